@@ -0,0 +1,56 @@
+#include <process.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <system.h>
+
+// Number of timed round trips per path, after a few untimed warm-up calls
+#define NB_ITERATIONS 100000
+#define NB_WARMUP 1000
+
+// Defined in stdlib's asm/syscall.s
+extern int64_t syscall(uint64_t nr, ...);
+extern int64_t syscall_int80(uint64_t nr, ...);
+
+typedef int64_t (*syscall_fn_t)(uint64_t nr, ...);
+
+// Read the full 64-bit TSC. lfence keeps rdtsc from running ahead of the
+// previous system call.
+static inline uint64_t rdtsc() {
+  uint32_t low, high;
+  __asm__ volatile("lfence; rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Time NB_ITERATIONS calls to getpid through one entry path.
+ * \param name Name of the path, printed with the result.
+ * \param fn Wrapper entering the kernel through the path.
+ */
+void bench(const char* name, syscall_fn_t fn) {
+  for (int64_t i = 0; i < NB_WARMUP; i++) fn(SYSCALL_GETPID);
+
+  uint64_t total = 0;
+  uint64_t min = UINT64_MAX;
+  for (int64_t i = 0; i < NB_ITERATIONS; i++) {
+    uint64_t start = rdtsc();
+    fn(SYSCALL_GETPID);
+    uint64_t cycles = rdtsc() - start;
+    total += cycles;
+    if (cycles < min) min = cycles;
+  }
+  printf("%s: avg %d cycles, min %d cycles per call\n", name,
+         total / NB_ITERATIONS, min);
+}
+
+void _start() {
+  printf("Round trip of getpid over %d calls\n", NB_ITERATIONS);
+  bench("syscall  ", syscall);
+  bench("int 0x80 ", syscall_int80);
+  exit();
+
+  // Loop forever
+  for (;;) {
+  }
+}
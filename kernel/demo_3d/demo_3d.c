@@ -1,15 +1,16 @@
 #include <graphic.h>
 #include <mem.h>
 #include <process.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <system.h>
-#include <time.h>
 
-#define DRAW_TIME 1000000
-#define INPUT_TIME 100000
+// One frame per period at 60 Hz, with up to 10 ms of CPU time per frame
+#define FRAME_PERIOD_NS 16666667
+#define FRAME_BUDGET_NS 10000000
 #define MOVE_SPEED 5
 #define SCALE_INC 1
 
@@ -104,24 +105,22 @@ void _start() {
   // Draw the cube for the first time;
   obj3d_o(&cube, true, true, false, false, &window);
   graphic_draw(&window, true);
+  graphic_present();
 
-  // Repeat drawing after a certain number of ticks. The program also get input
-  // from keyboard.
-  uint64_t prev_draw_time = 0;
-  uint64_t prev_input_time = 0;
+  // Draw one frame per period. The scheduler wakes us at the start of each
+  // period, so we do not spin between frames.
+  sched_setdeadline(0, FRAME_PERIOD_NS, FRAME_BUDGET_NS);
   bool fill = false;
   bool rotate = false;
   while (true) {
-    if (get_time() - prev_draw_time > DRAW_TIME) {
-      if (rotate) cube.rot_angle += 1;
-      obj3d_o(&cube, true, true, true, fill, &window);
-      graphic_draw(&window, true);
-      prev_draw_time = get_time();
-    }
+    if (rotate) cube.rot_angle += 1;
+    obj3d_o(&cube, true, true, true, fill, &window);
+    graphic_draw(&window, true);
+    graphic_flip();
 
     // Use the keyboard input to control the cube location on xy-plane
-    if (get_time() - prev_input_time > INPUT_TIME) {
-      char c = peekc();
+    char c;
+    while ((c = peekc()) != '\0') {
       switch (c) {
         case 'a':
           cube.dx -= MOVE_SPEED;
@@ -156,8 +155,9 @@ void _start() {
         default:
           break;
       }
-      prev_input_time = get_time();
     }
+
+    sched_wait_period();
   }
 
   exit();
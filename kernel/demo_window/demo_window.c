@@ -1,69 +1,97 @@
 #include <graphic.h>
+#include <input.h>
 #include <mem.h>
 #include <process.h>
+#include <ring.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
-#define DRAW_TIME 100000000
-#define INPUT_TIME 100000
+// One frame every 33 ms (30 Hz)
+#define FRAME_PERIOD_NS 33333333
 #define MOVE_SPEED 10
 
-window_t window;
+// Two overlapping windows; WASD moves the focused one
+window_t windows[2];
+window_t* focus = &windows[0];
+// Queue of the system calls of one frame
+syscall_ring_t ring;
 int32_t window_w = 640;
 int32_t window_h = 360;
 
 // Draw a mock-up of a macOS window
-void draw_window() {
-  rec2d_wh(0, window_h - 1, window_w, 20, ARGB32_GRAY, true, &window);
-  rec2d_wh(5, window_h - 5, 10, 10, ARGB32_LIGHT_RED, true, &window);
-  rec2d_wh(20, window_h - 5, 10, 10, ARGB32_YELLOW, true, &window);
-  rec2d_wh(35, window_h - 5, 10, 10, ARGB32_LIGHT_GREEN, true, &window);
+void draw_window(window_t* window) {
+  int32_t w = window->width;
+  int32_t h = window->height;
+  rec2d_wh(0, h - 1, w, 20, ARGB32_GRAY, true, window);
+  rec2d_wh(5, h - 5, 10, 10, ARGB32_LIGHT_RED, true, window);
+  rec2d_wh(20, h - 5, 10, 10, ARGB32_YELLOW, true, window);
+  rec2d_wh(35, h - 5, 10, 10, ARGB32_LIGHT_GREEN, true, window);
 }
 
 void _start() {
-  // Init window for user program and draw the mock-up
-  window_init(&window, window_w, window_h, 0, 0, ARGB32_LIGHT_BLUE);
-  draw_window();
+  // Init the windows and draw the mock-ups. Both are handed to the kernel's
+  // compositor, which keeps them stacked and redraws what a move uncovers.
+  graphic_clear_screen();
+  window_init(&windows[0], window_w, window_h, 0, 0, ARGB32_LIGHT_BLUE);
+  window_init(&windows[1], window_w / 2, window_h / 2, window_w / 2,
+              window_h / 2, ARGB32_WHITE);
+  for (int i = 0; i < 2; i++) {
+    draw_window(&windows[i]);
+    window_attach(&windows[i]);
+  }
+  window_raise(focus);
 
-  // Repeat drawing after a certain number of ticks. 
-  // The program also get input from keyboard.
-  uint64_t prev_draw_time = 0;
-  uint64_t prev_input_time = 0;
+  // Each frame is drawn and slept through with one system call: the draw of
+  // the focused window, the page flip and the sleep until the next frame are
+  // queued on a ring and run by ring_enter(). Only what changed is composed
+  // into the kernel's back buffer, so the screen does not flicker and needs no
+  // clear. The keyboard is read from the shared event ring. The wake-up time
+  // is absolute so the frame rate does not drift.
+  ring_init(&ring);
+  input_flush();
+  uint64_t next_frame = clock_ns();
   while (true) {
-    if (get_time() - prev_draw_time > DRAW_TIME) {
-      // Draw something
-      graphic_clear_screen();
-      graphic_draw(&window, false);
-      prev_draw_time = get_time();
+    next_frame += FRAME_PERIOD_NS;
+    ring_prep_draw(&ring, focus, 0);
+    ring_prep_flip(&ring, 0);
+    ring_prep_sleep(&ring, TIMER_ABSTIME, next_frame, 0);
+    ring_enter(&ring);
+    ring_cqe_t cqe;
+    while (ring_get_cqe(&ring, &cqe)) {
     }
 
-    // Use the keyboard input to control the cube location on xy-plane
-    if (get_time() - prev_input_time > INPUT_TIME) {
-      char c = peekc();
-      switch (c) {
-        case 'a':   // Move the window to the left
-          window.screen_x -= MOVE_SPEED;
+    // Use the keyboard input to control the window location on the screen
+    key_event_t event;
+    while (input_poll(&event)) {
+      if (!event.pressed) continue;
+      switch (event.key) {
+        case KEY_A:   // Move the window to the left
+          focus->screen_x -= MOVE_SPEED;
+          break;
+        case KEY_D:   // Move the window to the right
+          focus->screen_x += MOVE_SPEED;
           break;
-        case 'd':   // Move the window to the right
-          window.screen_x += MOVE_SPEED;
+        case KEY_W:   // The y axis of the screen is flipped; origin at top left
+          focus->screen_y -= MOVE_SPEED;
           break;
-        case 'w':   // The y axis of the screen is flipped; origin at top left
-          window.screen_y -= MOVE_SPEED;
+        case KEY_S:
+          focus->screen_y += MOVE_SPEED;
           break;
-        case 's':
-          window.screen_y += MOVE_SPEED;
+        case KEY_F:   // Flipt the window upside down
+          focus->flip = !focus->flip;
           break;
-        case 'f':   // Flipt the window upside down
-          window.flip = !window.flip;
+        case KEY_TAB:   // Focus the other window and bring it to the front
+          focus = focus == &windows[0] ? &windows[1] : &windows[0];
+          window_raise(focus);
           break;
-        case 'q':   // Exit and return to shell
+        case KEY_Q:   // Exit and return to shell
           exit();
         default:
           break;
       }
-      prev_input_time = get_time();
     }
   }
 
@@ -0,0 +1,47 @@
+.global context_switch
+.global kthread_trampoline
+.global sched_finish_switch
+.global kthread_exit
+
+# Switch from the current task to another one.
+# Arguments are:
+#  pointer where the current stack pointer is saved (in %rdi)
+#  stack pointer of the next task (in %rsi)
+# Only the callee-saved registers need saving; the caller of context_switch
+# has already spilled everything else.
+context_switch:
+  push %rbp
+  push %rbx
+  push %r12
+  push %r13
+  push %r14
+  push %r15
+
+  # Save our stack pointer and load the next task's
+  mov %rsp, (%rdi)
+  mov %rsi, %rsp
+
+  pop %r15
+  pop %r14
+  pop %r13
+  pop %r12
+  pop %rbx
+  pop %rbp
+
+  # Return into the next task (or into kthread_trampoline for a new thread)
+  retq
+
+# First code run by a new kernel thread. The initial stack prepared by
+# kthread_init_stack() holds the function in %r12 and its argument in %r13.
+kthread_trampoline:
+  call sched_finish_switch
+
+  # schedule() switched to us with interrupts disabled
+  sti
+
+  mov %r13, %rdi
+  and $-16, %rsp
+  call *%r12
+
+  # The thread function returned
+  call kthread_exit
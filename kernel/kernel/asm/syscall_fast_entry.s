@@ -0,0 +1,43 @@
+.global syscall_fast_entry
+.global syscall_handler
+
+# Offsets into cpu_t (see ksched.h)
+.set CPU_KSTACK_TOP, 0x8
+.set CPU_USER_RSP, 0x10
+
+# This is the entry point of the SYSCALL instruction (programmed in LSTAR).
+# The CPU saved the user %rip in %rcx and %rflags in %r11, and cleared IF, but
+# we are still on the user stack. Arguments follow the int 0x80 convention,
+# except that arg2 arrives in %r10 since %rcx is taken.
+syscall_fast_entry:
+  # Switch to the kernel stack of the current task. KERNEL_GS_BASE points at
+  # this CPU's cpu_t; user mode never sees it since we swap straight back.
+  swapgs
+  mov %rsp, %gs:CPU_USER_RSP
+  mov %gs:CPU_KSTACK_TOP, %rsp
+  pushq %gs:CPU_USER_RSP
+  swapgs
+
+  # Save the user return address and flags
+  push %rcx
+  push %r11
+
+  # Handlers run with interrupts enabled, as with the int 0x80 trap gate
+  sti
+
+  # Restore arg2 and put the sixth syscall argument on the stack
+  mov %r10, %rcx
+  push %rax
+
+  # Call the C-land syscall handler. The return value is in %rax.
+  call syscall_handler
+  add $0x8, %rsp
+
+  # No interrupt may arrive once we are back on the user stack
+  cli
+  pop %r11
+  pop %rcx
+  pop %rsp
+
+  # Return to user mode
+  sysretq
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kprint.h"
+#include "stivale2.h"
+#include "util.h"
+
+// Root System Description Pointer (ACPI 2.0 layout, the first 20 bytes are
+// the ACPI 1.0 one)
+typedef struct acpi_rsdp {
+  char signature[8];
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt_addr;
+  uint32_t length;
+  uint64_t xsdt_addr;
+  uint8_t ext_checksum;
+  uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+// Header shared by every system description table
+typedef struct acpi_sdt_hdr {
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_hdr_t;
+
+/******************************************************************************/
+// Multiple APIC Description Table ("APIC")
+typedef struct acpi_madt {
+  acpi_sdt_hdr_t hdr;
+  uint32_t lapic_addr;
+  uint32_t flags;
+  uint8_t entries[];
+} __attribute__((packed)) acpi_madt_t;
+
+// Bit in acpi_madt_t.flags: the system also has dual 8259 PICs
+#define MADT_PCAT_COMPAT 0x1
+
+// Types of the MADT entries
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_ISO 2
+#define MADT_LAPIC_ADDR 5
+#define MADT_X2APIC 9
+
+typedef struct madt_entry_hdr {
+  uint8_t type;
+  uint8_t length;
+} __attribute__((packed)) madt_entry_hdr_t;
+
+typedef struct madt_ioapic {
+  madt_entry_hdr_t hdr;
+  uint8_t id;
+  uint8_t reserved;
+  uint32_t addr;
+  uint32_t gsi_base;
+} __attribute__((packed)) madt_ioapic_t;
+
+// Interrupt source override: ISA IRQ source is wired to GSI gsi
+typedef struct madt_iso {
+  madt_entry_hdr_t hdr;
+  uint8_t bus;
+  uint8_t source;
+  uint32_t gsi;
+  uint16_t flags;
+} __attribute__((packed)) madt_iso_t;
+
+// Polarity (bits 0-1) and trigger mode (bits 2-3) in madt_iso_t.flags
+#define MADT_ISO_POLARITY_MASK 0x3
+#define MADT_ISO_ACTIVE_LOW 0x3
+#define MADT_ISO_TRIGGER_MASK 0xC
+#define MADT_ISO_LEVEL 0xC
+
+typedef struct madt_lapic_addr {
+  madt_entry_hdr_t hdr;
+  uint16_t reserved;
+  uint64_t addr;
+} __attribute__((packed)) madt_lapic_addr_t;
+
+/**
+ * Locate the ACPI root table from the bootloader's RSDP tag. Must be called
+ * before acpi_find_table().
+ * \param rsdp_tag RSDP struct tag from the bootloader (may be NULL).
+ * \returns true if a valid RSDT or XSDT is found, else returns false.
+ */
+bool acpi_init(struct stivale2_struct_tag_rsdp* rsdp_tag);
+
+/**
+ * Find a system description table by signature.
+ * \param signature Four character signature, e.g. "APIC" for the MADT.
+ * \returns pointer to the table, or NULL if it does not exist or is corrupted.
+ */
+acpi_sdt_hdr_t* acpi_find_table(const char* signature);
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "acpi.h"
+#include "kprint.h"
+#include "page.h"
+#include "pic.h"
+#include "port.h"
+#include "spinlock.h"
+#include "stivale2.h"
+
+// IA32_APIC_BASE MSR: global enable (bit 11), x2APIC mode (bit 10) and the
+// physical base of the xAPIC registers
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+#define APIC_BASE_X2APIC (1 << 10)
+#define APIC_BASE_ADDR_MASK 0xFFFFFFFFFFFFF000
+// x2APIC registers are MSRs 0x800 + (xAPIC offset >> 4)
+#define MSR_X2APIC_BASE 0x800
+
+// Local APIC register offsets (xAPIC layout)
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_ESR 0x280
+#define LAPIC_ICR 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3E0
+#define LAPIC_REG_SIZE 0x400
+
+// Bits in the spurious vector register and the LVT entries
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+// Set in the ICR while an IPI is on its way (xAPIC only)
+#define LAPIC_ICR_PENDING (1 << 12)
+
+// Vectors owned by the local APIC
+#define APIC_SPURIOUS_VECTOR 0xFF
+#define APIC_ERROR_VECTOR 0xFE
+
+// IO-APIC registers: select a register with IOREGSEL, access it with IOWIN
+#define IOAPIC_IOREGSEL 0x00
+#define IOAPIC_IOWIN 0x10
+#define IOAPIC_REG_VER 0x01
+#define IOAPIC_REG_REDTBL 0x10
+#define IOAPIC_REG_SIZE 0x20
+
+// Bits in the low half of a redirection entry
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define MAX_NB_IOAPIC 4
+#define NB_ISA_IRQ 16
+
+typedef struct ioapic {
+  volatile uint32_t* regs;
+  uint8_t id;
+  uint32_t gsi_base;
+  uint32_t nb_gsi;
+} ioapic_t;
+
+/**
+ * Bring up the local APIC of the boot CPU (in x2APIC mode when CPUID reports
+ * it) and the IO-APICs described by the ACPI MADT, then mask the 8259 PICs.
+ * Until this succeeds, IRQs keep going through the 8259. Call after
+ * init_free_list() and pic_init().
+ * \param rsdp_tag RSDP struct tag from the bootloader (may be NULL).
+ * \returns true if the APICs handle interrupts, else returns false.
+ */
+bool apic_init(struct stivale2_struct_tag_rsdp* rsdp_tag);
+
+/**
+ * Enable the local APIC of the calling CPU. Called by apic_init() on the boot
+ * CPU; other CPUs call it when they come online.
+ */
+void lapic_init();
+
+/**
+ * Read a local APIC register.
+ * \param reg Register offset in the xAPIC layout (LAPIC_*).
+ * \returns the register value.
+ */
+uint32_t lapic_read(uint32_t reg);
+
+/**
+ * Write a local APIC register.
+ * \param reg Register offset in the xAPIC layout (LAPIC_*).
+ * \param value The value to write.
+ */
+void lapic_write(uint32_t reg, uint32_t value);
+
+/**
+ * APIC ID of the calling CPU.
+ */
+uint32_t lapic_id();
+
+/**
+ * Signal the end of an interrupt to the local APIC. In x2APIC mode this is a
+ * single MSR write.
+ */
+void lapic_eoi();
+
+/**
+ * Send a fixed interrupt to another CPU.
+ * \param lapic_id APIC ID of the destination CPU.
+ * \param vector Interrupt vector delivered to it.
+ */
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+
+/**
+ * Whether the local APIC runs in x2APIC mode.
+ */
+bool apic_x2apic();
+
+/**
+ * Whether interrupts are delivered by the APICs (otherwise by the 8259).
+ */
+bool apic_enabled();
+
+/******************************************************************************/
+/**
+ * Route an ISA IRQ to a CPU and unmask it. Falls back to the 8259 if the
+ * APICs are not enabled.
+ * \param irq ISA IRQ number (0-15).
+ * \param vector Interrupt vector delivered to the CPU.
+ * \param lapic_id APIC ID of the destination CPU.
+ * \returns true if the IRQ is routed, else returns false.
+ */
+bool irq_route(uint8_t irq, uint8_t vector, uint32_t lapic_id);
+
+/**
+ * Unmask an ISA IRQ, delivered to the boot CPU at vector IRQ0_INTERRUPT + irq.
+ * \param irq ISA IRQ number (0-15).
+ */
+void irq_unmask(uint8_t irq);
+
+/**
+ * Mask an ISA IRQ.
+ * \param irq ISA IRQ number (0-15).
+ */
+void irq_mask(uint8_t irq);
+
+/**
+ * Acknowledge an IRQ to whichever controller delivered it.
+ * \param irq ISA IRQ number (0-15).
+ */
+void irq_eoi(uint8_t irq);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <graphic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kgraphic.h"
+
+// Number of windows the compositor can stack
+#define MAX_NB_SURFACE 16
+
+// A window attached to the compositor. The pixels stay in the owner's memory;
+// the geometry is the one last composed, so a move knows what it uncovers.
+typedef struct surface {
+  bool used;
+  int64_t pid;        // Owner
+  window_t* window;   // The owner's window_t, read on every commit
+  pixel_t* addr;
+  int32_t x;          // Top-left corner on the screen
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  bool flip;
+} surface_t;
+
+/******************************************************************************/
+/**
+ * Put a window on top of the stack and compose it.
+ * \param pid Pid of the owner.
+ * \param window The window, in the owner's memory.
+ * \returns the surface id, or -1 if the compositor is full.
+ */
+int32_t compositor_attach(int64_t pid, window_t* window);
+
+/**
+ * Take a window off the stack. What it covered is composed again.
+ * \param pid Pid of the owner.
+ * \param id Surface id returned by compositor_attach().
+ * \returns true if the surface is removed, else returns false.
+ */
+bool compositor_detach(int64_t pid, int32_t id);
+
+/**
+ * Take every window of a process off the stack, e.g. when it exits.
+ * \param pid Pid of the owner.
+ */
+void compositor_detach_pid(int64_t pid);
+
+/**
+ * Move a window to the top of the stack and compose it.
+ * \param pid Pid of the owner.
+ * \param id Surface id returned by compositor_attach().
+ * \returns true if the surface is raised, else returns false.
+ */
+bool compositor_raise(int64_t pid, int32_t id);
+
+/**
+ * Compose the regions of a window that changed. If the window moved, flipped
+ * or was resized since the last commit, the area it left and the whole new
+ * area are composed instead.
+ * \param pid Pid of the owner.
+ * \param id Surface id returned by compositor_attach().
+ * \param rects Changed regions of the window buffer, or NULL for all of it.
+ * \param nb_rect Number of entries in rects.
+ * \returns true if the surface is composed, else returns false.
+ */
+bool compositor_commit(int64_t pid, int32_t id, const damage_rect_t* rects,
+                       int32_t nb_rect);
+
+/**
+ * Compose a region of the screen from the background and the windows over
+ * it, bottom to top, into the back buffer.
+ * \param x0,y0 Top-left corner, inclusive.
+ * \param x1,y1 Bottom-right corner, exclusive.
+ */
+void compositor_expose(int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+
+/**
+ * Whether any window is attached.
+ */
+bool compositor_active();
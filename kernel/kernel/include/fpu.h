@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ksched.h"
+#include "port.h"
+
+// Bits in CR0 and CR4
+#define CR0_TS (1 << 3)
+#define CR4_OSXSAVE (1 << 18)
+
+// State components saved in XCR0
+#define XCR0_X87 0x1
+#define XCR0_SSE 0x2
+#define XCR0_AVX 0x4
+
+// Size of the legacy FXSAVE area, used when XSAVE is not available
+#define FXSAVE_SIZE 512
+// XSAVE and FXSAVE need a 64 and 16 byte aligned area respectively
+#define FPU_STATE_ALIGN 64
+
+// Default control words loaded into a task's first FPU state
+#define FPU_DEFAULT_FCW 0x37F
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+/**
+ * Detect XSAVE support, program XCR0 and size the per-task save area. Call
+ * after SSE is enabled and before any task is created. CR0.TS is set so the
+ * first FPU instruction of every task traps into fpu_handle_nm().
+ */
+void fpu_init();
+
+/**
+ * Give an application processor the FPU setup fpu_init() chose on the boot
+ * CPU. Call on that CPU once it is started.
+ */
+void fpu_init_cpu();
+
+/**
+ * Size in bytes of the FPU state saved for each task.
+ */
+size_t fpu_state_size();
+
+/**
+ * Update CR0.TS when switching tasks on the current CPU. Registers are left
+ * untouched: a task that did not use the FPU never pays for a save or restore.
+ * \param cpu The current CPU.
+ * \param prev The task being switched out.
+ * \param next The task being switched in.
+ */
+void fpu_switch(cpu_t* cpu, task_t* prev, task_t* next);
+
+/**
+ * Handle the #NM (device not available) fault raised by the first FPU/SSE
+ * instruction after a switch: save the registers of the previous owner and
+ * load the current task's state.
+ */
+void fpu_handle_nm();
+
+/**
+ * Forget the FPU state of a task that exits.
+ * \param task The exiting task.
+ */
+void fpu_task_exit(task_t* task);
+
+/**
+ * Allow kernel code to use SSE/AVX registers. The registers of the task that
+ * owns them are saved first. Must not sleep before fpu_kernel_end().
+ * \returns false before fpu_init() or inside another kernel FPU section (an
+ * interrupt handler that landed in one), in which case the caller must stick
+ * to the general registers and not call fpu_kernel_end().
+ */
+bool fpu_kernel_begin();
+
+/**
+ * End a kernel FPU section started by fpu_kernel_begin().
+ */
+void fpu_kernel_end();
@@ -4,15 +4,39 @@
  * https://curtsinger.cs.grinnell.edu/teaching/2022S/CSC395/kernel/usermode.html
  */
 #pragma once
+#include <stdint.h>
+#include <system.h>
+
 #include "util.h"
 #include "kmem.h"
 
-// Define the offsets into the GDT where we'll place important descriptors
+// Define the offsets into the GDT where we'll place important descriptors.
+// SYSRET loads SS from STAR[63:48] + 8 and CS from STAR[63:48] + 16, so the
+// user data descriptor has to sit right before the user code descriptor.
 #define KERNEL_CODE_SELECTOR 0x08
 #define KERNEL_DATA_SELECTOR 0x10
-#define USER_CODE_SELECTOR 0x18
-#define USER_DATA_SELECTOR 0x20
+#define USER_DATA_SELECTOR 0x18
+#define USER_CODE_SELECTOR 0x20
 #define TSS_SELECTOR 0x28
 
-// Set up and load the GDT
+// Each CPU has its own TSS. In long mode a TSS descriptor takes 16 bytes.
+#define TSS_SELECTOR_CPU(cpu) (TSS_SELECTOR + 16 * (cpu))
+
+// Set up the GDT and load it on the boot CPU, which is CPU 0
 void gdt_setup();
+
+/**
+ * Load the GDT on the calling CPU, reload its segment registers (the
+ * bootloader's selectors point elsewhere in our GDT) and load its TSS.
+ * \param cpu Index of the calling CPU.
+ * \param rsp0 Stack pointer loaded when an interrupt arrives from user mode.
+ */
+void gdt_load_cpu(int32_t cpu, uintptr_t rsp0);
+
+/**
+ * Set the stack pointer loaded by the CPU when an interrupt or system call
+ * arrives from user mode.
+ * \param cpu Index of the calling CPU.
+ * \param rsp0 Top of the kernel stack of the current task.
+ */
+void gdt_set_kernel_stack(int32_t cpu, uintptr_t rsp0);
\ No newline at end of file
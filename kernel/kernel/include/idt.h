@@ -19,6 +19,9 @@
 // Number of IDT entries
 #define IDT_NUM_ENTRIES 256
 
+// Page fault error code bit set when the fault happened in user mode
+#define PF_EC_USER 0x4
+
 // A struct the matches the layout of an IDT entry
 typedef struct idt_entry {
   uint16_t offset_0;
@@ -63,3 +66,8 @@ void idt_set_handler(uint8_t index, void* fn, uint8_t type);
  * exceptions, and install the IDT.
  */
 void idt_setup();
+
+/**
+ * Install the IDT on the calling CPU. idt_setup() does it for the boot CPU.
+ */
+void idt_load();
@@ -1,8 +1,16 @@
 #pragma once
 
+#include <input.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "spinlock.h"
+
+// Prefix of the extended scan codes and the release bit of a scan code
+#define EXTENDED_SS 0xE0
+#define RELEASE_SS_MASK 0x80
+
 // ESC key
 #define ESC_DOWN_SS 0x01
 #define ESC_UP_SS 0x81
@@ -40,6 +48,9 @@
 #define CAPSLOCK_ON_MASK 0x00010000
 
 #define KEYBOARD_BUFFER_SIZE 1024
+// Scan codes the interrupt handler can hold before they are processed
+#define KEYBOARD_RAW_SIZE 64
+#define KEYBOARD_RAW_MASK (KEYBOARD_RAW_SIZE - 1)
 
 /******************************************************************************/
 // CIRCULAR_QUEUE for KEYBOARD
@@ -48,6 +59,9 @@ typedef struct circular_queue {
   int write;
   int size;
   uint64_t buffer[KEYBOARD_BUFFER_SIZE];
+  // Keys are written on the CPU taking the keyboard interrupt and read on the
+  // CPU running the program
+  spinlock_t lock;
 } circular_queue_t;
 
 /**
@@ -100,6 +114,17 @@ typedef struct keyboard {
   uint32_t ctrl;
   uint32_t shift;
   uint32_t capslock;
+  // Event ring shared with user programs (NULL until kb_map_ring()) and
+  // whether the last byte was the EXTENDED_SS prefix
+  key_ring_t* ring;
+  uintptr_t ring_page;  // Physical address of the ring, 0 until allocated
+  bool extended;
+  // Scan codes and their arrival time, pushed by the interrupt handler and
+  // processed later by kb_process_raw()
+  uint8_t raw_code[KEYBOARD_RAW_SIZE];
+  uint64_t raw_tsc[KEYBOARD_RAW_SIZE];
+  volatile uint32_t raw_head;
+  volatile uint32_t raw_tail;
 } keyboard_t;
 
 /**
@@ -112,6 +137,16 @@ typedef struct keyboard {
  */
 void kb_init(keyboard_t *kb);
 
+/**
+ * Map the keyboard event ring read-only at USER_KEYBOARD, so user programs can
+ * poll keys without a system call (see input.h). The ring is allocated on the
+ * first call. Loading an executable unmaps the lower half, so run_exe() maps
+ * the ring again for each program.
+ * \param kb Pointer to keyboard object.
+ * \returns true if the ring is mapped, else returns false.
+ */
+bool kb_map_ring(keyboard_t *kb);
+
 /**
  * This function is called by the keyboard interrupt handler in idt.h. The scan
  * code being passed to the keyboard to be processed accordingly. We record
@@ -121,10 +156,33 @@ void kb_init(keyboard_t *kb);
  * We also do not record to the buffer scancode >= CAPSLOCK_DOWN_SS, which is
  * the limit between printable characters and non-printable characters.
  *
+ * Every press and release, including non-printable keys, is also written to
+ * the event ring, together with the key-down bitmap.
+ *
+ * \param kb Pointer to keyboard object.
+ * \param val Value of the scan code.
+ * \param tsc TSC when the scan code arrived.
+ */
+void kb_input_scan_code(keyboard_t *kb, uint64_t val, uint64_t tsc);
+
+/**
+ * Save a scan code read by the interrupt handler. The slow part of the work
+ * is left to kb_process_raw(). If the raw buffer is full, the scan code is
+ * dropped.
  * \param kb Pointer to keyboard object.
  * \param val Value of the scan code.
+ * \param tsc TSC when the scan code arrived.
+ * \returns true if the scan code is saved, else returns false.
+ */
+bool kb_push_raw(keyboard_t *kb, uint8_t val, uint64_t tsc);
+
+/**
+ * Feed the saved scan codes to kb_input_scan_code(). Runs outside of the
+ * interrupt handler, with interrupts enabled.
+ * \param kb Pointer to keyboard object.
+ * \returns the number of scan codes processed.
  */
-void kb_input_scan_code(keyboard_t *kb, uint64_t val);
+size_t kb_process_raw(keyboard_t *kb);
 
 /**
  * Read one scan code off the buffer and convert to character. If the key is not
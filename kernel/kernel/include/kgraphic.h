@@ -4,11 +4,28 @@
 #include <stdint.h>
 #include <system.h>
 
+#include "kmem.h"
+#include "page.h"
 #include "stivale2.h"
+#include "vbe.h"
+
+// Framebuffer layouts with a blitter of their own. The kernel draws in
+// XRGB8888 and converts rows to the framebuffer layout when it presents.
+typedef enum pixel_format {
+  PIXEL_FORMAT_XRGB8888,  // 32 bits, 8 bits per channel, red at bit 16
+  PIXEL_FORMAT_RGB888,    // 24 bits, same channels without the padding byte
+  PIXEL_FORMAT_RGB565,    // 16 bits, red at bit 11
+  PIXEL_FORMAT_MASKS,     // Anything else, from the masks in the tag
+} pixel_format_t;
+
+// Convert a row of nb_pixel XRGB8888 pixels to the framebuffer layout at dst
+typedef void (*kgraphic_blit_t)(uint8_t* dst, const pixel_t* src,
+                                int32_t nb_pixel);
 
 /**
  * Read the framebuffer struct tag to gain information about the current
- * framebuffer. The function also initialize psf font. 
+ * framebuffer and pick the blitter of its layout. The function also initialize
+ * psf font. 
  * \returns true if init successfully else returns false.
  */
 bool kgraphic_init();
@@ -16,4 +33,84 @@ bool kgraphic_init();
 /**
  * Set the framebuffer value to 0
  */ 
-void kgraphic_clear_buffer();
\ No newline at end of file
+void kgraphic_clear_buffer();
+
+/**
+ * Move the kernel's framebuffer mapping to write-combining pages, and report
+ * how many TSC cycles a full-screen write takes before and after. Call after
+ * init_free_list().
+ * \returns true if the framebuffer is write-combining, else returns false.
+ */
+bool kgraphic_write_combine();
+
+/**
+ * Move drawing to a back buffer in RAM. Clears, window copies and text then
+ * only reach the screen when kgraphic_present() copies the changed spans.
+ * What is on screen is kept. Call after kgraphic_write_combine().
+ * \returns true if the back buffer is in use, else returns false.
+ */
+bool kgraphic_back_buffer_init();
+
+/**
+ * Record that a rectangle of the back buffer changed. Parts outside the screen
+ * are ignored.
+ * \param x,y Top-left corner in pixels.
+ * \param width,height Size in pixels.
+ */
+void kgraphic_mark_dirty(int32_t x, int32_t y, int32_t width, int32_t height);
+
+/**
+ * Copy the changed spans of the back buffer to the screen in one pass,
+ * converted to its layout, and mark everything clean. Does nothing without a
+ * back buffer, since drawing then goes to the screen directly.
+ * \returns the number of bytes written to the framebuffer.
+ */
+uint64_t kgraphic_present();
+
+/**
+ * Set up page flipping on a Bochs VBE display: the framebuffer gets a second
+ * page below the visible one, and kgraphic_flip() draws the next frame there
+ * and shows it with one register write. Call after kgraphic_back_buffer_init().
+ * \returns true if pages can be flipped, else returns false.
+ */
+bool kgraphic_page_flip_init();
+
+/**
+ * Draw what changed since the last frame to the hidden page and show it.
+ * Without page flipping, the changes are copied to the screen as by
+ * kgraphic_present().
+ * \returns the number of bytes written to the framebuffer.
+ */
+uint64_t kgraphic_flip();
+
+/**
+ * Map the framebuffer at USER_SCANOUT so a process can draw to the screen
+ * without a copy. The process owns the screen until it releases it; the
+ * framebuffer system calls of other processes fail meanwhile.
+ * \param pid Pid of the process.
+ * \returns USER_SCANOUT, or 0 if another process owns the framebuffer or the
+ * mapping fails.
+ */
+uintptr_t kgraphic_map_user(int64_t pid);
+
+/**
+ * Unmap the framebuffer from user space if pid owns it.
+ * \param pid Pid of the process.
+ * \returns true if pid owned the framebuffer, else returns false.
+ */
+bool kgraphic_unmap_user(int64_t pid);
+
+/**
+ * Give the framebuffer back if pid owns it, without touching the mapping, e.g.
+ * once the lower half holding it is gone.
+ * \param pid Pid of the process.
+ * \returns true if pid owned the framebuffer, else returns false.
+ */
+bool kgraphic_release_user(int64_t pid);
+
+/**
+ * Whether a process may draw with the framebuffer system calls, i.e. no other
+ * process owns the framebuffer.
+ * \param pid Pid of the process.
+ */
+bool kgraphic_may_draw(int64_t pid);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <latency.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kmem.h"
+#include "kprint.h"
+#include "ksched.h"
+#include "ktime.h"
+#include "port.h"
+#include "spinlock.h"
+
+#define LAT_NB_VECTOR 256
+
+// Latency histogram of one interrupt vector or system call on one CPU. Only
+// updated by its CPU, with interrupts disabled.
+typedef struct lat_hist {
+  uint64_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t sum_ns;
+  uint32_t buckets[LAT_NB_BUCKET];
+} lat_hist_t;
+
+/**
+ * Allocate the histograms of every CPU, including those smp_start() has not
+ * brought online yet. Until then nothing is recorded. Call after sched_init().
+ * \returns true if the histograms are allocated, else returns false.
+ */
+bool lat_init();
+
+/**
+ * Record the run of an interrupt handler on the calling CPU.
+ * \param vector Interrupt vector.
+ * \param start TSC read when the handler was entered.
+ */
+void lat_record_irq(uint8_t vector, uint64_t start);
+
+/**
+ * Record the run of a system call on the calling CPU.
+ * \param nr System call number.
+ * \param start TSC read when the system call was entered.
+ */
+void lat_record_syscall(uint64_t nr, uint64_t start);
+
+/**
+ * Copy every non-empty histogram into stats.
+ * \param stats Output array.
+ * \param max_stat Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t klatstat(lat_stat_t* stats, size_t max_stat);
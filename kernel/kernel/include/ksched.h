@@ -0,0 +1,340 @@
+#pragma once
+
+#include <process.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <system.h>
+
+#include "kmem.h"
+#include "kprint.h"
+#include "ktime.h"
+#include "port.h"
+#include "spinlock.h"
+#include "stivale2.h"
+#include "timer.h"
+
+// Number of slots in each per-CPU run queue. Must be a power of two and large
+// enough to hold every task, so a push by the owner never fails.
+#define RUNQUEUE_SIZE MAX_NB_PROCESS
+#define RUNQUEUE_MASK (RUNQUEUE_SIZE - 1)
+
+// Size of the kernel stack given to each task
+#define TASK_KSTACK_SIZE 0x4000
+#define TASK_NAME_LEN PROC_NAME_LEN
+
+#define MSR_KERNEL_GS_BASE 0xC0000102
+// MSR holding the value returned by rdtscp in %ecx. We store the CPU index.
+#define MSR_TSC_AUX 0xC0000103
+
+// IPI waking a halted CPU that was handed work (see cpu_kick())
+#define RESCHED_VECTOR 0xF1
+
+// MWAIT hint of the idle loop: C1, the same state as hlt. Deeper C-states are
+// left to the hypervisor or firmware.
+#define MWAIT_HINT_C1 0x0
+
+// Share of a CPU (in parts per million) that deadline tasks may reserve. The
+// rest is left for best-effort work.
+#define DL_BW_LIMIT 950000
+#define DL_BW_UNIT 1000000
+
+// Same values as the PROC_STATE_* reported to user space
+typedef enum task_state {
+  TASK_UNUSED = PROC_STATE_UNUSED,
+  TASK_RUNNABLE = PROC_STATE_RUNNABLE,
+  TASK_RUNNING = PROC_STATE_RUNNING,
+  TASK_BLOCKED = PROC_STATE_BLOCKED,
+  TASK_EXITED = PROC_STATE_EXITED
+} task_state_t;
+
+// Kernel entry function of a kernel thread
+typedef void (*kthread_fn_t)(void*);
+
+// Control block of a schedulable task (a user process or a kernel thread)
+typedef struct task {
+  int64_t pid;
+  char name[TASK_NAME_LEN];
+  task_state_t state;
+  bool user;             // Whether the task returns to user mode
+  cpu_mask_t affinity;   // CPUs the task is allowed to run on
+  int32_t cpu;           // CPU the task last ran on
+  volatile bool on_cpu;  // Set until the task's context is saved on switch
+  uintptr_t ksp;         // Saved kernel stack pointer while switched out
+  uintptr_t kstack;      // Base of the kernel stack
+  uintptr_t kstack_top;  // Initial kernel stack pointer (loaded in TSS.rsp0)
+  struct task* next;     // Link in a CPU's inbox or deadline lists
+
+  // Deadline class. Times are in TSC ticks.
+  int32_t sched_class;     // SCHED_NORMAL or SCHED_DEADLINE
+  int32_t dl_cpu;          // CPU holding the task's reserved bandwidth
+  uint64_t dl_bw;          // Reserved bandwidth in parts per million
+  uint64_t dl_period;      // Length of a period
+  uint64_t dl_budget;      // Run time allowed per period
+  uint64_t dl_release;     // Start of the current period
+  uint64_t dl_deadline;    // End of the current period
+  uint64_t dl_runtime;     // Run time used in the current period
+  uint64_t dl_exec_start;  // When the task was last switched in
+  uint64_t dl_nr_period;   // Periods completed
+  uint64_t dl_nr_missed;   // Periods finished after their deadline
+  uint64_t dl_nr_overrun;  // Periods that used more than the budget
+
+  // CPU accounting. Times are in TSC ticks.
+  bool acct_user;          // Whether the task is in user mode
+  uint64_t acct_last;      // When utime or stime was last charged
+  uint64_t utime;          // Time spent in user mode
+  uint64_t stime;          // Time spent in the kernel
+  uint64_t nr_switch;      // Times the task was switched out
+  uint64_t nr_page_fault;  // Page faults taken by the task
+
+  // FPU/SSE state, only allocated once the task executes an FPU instruction
+  void* fpu_state;  // XSAVE (or FXSAVE) area
+  bool fpu_used;    // Whether fpu_state holds a valid state
+  int32_t fpu_cpu;  // CPU whose registers hold the latest state, or -1
+
+  ktimer_t sleep_timer;  // Wakes the task from ksched_sleep_until()
+  struct waitq* waitq;   // Wait queue the task is blocked on, if any
+  struct task* wait_next;
+} task_t;
+
+/**
+ * Per-CPU run queue. The owner CPU pushes at tail and pops at head without
+ * taking a lock; idle CPUs steal from head with the same compare-and-swap the
+ * owner uses, so a task is handed out exactly once.
+ */
+typedef struct runqueue {
+  volatile uint64_t head;  // Next task to run. Updated with CAS.
+  volatile uint64_t tail;  // Next free slot. Only written by the owner.
+  task_t* volatile slots[RUNQUEUE_SIZE];
+  uint64_t nr_push;
+  uint64_t nr_pop;
+  uint64_t nr_stolen;
+} runqueue_t;
+
+// Scheduler state of a CPU
+typedef struct cpu {
+  // The first fields are read by the SYSCALL entry through %gs (see
+  // asm/syscall_fast_entry.s); keep their offsets in sync
+  struct cpu* self;
+  uintptr_t kstack_top;  // Kernel stack of the running task
+  uintptr_t user_rsp;    // Scratch slot for the user stack pointer
+  int32_t id;
+  uint32_t lapic_id;
+  bool online;
+  volatile bool need_resched;
+  task_t* current;
+  task_t* idle;
+  task_t* prev;       // Task switched out by the last context switch
+  bool requeue_prev;  // Queue prev again once its context is saved
+  runqueue_t rq;
+  // Tasks that other CPUs want to run here. Drained into rq by the owner.
+  spinlock_t inbox_lock;
+  task_t* inbox;
+  // Released deadline tasks ordered by deadline (EDF), and tasks waiting for
+  // their next period ordered by release time. Only touched by the owner.
+  task_t* dl_ready;
+  task_t* dl_wait;
+  uint64_t dl_bw;  // Bandwidth reserved by deadline tasks on this CPU
+  ktimer_t dl_timer;  // Wakes the idle task for the next deadline release
+  // Task whose FPU state is (or was last) loaded in this CPU's registers
+  task_t* fpu_owner;
+  bool fpu_ts;      // Current value of CR0.TS
+  bool fpu_kernel;  // Inside fpu_kernel_begin()/fpu_kernel_end()
+  uint64_t vm_gen;  // Page table generation the TLB was last flushed at
+  uint64_t rand_state;
+  uint64_t nr_steal;
+  uint64_t nr_steal_fail;
+  uint64_t nr_switch;
+} cpu_t;
+
+_Static_assert(offsetof(cpu_t, kstack_top) == 0x8, "kstack_top offset");
+_Static_assert(offsetof(cpu_t, user_rsp) == 0x10, "user_rsp offset");
+
+/******************************************************************************/
+/**
+ * Initialize the per-CPU scheduler state. CPUs are enumerated from the SMP
+ * struct tag; the bootstrap CPU becomes CPU 0 and is the only one online until
+ * smp_start(). The function creates the idle task of every CPU and a "boot"
+ * task that stands for the current context until the first user program
+ * starts.
+ * \param smp_tag SMP struct tag from the bootloader (may be NULL).
+ */
+void sched_init(struct stivale2_struct_tag_smp* smp_tag);
+
+/**
+ * Mark the calling application processor online and run its idle task. Called
+ * by ap_entry() once the CPU is set up. Does not return.
+ */
+void sched_cpu_online();
+
+/**
+ * Index of the CPU this code runs on. Once application processors are started
+ * every CPU holds its index in IA32_TSC_AUX, which RDTSCP reads.
+ * \returns the CPU index.
+ */
+int32_t cpu_current_id();
+
+/**
+ * Get the scheduler state of the CPU this code runs on.
+ * \returns pointer to the current CPU struct.
+ */
+cpu_t* this_cpu();
+
+/**
+ * Get the task currently running on this CPU.
+ * \returns pointer to the running task.
+ */
+task_t* task_current();
+
+/**
+ * Find a live task by pid.
+ * \param pid Pid of the task.
+ * \returns pointer to the task, or NULL if no live task has that pid.
+ */
+task_t* task_find(int64_t pid);
+
+/**
+ * Finish a context switch on the new task's stack: the previous task's context
+ * is saved, so it may now run elsewhere and is queued again if it was still
+ * runnable. Called by schedule() and by the kernel thread entry trampoline.
+ */
+void sched_finish_switch();
+
+/**
+ * Create the task for a freshly loaded user program and make it the current
+ * task of this CPU. The previous task is retired since its image has been
+ * replaced. The caller is expected to jump to user mode right after.
+ * \param name Name of the executable.
+ * \returns pointer to the new task, or NULL if no task slot is available.
+ */
+task_t* task_create_user(const char* name);
+
+/**
+ * Create a kernel thread and put it on a run queue.
+ * \param name Name of the thread.
+ * \param fn Function the thread runs.
+ * \param arg Argument passed to fn.
+ * \param affinity CPUs the thread may run on.
+ * \returns pointer to the new task, or NULL if it cannot be created.
+ */
+task_t* kthread_create(const char* name, kthread_fn_t fn, void* arg,
+                       cpu_mask_t affinity);
+
+/**
+ * Terminate the calling kernel thread. Does not return.
+ */
+void kthread_exit();
+
+/******************************************************************************/
+/**
+ * Make a task runnable and queue it on a CPU it is allowed to run on. The
+ * current CPU is preferred so the task stays cache-warm; an idle CPU is then
+ * kicked so it can steal the task.
+ * \param task The task to be queued.
+ */
+void sched_enqueue(task_t* task);
+
+/**
+ * Wake up a blocked task. Does nothing if the task is not blocked. A task that
+ * blocked on another CPU is queued once that CPU has saved its context.
+ * \param task The task to be woken up.
+ */
+void sched_wakeup(task_t* task);
+
+/**
+ * Pick the next task and switch to it. Released deadline tasks run first in
+ * earliest-deadline order, then best-effort tasks from the run queue, then a
+ * task stolen from another CPU. If the current task is still running it is
+ * queued again. A task that wants to sleep sets its state to TASK_BLOCKED
+ * before calling this function.
+ */
+void schedule();
+
+/**
+ * Give up the CPU to the next runnable task, if any.
+ */
+void sched_yield();
+
+/**
+ * Restrict a task to the given CPUs. If the task is running on a CPU that is
+ * no longer allowed, it is moved at the next reschedule.
+ * \param pid Pid of the task. 0 means the current task.
+ * \param mask Allowed CPUs. Must include at least one online CPU.
+ * \returns true if the affinity is changed, else returns false.
+ */
+bool ksched_setaffinity(int64_t pid, cpu_mask_t mask);
+
+/**
+ * Read the affinity of a task.
+ * \param pid Pid of the task. 0 means the current task.
+ * \returns the affinity mask, or 0 if no such task.
+ */
+cpu_mask_t ksched_getaffinity(int64_t pid);
+
+/**
+ * Copy the run queue counters of every CPU into stats.
+ * \param stats Output array.
+ * \param max_cpu Number of entries in stats.
+ * \returns the number of entries written.
+ */
+int64_t ksched_get_stat(runqueue_stat_t* stats, size_t max_cpu);
+
+/******************************************************************************/
+/**
+ * Move a task into the deadline class. Only the calling task may change its
+ * own class. The request is rejected if the bandwidth budget / period does not
+ * fit in what is left of the CPU.
+ * \param pid Pid of the task. 0 means the current task.
+ * \param period_ns Length of a period in nanoseconds. 0 moves the task back to
+ * the best-effort class.
+ * \param budget_ns Run time needed per period in nanoseconds.
+ * \returns true if the class is changed, else returns false.
+ */
+bool ksched_setdeadline(int64_t pid, uint64_t period_ns, uint64_t budget_ns);
+
+/**
+ * End the current period of the calling deadline task and sleep until the
+ * next one starts. Missed deadlines and budget overruns are counted here.
+ * \returns the number of deadlines missed so far, or -1 if the calling task is
+ * not in the deadline class.
+ */
+int64_t ksched_wait_period();
+
+/**
+ * Throttle the calling deadline task if it used up the budget of its period.
+ * The kernel does not preempt, so the budget is enforced here, before each
+ * return from a system call, and whenever the task calls schedule().
+ */
+void ksched_enforce_budget();
+
+/**
+ * Block the calling task until a given time. The CPU runs other tasks or
+ * halts meanwhile. Without timer interrupts the task yields until the time
+ * has passed.
+ * \param deadline Time to wake up at, in ns since boot (see ktime_ns()).
+ * \returns 0 once the time has passed.
+ */
+int64_t ksched_sleep_until(uint64_t deadline);
+
+/******************************************************************************/
+/**
+ * Charge the time since the last transition to the current task's user time
+ * and mark it as running in the kernel. Called when a system call or an
+ * interrupt arrives from user mode.
+ */
+void acct_enter_kernel();
+
+/**
+ * Charge the time since the last transition to the current task's system time.
+ * Called right before returning to user mode.
+ */
+void acct_exit_kernel();
+
+/**
+ * Copy the statistics of every task that is or was alive into stats.
+ * \param stats Output array.
+ * \param max_proc Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t ksched_procstat(proc_stat_t* stats, size_t max_proc);
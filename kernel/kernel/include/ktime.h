@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <system.h>
+#include <time.h>
+
+#include "kprint.h"
+#include "port.h"
+
+// Ports of the PIT (8253/8254)
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+// Port controlling the PIT channel 2 gate (bit 0) and reporting its output
+// (bit 5)
+#define PIT_CH2_GATE_PORT 0x61
+
+// Input clock of the PIT
+#define PIT_FREQ_HZ 1193182
+#define NS_PER_MS 1000000ULL
+
+/**
+ * Calibrate the TSC against PIT channel 2. Must be called before any other
+ * function in this file. If the PIT does not respond, a 1 GHz TSC is assumed.
+ * \returns true if calibration succeeds, else returns false.
+ */
+bool ktime_init();
+
+/**
+ * Publish the TSC scale factors in a read-only page mapped at USER_VDSO, so
+ * user programs can read the time without a system call (see clock_ns() in
+ * the stdlib). Called by ktime_init().
+ * \returns true if the page is mapped, else returns false.
+ */
+bool vdso_init();
+
+/**
+ * Map the time page at USER_VDSO. Loading an executable unmaps the lower half,
+ * so run_exe() maps the page again for each program.
+ * \returns true if the page is mapped, else returns false.
+ */
+bool vdso_map();
+
+/**
+ * Frequency of the TSC measured at boot.
+ * \returns the TSC frequency in kHz.
+ */
+uint64_t tsc_khz();
+
+/**
+ * Convert a TSC delta to nanoseconds.
+ * \param tsc Number of TSC ticks.
+ * \returns the duration in nanoseconds.
+ */
+uint64_t tsc_to_ns(uint64_t tsc);
+
+/**
+ * Convert nanoseconds to a TSC delta.
+ * \param ns Duration in nanoseconds.
+ * \returns the number of TSC ticks.
+ */
+uint64_t ns_to_tsc(uint64_t ns);
+
+/**
+ * Nanoseconds elapsed since ktime_init().
+ * \returns the current time in nanoseconds.
+ */
+uint64_t ktime_ns();
+
+/**
+ * Time of an absolute TSC value.
+ * \param tsc A TSC value read on this machine.
+ * \returns the time in nanoseconds since ktime_init().
+ */
+uint64_t ktime_from_tsc(uint64_t tsc);
+
+/**
+ * TSC value at a given time.
+ * \param ns Time in nanoseconds since ktime_init().
+ * \returns the TSC value at that time.
+ */
+uint64_t ktime_to_tsc(uint64_t ns);
@@ -9,6 +9,16 @@
 #include "stivale2.h"
 #include "util.h"
 
+// IA32_PAT MSR: eight memory types, selected by the PAT, PCD and PWT bits of
+// a page table entry (index = PAT << 2 | PCD << 1 | PWT). pat_init() keeps
+// the power-on layout except entry 1 (PWT only), which becomes
+// write-combining instead of write-through.
+#define MSR_PAT 0x277
+// Entries 0-7: WB, WC, UC-, UC, WB, WT, UC-, UC
+#define PAT_LAYOUT 0x0007040600070106ULL
+// CPUID.1:EDX bit reporting the PAT
+#define CPUID_1_EDX_PAT (1 << 16)
+
 // CR3 for Ordinary 4-level mapping with CR4.PCIDE = 0
 // Notice that PCIDE is the bit 17 of CR4
 typedef struct REG_CR3_CR4_PCIDE0 {
@@ -185,6 +195,15 @@ void pmem_free(uintptr_t p);
 inline void vmem_free(uintptr_t v);
 
 /******************************************************************************/
+/**
+ * Find the page table entry of a virtual address, allocating the missing
+ * intermediate tables. The caller holds vm_lock.
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address.
+ * \returns pointer to the page table entry, or NULL on error.
+ */
+pt_4kb_entry_t* vm_walk(uintptr_t proot, uintptr_t vaddress);
+
 /**
  * Map a single page of memory into a virtual address space.
  * \param root The physical address of the top-level page table structure.
@@ -197,6 +216,71 @@ inline void vmem_free(uintptr_t v);
 bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
             bool executable);
 
+/**
+ * Map a virtual page to a given physical page, e.g. a page shared between the
+ * kernel and every process. The physical page is not owned by the mapping:
+ * it must not be released with vm_unmap().
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address to map into the address space.
+ * \param paddress The page-aligned physical address to map to.
+ * \param user Boolean for user-accessible (also used for read permission).
+ * \param writable Boolean for write permission.
+ * \param executable Boolean for execute permission.
+ * \returns true if the mapping succeeded, else return false.
+ */
+bool vm_map_phys(uintptr_t proot, uintptr_t vaddress, uintptr_t paddress,
+                 bool user, bool writable, bool executable);
+
+/**
+ * Remove a mapping made with vm_map_phys(). The physical page is not freed.
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address to unmap.
+ * \returns true if the page is no longer mapped, else return false.
+ */
+bool vm_unmap_phys(uintptr_t proot, uintptr_t vaddress);
+
+/**
+ * Map device registers into the kernel's address space, uncached.
+ * \param paddress Physical address of the registers.
+ * \param size Size of the register window in bytes.
+ * \returns the virtual address of paddress, or 0 on error.
+ */
+uintptr_t vm_map_mmio(uintptr_t paddress, size_t size);
+
+/**
+ * Map memory written in bulk by the CPU, such as a framebuffer, into the
+ * kernel's address space, write-combining.
+ * \param paddress Physical address of the memory.
+ * \param size Size of the memory in bytes.
+ * \returns the virtual address of paddress, or 0 on error.
+ */
+uintptr_t vm_map_wc(uintptr_t paddress, size_t size);
+
+/**
+ * Make a mapped page write-combining: writes are buffered and sent to memory
+ * in bursts, reads are not cached. Suits framebuffers, which are written far
+ * more than read. Without the PAT the page is made uncached instead.
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address of the page.
+ * \returns true if the page is mapped, else return false.
+ */
+bool vm_set_write_combining(uintptr_t proot, uintptr_t vaddress);
+
+/**
+ * Program the PAT so that pages with only PWT set are write-combining. Call
+ * on every CPU before it maps such pages; every CPU must use the same layout.
+ * \returns true if write-combining is available, else returns false.
+ */
+bool pat_init();
+
+/**
+ * Flush the TLB of the calling CPU if a mapping was removed or changed since
+ * it last did. Called before a user task runs on the CPU, since the task may
+ * have changed its mappings while running on another CPU.
+ * \param seen Generation the calling CPU last flushed at. Updated.
+ */
+void vm_sync_tlb(uint64_t* seen);
+
 /**
  * Unmap the page from the memory address space.
  * \param proot The physical address of the top-level page table structure.
@@ -43,4 +43,10 @@ void pic_init();
 void pic_mask_irq(uint8_t num);
 
 /// Unmask an IRQ by number (0-15)
-void pic_unmask_irq(uint8_t num);
\ No newline at end of file
+void pic_unmask_irq(uint8_t num);
+
+/// Mask every IRQ, once the APICs deliver interrupts instead
+void pic_disable();
+
+/// Acknowledge an IRQ by number (0-15)
+void pic_eoi(uint8_t num);
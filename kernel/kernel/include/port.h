@@ -20,6 +20,16 @@ static inline uint8_t inb(uint16_t port) {
   return ret;
 }
 
+static inline void outw(uint16_t port, uint16_t val) {
+  __asm__("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+  uint16_t ret;
+  __asm__("inw %1, %0" : "=a"(ret) : "Nd"(port));
+  return ret;
+}
+
 /******************************************************************************/
 static inline uint64_t read_cr0() {
   uintptr_t value;
@@ -32,6 +42,13 @@ static inline void write_cr0(uint64_t value) {
 }
 
 /******************************************************************************/
+// Holds the address that caused the last page fault
+static inline uintptr_t read_cr2() {
+  uintptr_t value;
+  __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+  return value;
+}
+
 static inline uintptr_t read_cr3() {
   uintptr_t value;
   __asm__("mov %%cr3, %0" : "=r"(value));
@@ -54,4 +71,48 @@ static inline void write_cr4(uint64_t value) {
 }
 
 /******************************************************************************/
-static inline void io_wait() { outb(0x80, 0); }
\ No newline at end of file
+static inline void io_wait() { outb(0x80, 0); }
+
+/******************************************************************************/
+static inline uint64_t read_msr(uint32_t msr) {
+  uint32_t low, high;
+  __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+  return ((uint64_t)high << 32) | low;
+}
+
+static inline void write_msr(uint32_t msr, uint64_t value) {
+  __asm__ volatile("wrmsr"
+                   :
+                   : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/******************************************************************************/
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax,
+                         uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+  __asm__ volatile("cpuid"
+                   : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                   : "a"(leaf), "c"(subleaf));
+}
+
+/**
+ * Arm address monitoring on the cache line holding addr. A later mwait
+ * returns once that line is written.
+ */
+static inline void cpu_monitor(const volatile void* addr) {
+  __asm__ volatile("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+}
+
+/**
+ * Enable interrupts and wait for a write to the monitored line or an
+ * interrupt. As with "sti; hlt", the interrupt window only opens once the CPU
+ * is waiting.
+ */
+static inline void cpu_sti_mwait(uint32_t hint) {
+  __asm__ volatile("sti; mwait" : : "a"(hint), "c"(0) : "memory");
+}
+
+static inline uint64_t read_tsc() {
+  uint32_t low, high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
\ No newline at end of file
@@ -11,6 +11,10 @@
  */
 #define PSF_FONT_MAGIC 0x864ab572
 
+// Number of fg/bg color pairs with expanded glyph rows, least recently used
+// evicted first
+#define PSF_CACHE_SIZE 4
+
 typedef struct psf {
   uint32_t magic;         /* magic bytes to identify PSF */
   uint32_t version;       /* zero */
@@ -22,6 +26,16 @@ typedef struct psf {
   int32_t width;          /* width in pixels */
 } psf_t;
 
+// A color pair and the 8 pixels drawn for each of the 256 values of a byte of
+// glyph bits. A glyph row is then copied 8 pixels at a time.
+typedef struct psf_cache_entry {
+  bool used;
+  color_t fg;
+  color_t bg;
+  uint64_t last_used;
+  pixel_t rows[256][8];
+} psf_cache_entry_t;
+
 /**
  * Init the information regarding the current psf font.
  * Requirement: The screen pixel width must be a multiple of each glyph's width.
@@ -32,8 +46,8 @@ typedef struct psf {
 bool psf_init();
 
 /**
- * Using the glyphs table to draw pixel-by-pixel the characters onto the frame
- * framebuffer.
+ * Draw a character onto the frame buffer, one glyph row at a time, from the
+ * pixel rows cached for its colors.
  * \param c: Character to be printed.
  * \param pixel_row: The row index of the top left pixel.
  * \param pixel_col: The col index of the top left pixel.
@@ -43,3 +57,19 @@ bool psf_init();
  */
 bool psf_put_char(char c, int32_t pixel_row, int32_t pixel_col, color_t fg,
                   color_t bg);
+
+/**
+ * Draw a run of characters in the same colors side by side. The run is drawn
+ * one pixel row at a time across all its characters, with one look-up of the
+ * color pair.
+ * \param s: Characters to be printed.
+ * \param n: Number of characters.
+ * \param pixel_row: The row index of the top left pixel.
+ * \param pixel_col: The col index of the top left pixel of the first one.
+ * \param fg: Foreground color of the characters.
+ * \param bg: Background color of the characters.
+ * \returns the number of characters drawn; the ones past the right edge are
+ * not.
+ */
+int32_t psf_put_chars(const char* s, int32_t n, int32_t pixel_row,
+                      int32_t pixel_col, color_t fg, color_t bg);
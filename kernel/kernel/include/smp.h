@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apic.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "kprint.h"
+#include "ksched.h"
+#include "ktime.h"
+#include "page.h"
+#include "port.h"
+#include "stivale2.h"
+#include "syscall.h"
+
+// CR0.WP: the kernel cannot write to read-only pages either
+#define CR0_WP (1 << 16)
+
+// CPUID 0x80000001 EDX: RDTSCP and IA32_TSC_AUX
+#define CPUID_EXT_EDX_RDTSCP (1 << 27)
+
+// Bound on the wait for the parked CPUs. TSC calibration has not run when
+// they are parked, so that wait counts pause instructions (well over 100 ms
+// on any CPU).
+#define SMP_PARK_SPINS (1 << 26)
+#define SMP_START_TIMEOUT_NS 100000000
+
+/**
+ * Move the application processors out of the bootloader. Each one loads the
+ * GDT, its TSS and the IDT on the stack of its idle task, then waits for
+ * smp_start() with interrupts disabled. Call after sched_init() and
+ * apic_init(), and before unmap_lower_half() takes the bootloader's code away
+ * from them.
+ * \param smp_tag SMP struct tag from the bootloader (may be NULL).
+ * \returns the number of CPUs parked.
+ */
+int32_t smp_park(struct stivale2_struct_tag_smp* smp_tag);
+
+/**
+ * Let the parked CPUs finish their setup and run their idle task. Call at the
+ * end of setup_kernel(), once everything they share is initialized.
+ * \returns the number of CPUs online.
+ */
+int32_t smp_start();
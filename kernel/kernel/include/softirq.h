@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kprint.h"
+#include "ksched.h"
+#include "ktime.h"
+#include "port.h"
+#include "spinlock.h"
+#include "waitq.h"
+
+// Most work items run by one drain, and the longest a drain may take. What is
+// left is handed to the CPU's softirqd thread.
+#define SOFTIRQ_BUDGET 16
+#define SOFTIRQ_TIME_LIMIT_NS 1000000
+
+struct softirq_work;
+typedef void (*softirq_fn_t)(struct softirq_work* work, void* arg);
+
+// Work deferred out of an interrupt handler. The caller owns the memory. An
+// item is queued at most once: raising it again before it runs does nothing,
+// so the function must handle everything that arrived since it was raised.
+typedef struct softirq_work {
+  softirq_fn_t fn;  // Runs with interrupts enabled, must not block
+  void* arg;
+  struct softirq_work* next;
+  volatile bool queued;
+  // Raise-to-run latency in TSC ticks
+  uint64_t raised_tsc;    // When the pending run was raised
+  uint64_t last_latency;  // Latency of the last run
+  uint64_t max_latency;   // Worst latency seen
+  uint64_t nr_run;        // Times the function ran
+} softirq_work_t;
+
+#define SOFTIRQ_WORK_INIT(work_fn, work_arg) \
+  { .fn = (work_fn), .arg = (work_arg), .next = NULL, .queued = false }
+
+// Deferred work state of a CPU. Only touched by its owner, with interrupts
+// disabled.
+typedef struct softirq_cpu {
+  softirq_work_t* head;
+  softirq_work_t* tail;
+  uint32_t irq_depth;  // Nested interrupt handlers running on the CPU
+  bool running;        // A drain is in progress
+  task_t* thread;      // softirqd: drains when the budget runs out
+  waitq_t waitq;       // softirqd sleeps here while the queue is empty
+  uint64_t nr_raise;
+  uint64_t nr_run;
+  uint64_t nr_defer;  // Drains that ran out of budget or time
+  uint64_t max_latency;
+} softirq_cpu_t;
+
+/**
+ * Start the softirqd thread of each online CPU. Work raised before runs on
+ * interrupt exit only. Call after sched_init().
+ * \returns true if the threads are created, else returns false.
+ */
+bool softirq_init();
+
+/**
+ * Prepare a work item.
+ * \param work The work item.
+ * \param fn Function to run.
+ * \param arg Argument passed to fn.
+ */
+void softirq_work_init(softirq_work_t* work, softirq_fn_t fn, void* arg);
+
+/**
+ * Queue a work item on the calling CPU. Safe in interrupt context. From an
+ * interrupt handler the item runs on interrupt exit; otherwise softirqd is
+ * woken up to run it.
+ * \param work The work item.
+ * \returns true if the item is queued, or false if it was already pending.
+ */
+bool softirq_raise(softirq_work_t* work);
+
+/**
+ * Mark the start of an interrupt handler. Pair with softirq_irq_exit().
+ */
+void softirq_irq_enter();
+
+/**
+ * Mark the end of an interrupt handler. The outermost handler runs pending
+ * work with interrupts enabled, within SOFTIRQ_BUDGET items and
+ * SOFTIRQ_TIME_LIMIT_NS, and leaves the rest to softirqd. Interrupts are
+ * disabled again on return.
+ */
+void softirq_irq_exit();
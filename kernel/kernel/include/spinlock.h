@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Interrupt flag bit in RFLAGS
+#define RFLAGS_IF 0x200
+
+// A simple test-and-test-and-set spinlock
+typedef struct spinlock {
+  volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT \
+  { .locked = 0 }
+
+/******************************************************************************/
+static inline void spin_init(spinlock_t* lock) { lock->locked = 0; }
+
+static inline void spin_lock(spinlock_t* lock) {
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    // Spin on a plain read so we do not bounce the cache line around
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+      __asm__ volatile("pause");
+    }
+  }
+}
+
+static inline bool spin_trylock(spinlock_t* lock) {
+  return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************/
+/**
+ * Disable interrupts on this CPU.
+ * \returns the previous RFLAGS value, to be passed to irq_restore().
+ */
+static inline uint64_t irq_save() {
+  uint64_t flags;
+  __asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+/**
+ * Re-enable interrupts if they were enabled when irq_save() was called.
+ * \param flags RFLAGS value returned by irq_save().
+ */
+static inline void irq_restore(uint64_t flags) {
+  if (flags & RFLAGS_IF) __asm__ volatile("sti" : : : "memory");
+}
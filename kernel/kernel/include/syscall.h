@@ -1,18 +1,51 @@
 #pragma once
 
 #include <graphic.h>
+#include <process.h>
+#include <ring.h>
 #include <stdint.h>
 #include <system.h>
 
+#include "compositor.h"
 #include "executable.h"
 #include "keyboard.h"
 #include "kgraphic.h"
 #include "kprint.h"
+#include "ksched.h"
 #include "page.h"
 #include "port.h"
 #include "stivale2.h"
 #include "term.h"
 
+// MSRs used by the SYSCALL/SYSRET instructions
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_FMASK 0xC0000084
+#define EFER_SCE 0x1
+// RFLAGS bits cleared on SYSCALL: IF, TF, DF and AC
+#define SYSCALL_FMASK 0x40700
+
+// Signature shared by every system call entry point. The handler of a system
+// call named name in SYSCALL_LIST is defined with SYSCALL_DEFINE(name).
+typedef int64_t (*syscall_fn_t)(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                                uint64_t arg3, uint64_t arg4, uint64_t arg5);
+#define SYSCALL_DEFINE(name)                                        \
+  int64_t ksys_##name(uint64_t arg0, uint64_t arg1, uint64_t arg2, \
+                      uint64_t arg3, uint64_t arg4, uint64_t arg5)
+#define SYSCALL_DECLARE(NAME, name, num, argc) SYSCALL_DEFINE(name);
+SYSCALL_LIST(SYSCALL_DECLARE)
+
+// Entry of the dispatch table, with the counters reported by syscallstat()
+typedef struct syscall_entry {
+  syscall_fn_t fn;
+  const char* name;
+  uint64_t nr;
+  int32_t nb_args;
+  uint64_t count;   // Number of calls
+  uint64_t cycles;  // TSC ticks spent in fn
+} syscall_entry_t;
+
 /**
  * syscall_handler(...) is being called inside syscall_entry(). Notice that
  * syscall_entry() is invoked by the interrupt 80. Based on the value of arg nr,
@@ -22,8 +55,54 @@ int64_t syscall_entry_handler(uint64_t nr, uint64_t arg0, uint64_t arg1,
                               uint64_t arg2, uint64_t arg3, uint64_t arg4,
                               uint64_t arg5);
 
+/**
+ * Enable the SYSCALL/SYSRET fast path on the current CPU: user programs then
+ * enter the kernel through syscall_fast_entry() instead of interrupt 0x80.
+ * Call after gdt_setup() and sched_init().
+ */
+void syscall_fast_init();
+
+/**
+ * Dense index of a system call, used to keep per system call statistics.
+ * \param nr System call number.
+ * \returns the index (below NB_SYSCALL), or -1 if nr is not a system call.
+ */
+int32_t syscall_slot(uint64_t nr);
+
+/**
+ * System call number of a dense index.
+ * \param slot Index returned by syscall_slot().
+ * \returns the system call number.
+ */
+uint64_t syscall_number(int32_t slot);
+
+/**
+ * Look up the handler of system call nr in the dispatch table and call it. The
+ * call and the TSC ticks it takes are counted in its table entry.
+ */
+int64_t syscall_dispatch(uint64_t nr, uint64_t arg0, uint64_t arg1,
+                         uint64_t arg2, uint64_t arg3, uint64_t arg4,
+                         uint64_t arg5);
+
+/**
+ * Copy the counters of every system call into stats.
+ * \param stats Output array.
+ * \param max_stat Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t ksyscallstat(syscall_stat_t* stats, size_t max_stat);
+
 /******************************************************************************/
 // Syscall handlers: functions to process system calls
+/**
+ * Whether a process may map, protect or unmap a page itself. Pages the kernel
+ * shares with every process (the time page, the keyboard ring and the
+ * framebuffer) are off limits.
+ * \param vaddress The virtual address.
+ * \returns true if the page belongs to the process, else returns false.
+ */
+bool user_page_owned(uintptr_t vaddress);
+
 /**
  * Handlers for read system call. Return the number of read characters
  * (excluding the null-terminate AND backspace). The function is not responsible
@@ -86,6 +165,37 @@ bool exec_handler(const char* exe_name);
  */
 bool exit_handler();
 
+/**
+ * Handler for the nanosleep system calls. The caller is blocked on a kernel
+ * timer.
+ * \param clock_id The clock, only CLOCK_MONOTONIC is supported.
+ * \param flags 0 or TIMER_ABSTIME.
+ * \param ns Duration, or deadline in ns since boot with TIMER_ABSTIME.
+ * \returns 0 on success, or -1 if the clock is not supported.
+ */
+int64_t clock_nanosleep_handler(int clock_id, int flags, uint64_t ns);
+
+/**
+ * Handler for the ring_enter system call. Runs the queued entries of a
+ * submission ring in order, through the same dispatch table as syscall(), and
+ * writes one completion per entry. Entries that would not return here (exec,
+ * exit) and nested ring_enter complete with -1. Stops early when the
+ * completion queue is full.
+ * \param ring The ring, in the caller's memory.
+ * \param to_submit Maximum number of entries to run.
+ * \returns the number of entries run, or -1 on error.
+ */
+int64_t ring_enter_handler(syscall_ring_t* ring, uint32_t to_submit);
+
+/**
+ * Handler to change the CPU affinity of a task. If the calling task is no
+ * longer allowed on this CPU, it is migrated before returning to user mode.
+ * \param pid Pid of the task. 0 means the calling task.
+ * \param mask Allowed CPUs.
+ * \returns true if the affinity is changed, else returns false.
+ */
+bool sched_setaffinity_handler(int64_t pid, cpu_mask_t mask);
+
 /******************************************************************************/
 /**
  * Handler to handler query kernel's framebuffer information. The information is
@@ -108,7 +218,11 @@ bool get_framebuffer_info_handler(framebuffer_info_t* fb_info);
  * \param src_w The width of the source buffer.
  * \param src_h The height of the source buffer.
  * \param flip Boolean whether we flip the source buffer.
+ * \param rects Regions of the source buffer to copy (in source rows, before
+ * the flip), or NULL to copy all of it.
+ * \param nb_rect Number of entries in rects.
  * \returns true if copy successfully and false otherwise.
  */
 bool framebuffer_cpy_handler(pixel_t* src, int32_t dst_x, int32_t dst_y,
-                             int32_t src_w, int32_t src_h, bool flip);
\ No newline at end of file
+                             int32_t src_w, int32_t src_h, bool flip,
+                             const damage_rect_t* rects, int32_t nb_rect);
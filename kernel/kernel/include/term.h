@@ -14,15 +14,44 @@
 #include "psf.h"
 #include "stivale2.h"
 
+// Largest text grid kept, in characters. A larger screen shows a grid of this
+// size in its top-left corner.
+#define TERM_MAX_COLS 256
+#define TERM_MAX_ROWS 128
+
+// One character of the text grid and its colors
+typedef struct {
+  char c;
+  color_t fg;
+  color_t bg;
+} term_cell_t;
+
 typedef struct {
   int32_t row;
   int32_t col;
-  size_t byte_per_row;
   color_t fg;
   color_t bg;
   bool enable_cursor;
+  // Grid row shown at the top of the screen. Screen row r is grid row
+  // (head + r) % term_h, so scrolling moves head instead of pixels.
+  int32_t head;
+  // Whole screen to draw on the next term_flush(), e.g. after a scroll
+  bool redraw;
+  // Columns [dirty_x0[r], dirty_x1[r]) of grid row r changed since the last
+  // term_flush()
+  int32_t dirty_x0[TERM_MAX_ROWS];
+  int32_t dirty_x1[TERM_MAX_ROWS];
+  term_cell_t cells[TERM_MAX_ROWS][TERM_MAX_COLS];
 } terminal_t;
 
+// Take the terminal lock, which serializes the terminal and the screen it draws
+// on between CPUs. The CPU holding it may take it again, so an interrupt
+// handler that prints does not deadlock.
+void term_lock();
+
+// Release the terminal lock taken with term_lock()
+void term_unlock();
+
 // Initialize the terminal
 void term_init();
 
@@ -42,4 +71,16 @@ void term_clear();
 void term_putchar(char c);
 
 // Write string to the terminal
-void term_puts(const char* s, size_t size);
\ No newline at end of file
+void term_puts(const char* s, size_t size);
+
+// Lay out a buffer in the grid, up to its first null character. Printable
+// characters are stored a run at a time, each run up to the next control
+// character or the end of the row; nothing is drawn until term_flush(). Returns
+// the number of characters written.
+size_t term_write_buf(const char* s, size_t size);
+
+// Draw the characters that changed since the last call and show them
+void term_flush();
+
+// Draw every character again on the next term_flush()
+void term_redraw();
\ No newline at end of file
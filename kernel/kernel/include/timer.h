@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apic.h"
+#include "kprint.h"
+#include "ktime.h"
+#include "pic.h"
+#include "port.h"
+#include "spinlock.h"
+
+// Vector of the local APIC timer. The PIT fallback uses IRQ0_INTERRUPT.
+#define TIMER_VECTOR 0xF0
+
+// IA32_TSC_DEADLINE MSR and the LVT timer modes
+#define MSR_TSC_DEADLINE 0x6E0
+#define LAPIC_TIMER_ONESHOT 0x0
+#define LAPIC_TIMER_TSC_DEADLINE (0x2 << 17)
+// LAPIC timer input divided by 16
+#define LAPIC_TIMER_DIV_16 0x3
+// Length of the LAPIC timer calibration
+#define LAPIC_CALIBRATE_NS 10000000
+
+// PIT channel 0, which raises IRQ0
+#define PIT_CHANNEL0 0x40
+
+// Longest delay programmed at once (about 16 minutes)
+#define TIMER_MAX_DELAY_NS (1ULL << 40)
+
+// Timer wheel: one for the whole system. Its interrupt is raised on the boot
+// CPU, which alone programs the device; other CPUs that arm an earlier timer
+// send it TIMER_VECTOR. TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots.
+// A level 0 slot spans 2^TIMER_WHEEL_SHIFT ns (about 16 us) and each level is
+// TIMER_WHEEL_SLOTS times coarser than the one below; the wheel covers about
+// 13 days. Timers further away wait in the last level.
+#define TIMER_WHEEL_SHIFT 14
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 6
+
+// Hardware used to raise the timer interrupt, best first
+typedef enum clockevent_mode {
+  CLOCKEVENT_NONE,
+  CLOCKEVENT_TSC_DEADLINE,
+  CLOCKEVENT_LAPIC_ONESHOT,
+  CLOCKEVENT_PIT,
+} clockevent_mode_t;
+
+struct ktimer;
+typedef void (*ktimer_fn_t)(struct ktimer* timer, void* arg);
+
+// A one-shot timer. The caller owns the memory; a timer must be cancelled
+// before it is freed.
+typedef struct ktimer {
+  uint64_t expires;  // Absolute expiry in ns since boot (ktime_ns())
+  ktimer_fn_t fn;    // Runs in interrupt context with interrupts disabled
+  void* arg;
+  // Links of the wheel slot the timer sits in
+  struct ktimer* next;
+  struct ktimer* prev;
+  struct ktimer** slot;  // NULL while the timer is not pending
+} ktimer_t;
+
+/**
+ * Pick the best clock event device (TSC-deadline, then LAPIC one-shot, then
+ * the PIT). The handlers of TIMER_VECTOR and IRQ0 are installed by
+ * idt_setup(). Call after ktime_init() and apic_init().
+ * \returns true if a device can raise timer interrupts, else returns false.
+ */
+bool timer_init();
+
+/**
+ * Whether timer interrupts are available. Without them ktimer_t never fires.
+ */
+bool timer_enabled();
+
+/**
+ * Name of the clock event device in use.
+ */
+const char* clockevent_name();
+
+/**
+ * Expire the due timers and program the next interrupt. Called by the timer
+ * interrupt handler.
+ */
+void timer_interrupt();
+
+/******************************************************************************/
+/**
+ * Prepare a timer. It is not pending until armed.
+ * \param timer The timer.
+ * \param fn Function called when the timer expires.
+ * \param arg Argument passed to fn.
+ */
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* arg);
+
+/**
+ * Arm a timer, or move it if it is already pending. fn may re-arm its own
+ * timer.
+ * \param timer The timer.
+ * \param expires Absolute expiry in ns since boot. A time in the past fires
+ * on the next timer interrupt, which is raised right away.
+ */
+void ktimer_arm(ktimer_t* timer, uint64_t expires);
+
+/**
+ * Arm a timer relative to now.
+ * \param timer The timer.
+ * \param delay_ns Delay in ns.
+ */
+void ktimer_arm_after(ktimer_t* timer, uint64_t delay_ns);
+
+/**
+ * Disarm a timer.
+ * \param timer The timer.
+ * \returns true if the timer was pending, else returns false.
+ */
+bool ktimer_cancel(ktimer_t* timer);
+
+/**
+ * Whether a timer is armed and has not fired yet.
+ * \param timer The timer.
+ */
+bool ktimer_pending(ktimer_t* timer);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kprint.h"
+#include "port.h"
+#include "spinlock.h"
+
+// Bochs VBE display interface (QEMU standard VGA, Bochs): a register is
+// selected with the index port and accessed with the data port
+#define VBE_DISPI_IOPORT_INDEX 0x01CE
+#define VBE_DISPI_IOPORT_DATA 0x01CF
+
+// Registers
+#define VBE_DISPI_INDEX_ID 0x0
+#define VBE_DISPI_INDEX_XRES 0x1
+#define VBE_DISPI_INDEX_YRES 0x2
+#define VBE_DISPI_INDEX_BPP 0x3
+#define VBE_DISPI_INDEX_ENABLE 0x4
+#define VBE_DISPI_INDEX_VIRT_WIDTH 0x6
+#define VBE_DISPI_INDEX_VIRT_HEIGHT 0x7
+#define VBE_DISPI_INDEX_X_OFFSET 0x8
+#define VBE_DISPI_INDEX_Y_OFFSET 0x9
+
+// Versions reported by VBE_DISPI_INDEX_ID. Virtual screens and offsets came
+// with VBE_DISPI_ID1.
+#define VBE_DISPI_ID1 0xB0C1
+#define VBE_DISPI_ID5 0xB0C5
+#define VBE_DISPI_ENABLED 0x01
+
+/**
+ * Find the Bochs VBE device and make its virtual screen two pages tall, so
+ * vbe_show_page() can flip between them. The mode set by the bootloader is
+ * kept; it must be the one described by the arguments, else the screen is
+ * driven by another device.
+ * \param width,height Visible size in pixels.
+ * \param bpp Bits per pixel.
+ * \returns true if the device can flip pages, else returns false.
+ */
+bool vbe_init(int32_t width, int32_t height, int32_t bpp);
+
+/**
+ * Whether vbe_init() succeeded.
+ */
+bool vbe_enabled();
+
+/**
+ * Scan out one of the two pages. The switch is one register write; the device
+ * shows the new page from its next frame.
+ * \param page 0 for the top page, 1 for the one below it.
+ */
+void vbe_show_page(int32_t page);
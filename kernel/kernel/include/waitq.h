@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ksched.h"
+#include "spinlock.h"
+
+// A FIFO of tasks blocked until some condition holds, e.g. until the keyboard
+// buffer has input. Wakers unlink the tasks under the queue's lock.
+typedef struct waitq {
+  spinlock_t lock;
+  task_t* head;
+  task_t* tail;
+} waitq_t;
+
+#define WAITQ_INIT \
+  { .lock = SPINLOCK_INIT, .head = NULL, .tail = NULL }
+
+// Condition a task waits for. Called with the queue's lock held and
+// interrupts disabled, so it must not block.
+typedef bool (*waitq_cond_t)(void* arg);
+
+/******************************************************************************/
+/**
+ * Init an empty wait queue.
+ * \param wq The wait queue.
+ */
+void waitq_init(waitq_t* wq);
+
+/**
+ * Block the calling task until cond(arg) holds. The condition is checked
+ * under the queue's lock, so a wakeup sent after the check is never lost.
+ * \param wq The wait queue.
+ * \param cond The condition.
+ * \param arg Argument passed to cond.
+ */
+void waitq_wait(waitq_t* wq, waitq_cond_t cond, void* arg);
+
+/**
+ * Wake the task that has waited the longest. Safe in interrupt context.
+ * \param wq The wait queue.
+ * \returns true if a task is woken up, else returns false.
+ */
+bool waitq_wake_one(waitq_t* wq);
+
+/**
+ * Wake every task in the queue. Safe in interrupt context.
+ * \param wq The wait queue.
+ * \returns the number of tasks woken up.
+ */
+size_t waitq_wake_all(waitq_t* wq);
@@ -0,0 +1,91 @@
+#include "acpi.h"
+
+// hhdm struct allow us to get the base virtual address
+extern struct stivale2_struct_tag_hhdm* hhdm_struct_tag;
+
+// Root table: the XSDT holds 64-bit pointers, the RSDT 32-bit ones
+acpi_sdt_hdr_t* acpi_root = NULL;
+bool acpi_use_xsdt = false;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Sum of the bytes of a table. ACPI tables are valid when it is 0.
+ * \param table Start of the table.
+ * \param length Number of bytes.
+ */
+uint8_t acpi_checksum(const void* table, size_t length) {
+  const uint8_t* bytes = (const uint8_t*)table;
+  uint8_t sum = 0;
+  for (size_t i = 0; i < length; i++) sum += bytes[i];
+  return sum;
+}
+
+// Compare a 4 character table signature
+bool acpi_signature_eq(const char* a, const char* b) {
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+}
+
+/******************************************************************************/
+/**
+ * Locate the ACPI root table from the bootloader's RSDP tag. Must be called
+ * before acpi_find_table().
+ * \param rsdp_tag RSDP struct tag from the bootloader (may be NULL).
+ * \returns true if a valid RSDT or XSDT is found, else returns false.
+ */
+bool acpi_init(struct stivale2_struct_tag_rsdp* rsdp_tag) {
+  if (rsdp_tag == NULL || rsdp_tag->rsdp == 0) {
+    kperror("[ERROR] acpi_init: no RSDP from the bootloader\n");
+    return false;
+  }
+
+  // Pointers in tags are higher half, the ones inside ACPI tables physical
+  uintptr_t rsdp_addr = rsdp_tag->rsdp;
+  if (rsdp_addr < hhdm_struct_tag->addr) rsdp_addr = ptov(rsdp_addr);
+  acpi_rsdp_t* rsdp = (acpi_rsdp_t*)rsdp_addr;
+  if (acpi_checksum(rsdp, 20) != 0) {
+    kperror("[ERROR] acpi_init: bad RSDP checksum\n");
+    return false;
+  }
+
+  if (rsdp->revision >= 2 && rsdp->xsdt_addr != 0) {
+    acpi_root = (acpi_sdt_hdr_t*)ptov(rsdp->xsdt_addr);
+    acpi_use_xsdt = true;
+  } else {
+    acpi_root = (acpi_sdt_hdr_t*)ptov(rsdp->rsdt_addr);
+    acpi_use_xsdt = false;
+  }
+
+  if (acpi_checksum(acpi_root, acpi_root->length) != 0) {
+    kperror("[ERROR] acpi_init: bad root table checksum\n");
+    acpi_root = NULL;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Find a system description table by signature.
+ * \param signature Four character signature, e.g. "APIC" for the MADT.
+ * \returns pointer to the table, or NULL if it does not exist or is corrupted.
+ */
+acpi_sdt_hdr_t* acpi_find_table(const char* signature) {
+  if (acpi_root == NULL) return NULL;
+
+  size_t entry_size = acpi_use_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+  size_t nb_entries = (acpi_root->length - sizeof(acpi_sdt_hdr_t)) / entry_size;
+  uint8_t* entries = (uint8_t*)acpi_root + sizeof(acpi_sdt_hdr_t);
+
+  for (size_t i = 0; i < nb_entries; i++) {
+    uintptr_t paddr = acpi_use_xsdt ? ((uint64_t*)entries)[i]
+                                    : ((uint32_t*)entries)[i];
+    acpi_sdt_hdr_t* table = (acpi_sdt_hdr_t*)ptov(paddr);
+    if (!acpi_signature_eq(table->signature, signature)) continue;
+    if (acpi_checksum(table, table->length) != 0) {
+      kperror("[ERROR] acpi_find_table: bad %s checksum\n", signature);
+      return NULL;
+    }
+    return table;
+  }
+  return NULL;
+}
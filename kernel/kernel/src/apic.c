@@ -0,0 +1,333 @@
+#include "apic.h"
+
+// Local APIC of every CPU: MSRs in x2APIC mode, else an MMIO window
+bool lapic_x2apic = false;
+volatile uint32_t* lapic_regs = NULL;
+
+// IO-APICs and ISA IRQ overrides found in the MADT
+ioapic_t ioapics[MAX_NB_IOAPIC];
+int32_t nb_ioapic = 0;
+uint32_t isa_gsi[NB_ISA_IRQ];
+uint16_t isa_flags[NB_ISA_IRQ];
+spinlock_t ioapic_lock = SPINLOCK_INIT;
+
+// Whether IRQs go through the IO-APICs rather than the 8259
+bool apic_on = false;
+// APIC ID of the boot CPU, where ISA IRQs are delivered by default
+uint32_t boot_lapic_id = 0;
+
+/******************************************************************************/
+// Helper functions
+uint32_t ioapic_read(ioapic_t* ioapic, uint32_t reg) {
+  ioapic->regs[IOAPIC_IOREGSEL / 4] = reg;
+  return ioapic->regs[IOAPIC_IOWIN / 4];
+}
+
+void ioapic_write(ioapic_t* ioapic, uint32_t reg, uint32_t value) {
+  ioapic->regs[IOAPIC_IOREGSEL / 4] = reg;
+  ioapic->regs[IOAPIC_IOWIN / 4] = value;
+}
+
+/**
+ * Find the IO-APIC handling a global system interrupt.
+ * \param gsi The global system interrupt.
+ * \returns pointer to the IO-APIC, or NULL if none handles gsi.
+ */
+ioapic_t* ioapic_for_gsi(uint32_t gsi) {
+  for (int32_t i = 0; i < nb_ioapic; i++) {
+    ioapic_t* ioapic = &ioapics[i];
+    if (gsi >= ioapic->gsi_base && gsi < ioapic->gsi_base + ioapic->nb_gsi) {
+      return ioapic;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Set the mask bit of the redirection entry of an ISA IRQ.
+ * \param irq ISA IRQ number (0-15).
+ * \param masked New value of the mask bit.
+ */
+void ioapic_set_mask(uint8_t irq, bool masked) {
+  uint32_t gsi = isa_gsi[irq];
+  ioapic_t* ioapic = ioapic_for_gsi(gsi);
+  if (ioapic == NULL) return;
+
+  uint32_t reg = IOAPIC_REG_REDTBL + 2 * (gsi - ioapic->gsi_base);
+  uint64_t flags = irq_save();
+  spin_lock(&ioapic_lock);
+  uint32_t low = ioapic_read(ioapic, reg);
+  low = masked ? (low | IOAPIC_MASKED) : (low & ~IOAPIC_MASKED);
+  ioapic_write(ioapic, reg, low);
+  spin_unlock(&ioapic_lock);
+  irq_restore(flags);
+}
+
+/**
+ * Walk the MADT: record the IO-APICs, the ISA IRQ overrides and a 64-bit
+ * local APIC address if there is one.
+ * \param madt The MADT.
+ * \param lapic_paddr Set to the physical address of the local APIC.
+ */
+void madt_parse(acpi_madt_t* madt, uintptr_t* lapic_paddr) {
+  *lapic_paddr = madt->lapic_addr;
+
+  uint8_t* entry = madt->entries;
+  uint8_t* end = (uint8_t*)madt + madt->hdr.length;
+  while (entry + sizeof(madt_entry_hdr_t) <= end) {
+    madt_entry_hdr_t* hdr = (madt_entry_hdr_t*)entry;
+    if (hdr->length < sizeof(madt_entry_hdr_t)) break;
+
+    if (hdr->type == MADT_IOAPIC && nb_ioapic < MAX_NB_IOAPIC) {
+      madt_ioapic_t* info = (madt_ioapic_t*)entry;
+      ioapic_t* ioapic = &ioapics[nb_ioapic];
+      ioapic->regs = (volatile uint32_t*)vm_map_mmio(info->addr,
+                                                     IOAPIC_REG_SIZE);
+      if (ioapic->regs != NULL) {
+        ioapic->id = info->id;
+        ioapic->gsi_base = info->gsi_base;
+        ioapic->nb_gsi = ((ioapic_read(ioapic, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+        nb_ioapic++;
+      }
+    } else if (hdr->type == MADT_ISO) {
+      madt_iso_t* iso = (madt_iso_t*)entry;
+      if (iso->bus == 0 && iso->source < NB_ISA_IRQ) {
+        isa_gsi[iso->source] = iso->gsi;
+        isa_flags[iso->source] = iso->flags;
+      }
+    } else if (hdr->type == MADT_LAPIC_ADDR) {
+      *lapic_paddr = ((madt_lapic_addr_t*)entry)->addr;
+    }
+    entry += hdr->length;
+  }
+}
+
+/******************************************************************************/
+/**
+ * Bring up the local APIC of the boot CPU (in x2APIC mode when CPUID reports
+ * it) and the IO-APICs described by the ACPI MADT, then mask the 8259 PICs.
+ * Until this succeeds, IRQs keep going through the 8259. Call after
+ * init_free_list() and pic_init().
+ * \param rsdp_tag RSDP struct tag from the bootloader (may be NULL).
+ * \returns true if the APICs handle interrupts, else returns false.
+ */
+bool apic_init(struct stivale2_struct_tag_rsdp* rsdp_tag) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  if (!(edx & (1 << 9))) {
+    kperror("[ERROR] apic_init: no local APIC, keep the 8259\n");
+    return false;
+  }
+  lapic_x2apic = ecx & (1 << 21);
+
+  if (!acpi_init(rsdp_tag)) return false;
+  acpi_madt_t* madt = (acpi_madt_t*)acpi_find_table("APIC");
+  if (madt == NULL) {
+    kperror("[ERROR] apic_init: no MADT, keep the 8259\n");
+    return false;
+  }
+
+  // ISA IRQs are identity mapped, edge triggered and active high unless the
+  // MADT overrides them
+  for (uint8_t irq = 0; irq < NB_ISA_IRQ; irq++) {
+    isa_gsi[irq] = irq;
+    isa_flags[irq] = 0;
+  }
+  uintptr_t lapic_paddr;
+  madt_parse(madt, &lapic_paddr);
+  if (nb_ioapic == 0) {
+    kperror("[ERROR] apic_init: no IO-APIC, keep the 8259\n");
+    return false;
+  }
+
+  if (!lapic_x2apic) {
+    lapic_regs = (volatile uint32_t*)vm_map_mmio(lapic_paddr, LAPIC_REG_SIZE);
+    if (lapic_regs == NULL) return false;
+  }
+  lapic_init();
+  boot_lapic_id = lapic_id();
+
+  // Start with every redirection entry masked
+  for (int32_t i = 0; i < nb_ioapic; i++) {
+    ioapic_t* ioapic = &ioapics[i];
+    for (uint32_t pin = 0; pin < ioapic->nb_gsi; pin++) {
+      ioapic_write(ioapic, IOAPIC_REG_REDTBL + 2 * pin, IOAPIC_MASKED);
+      ioapic_write(ioapic, IOAPIC_REG_REDTBL + 2 * pin + 1, 0);
+    }
+  }
+
+  // The 8259 stays remapped above the exceptions so a spurious IRQ from it
+  // cannot be taken for a fault
+  pic_disable();
+  apic_on = true;
+  kprintf("[INFO] apic_init: %s, %d IO-APIC(s)\n",
+          lapic_x2apic ? "x2APIC" : "xAPIC", nb_ioapic);
+  return true;
+}
+
+/**
+ * Enable the local APIC of the calling CPU. Called by apic_init() on the boot
+ * CPU; other CPUs call it when they come online.
+ */
+void lapic_init() {
+  uint64_t base = read_msr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+  // x2APIC has to be entered from the enabled xAPIC state
+  write_msr(MSR_APIC_BASE, base);
+  if (lapic_x2apic) write_msr(MSR_APIC_BASE, base | APIC_BASE_X2APIC);
+
+  // Accept every priority, mask the local interrupt pins (the 8259 is gone)
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_ERROR, APIC_ERROR_VECTOR);
+  lapic_write(LAPIC_ESR, 0);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+  lapic_eoi();
+}
+
+/**
+ * Read a local APIC register.
+ * \param reg Register offset in the xAPIC layout (LAPIC_*).
+ * \returns the register value.
+ */
+uint32_t lapic_read(uint32_t reg) {
+  if (lapic_x2apic) return (uint32_t)read_msr(MSR_X2APIC_BASE + (reg >> 4));
+  return lapic_regs[reg / 4];
+}
+
+/**
+ * Write a local APIC register.
+ * \param reg Register offset in the xAPIC layout (LAPIC_*).
+ * \param value The value to write.
+ */
+void lapic_write(uint32_t reg, uint32_t value) {
+  if (lapic_x2apic) {
+    write_msr(MSR_X2APIC_BASE + (reg >> 4), value);
+  } else {
+    lapic_regs[reg / 4] = value;
+  }
+}
+
+/**
+ * APIC ID of the calling CPU.
+ */
+uint32_t lapic_id() {
+  uint32_t id = lapic_read(LAPIC_ID);
+  return lapic_x2apic ? id : id >> 24;
+}
+
+/**
+ * Signal the end of an interrupt to the local APIC. In x2APIC mode this is a
+ * single MSR write.
+ */
+void lapic_eoi() { lapic_write(LAPIC_EOI, 0); }
+
+/**
+ * Send a fixed interrupt to another CPU.
+ * \param lapic_id APIC ID of the destination CPU.
+ * \param vector Interrupt vector delivered to it.
+ */
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+  // x2APIC takes the destination and the vector in one MSR write
+  if (lapic_x2apic) {
+    write_msr(MSR_X2APIC_BASE + (LAPIC_ICR >> 4),
+              ((uint64_t)lapic_id << 32) | vector);
+    return;
+  }
+
+  // An interrupt handler sending its own IPI must not land between the two
+  // halves. Writing the low half sends the IPI.
+  uint64_t flags = irq_save();
+  lapic_write(LAPIC_ICR_HIGH, lapic_id << 24);
+  lapic_write(LAPIC_ICR, vector);
+  while (lapic_read(LAPIC_ICR) & LAPIC_ICR_PENDING) {
+    __asm__ volatile("pause");
+  }
+  irq_restore(flags);
+}
+
+/**
+ * Whether the local APIC runs in x2APIC mode.
+ */
+bool apic_x2apic() { return lapic_x2apic; }
+
+/**
+ * Whether interrupts are delivered by the APICs (otherwise by the 8259).
+ */
+bool apic_enabled() { return apic_on; }
+
+/******************************************************************************/
+/**
+ * Route an ISA IRQ to a CPU and unmask it. Falls back to the 8259 if the
+ * APICs are not enabled.
+ * \param irq ISA IRQ number (0-15).
+ * \param vector Interrupt vector delivered to the CPU.
+ * \param lapic_id APIC ID of the destination CPU.
+ * \returns true if the IRQ is routed, else returns false.
+ */
+bool irq_route(uint8_t irq, uint8_t vector, uint32_t lapic_id) {
+  if (irq >= NB_ISA_IRQ) return false;
+  if (!apic_on) {
+    pic_unmask_irq(irq);
+    return true;
+  }
+
+  uint32_t gsi = isa_gsi[irq];
+  ioapic_t* ioapic = ioapic_for_gsi(gsi);
+  if (ioapic == NULL) {
+    kperror("[ERROR] irq_route: no IO-APIC for IRQ %d\n", irq);
+    return false;
+  }
+
+  // Fixed delivery, physical destination
+  uint32_t low = vector;
+  if ((isa_flags[irq] & MADT_ISO_POLARITY_MASK) == MADT_ISO_ACTIVE_LOW) {
+    low |= IOAPIC_ACTIVE_LOW;
+  }
+  if ((isa_flags[irq] & MADT_ISO_TRIGGER_MASK) == MADT_ISO_LEVEL) {
+    low |= IOAPIC_LEVEL;
+  }
+  uint32_t reg = IOAPIC_REG_REDTBL + 2 * (gsi - ioapic->gsi_base);
+
+  uint64_t flags = irq_save();
+  spin_lock(&ioapic_lock);
+  ioapic_write(ioapic, reg + 1, lapic_id << 24);
+  ioapic_write(ioapic, reg, low);
+  spin_unlock(&ioapic_lock);
+  irq_restore(flags);
+  return true;
+}
+
+/**
+ * Unmask an ISA IRQ, delivered to the boot CPU at vector IRQ0_INTERRUPT + irq.
+ * \param irq ISA IRQ number (0-15).
+ */
+void irq_unmask(uint8_t irq) {
+  irq_route(irq, IRQ0_INTERRUPT + irq, boot_lapic_id);
+}
+
+/**
+ * Mask an ISA IRQ.
+ * \param irq ISA IRQ number (0-15).
+ */
+void irq_mask(uint8_t irq) {
+  if (irq >= NB_ISA_IRQ) return;
+  if (apic_on) {
+    ioapic_set_mask(irq, true);
+  } else {
+    pic_mask_irq(irq);
+  }
+}
+
+/**
+ * Acknowledge an IRQ to whichever controller delivered it.
+ * \param irq ISA IRQ number (0-15).
+ */
+void irq_eoi(uint8_t irq) {
+  if (apic_on) {
+    lapic_eoi();
+  } else {
+    pic_eoi(irq);
+  }
+}
@@ -6,20 +6,29 @@
 #include <system.h>
 #include <trigonometry.h>
 
+#include "apic.h"
 #include "executable.h"
+#include "fpu.h"
 #include "gdt.h"
 #include "idt.h"
 #include "kgraphic.h"
+#include "klatency.h"
 #include "kprint.h"
+#include "ksched.h"
+#include "ktime.h"
 #include "page.h"
 #include "pic.h"
+#include "smp.h"
+#include "softirq.h"
 #include "stivale2.h"
 #include "syscall.h"
 #include "term.h"
+#include "timer.h"
 #include "util.h"
 
 // Function to write to terminal is defined in stivale2 source
 extern term_write_t term_write;
+extern keyboard_t keyboard;
 extern int64_t syscall(uint64_t nr, ...);
 extern uint8_t gdt;
 
@@ -30,6 +39,8 @@ struct stivale2_struct_tag_hhdm* hhdm_struct_tag = NULL;
 struct stivale2_struct_tag_modules* modules_struct_tag = NULL;
 struct stivale2_struct_tag_terminal* terminal_struct_tag = NULL;
 struct stivale2_struct_tag_framebuffer* framebuffer_struct_tag = NULL;
+struct stivale2_struct_tag_smp* smp_struct_tag = NULL;
+struct stivale2_struct_tag_rsdp* rsdp_struct_tag = NULL;
 
 // Reserve space for the stack
 static uint8_t stack[8192];
@@ -73,6 +84,12 @@ static struct stivale2_header_tag_framebuffer framebuffer_hdr_tag = {
     .framebuffer_width = 0,
     .framebuffer_bpp = 0};
 
+// Ask the bootloader to enumerate the CPUs and park the application processors
+static struct stivale2_header_tag_smp smp_hdr_tag = {
+    .tag = {.identifier = STIVALE2_HEADER_TAG_SMP_ID,
+            .next = (uintptr_t)(&framebuffer_hdr_tag)},
+    .flags = 0};
+
 // Declare the header for the bootloader
 __attribute__((section(".stivale2hdr"),
                used)) static struct stivale2_header stivale_hdr = {
@@ -89,7 +106,7 @@ __attribute__((section(".stivale2hdr"),
     .flags = 0x1E,
 
     // First tag struct
-    .tags = (uintptr_t)&framebuffer_hdr_tag};
+    .tags = (uintptr_t)&smp_hdr_tag};
 
 /******************************************************************************/
 // Find a tag with a given ID
@@ -122,6 +139,12 @@ void struct_tag_setup(struct stivale2_struct* hdr) {
 
   // Framebuffer tag:
   framebuffer_struct_tag = find_tag(hdr, STIVALE2_STRUCT_TAG_FRAMEBUFFER_ID);
+
+  // SMP tag:
+  smp_struct_tag = find_tag(hdr, STIVALE2_STRUCT_TAG_SMP_ID);
+
+  // RSDP tag (ACPI tables):
+  rsdp_struct_tag = find_tag(hdr, STIVALE2_STRUCT_TAG_RSDP_ID);
 }
 
 inline void enable_write_protection() {
@@ -174,21 +197,64 @@ void setup_kernel(struct stivale2_struct* hdr) {
 
   // Set up PIC
   pic_init();
-  // Enable keyboard interrupt
-  pic_unmask_irq(1);
 
   // Init free list for mapping paging
   init_free_list();
 
+  // Write to the framebuffer through write-combining pages, and draw into a
+  // back buffer that is copied to it on present
+  kgraphic_write_combine();
+  kgraphic_back_buffer_init();
+  // On a Bochs VBE display, frames can also be shown by flipping two pages
+  kgraphic_page_flip_init();
+  // Text written so far was lost if the screen could not be drawn to directly
+  term_redraw();
+  term_flush();
+
+  // Deliver IRQs through the local APIC and IO-APIC when the MADT describes
+  // them; otherwise the 8259 stays in charge
+  apic_init(rsdp_struct_tag);
+  // Enable keyboard interrupt
+  irq_unmask(1);
+
   // Enable write protection
   enable_write_protection();
 
+  // Set up per-CPU run queues, and move the other CPUs out of the bootloader
+  // while its code is still mapped
+  sched_init(smp_struct_tag);
+  smp_park(smp_struct_tag);
+
   // Unmap lower half
   uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
   unmap_lower_half(proot);
 
   // Init executable list for loading and running executable
   init_exe_list();
+
+  // Calibrate the TSC so the kernel can measure time
+  ktime_init();
+
+  // Share the keyboard event ring with user programs
+  kb_map_ring(&keyboard);
+
+  // Start the clock event device behind kernel timers
+  timer_init();
+
+  // Start the threads that run deferred interrupt work
+  softirq_init();
+
+  // Allocate the interrupt and system call latency histograms
+  lat_init();
+
+  // Switch FPU/SSE state lazily between tasks
+  fpu_init();
+
+  // Let user programs enter the kernel with SYSCALL
+  syscall_fast_init();
+
+  // The other CPUs repeat the per-CPU setup and go idle
+  smp_start();
 }
 
 /******************************************************************************/
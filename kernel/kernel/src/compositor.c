@@ -0,0 +1,221 @@
+#include "compositor.h"
+
+// Defined in kgraphic.c
+extern int32_t screen_w;
+extern int32_t screen_h;
+extern uintptr_t buffer_addr;
+extern int32_t buffer_stride;
+
+surface_t surfaces[MAX_NB_SURFACE];
+// Ids of the attached surfaces, bottom of the stack first
+int32_t z_order[MAX_NB_SURFACE];
+int32_t nb_stacked = 0;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Look up a surface owned by pid.
+ * \returns the surface, or NULL if id is not one of pid's surfaces.
+ */
+surface_t* surface_get(int64_t pid, int32_t id) {
+  if (id < 0 || id >= MAX_NB_SURFACE) return NULL;
+  surface_t* surface = &surfaces[id];
+  if (!surface->used || surface->pid != pid) return NULL;
+  return surface;
+}
+
+// Take a surface id out of the stacking order
+void z_order_remove(int32_t id) {
+  int32_t i = 0;
+  while (i < nb_stacked && z_order[i] != id) i++;
+  for (; i + 1 < nb_stacked; i++) z_order[i] = z_order[i + 1];
+  if (nb_stacked > 0) nb_stacked--;
+}
+
+// Read the geometry of the owner's window into its surface
+void surface_sync(surface_t* surface) {
+  window_t* window = surface->window;
+  surface->addr = window->addr;
+  surface->x = window->screen_x;
+  surface->y = window->screen_y;
+  surface->width = window->width;
+  surface->height = window->height;
+  surface->flip = window->flip;
+}
+
+// Compose the whole screen area of a surface
+void surface_expose(surface_t* surface) {
+  compositor_expose(surface->x, surface->y, surface->x + surface->width,
+                    surface->y + surface->height);
+}
+
+/**
+ * Copy the part of a surface inside [x0, x1) x [y0, y1) of the screen into the
+ * back buffer. The rectangle is already clipped to the screen.
+ */
+void surface_paint(surface_t* surface, int32_t x0, int32_t y0, int32_t x1,
+                   int32_t y1) {
+  x0 = max(x0, surface->x);
+  y0 = max(y0, surface->y);
+  x1 = min(x1, surface->x + surface->width);
+  y1 = min(y1, surface->y + surface->height);
+  if (x0 >= x1 || y0 >= y1) return;
+
+  pixel_t* dst = (pixel_t*)buffer_addr;
+  size_t row_size = (x1 - x0) * sizeof(pixel_t);
+  for (int32_t y = y0; y < y1; y++) {
+    // Row r of the buffer lands on row y + r, or is counted from the bottom
+    // when flipped
+    int32_t r = surface->flip ? surface->y + surface->height - 1 - y
+                              : y - surface->y;
+    kmemcpy(dst + y * buffer_stride + x0,
+            surface->addr + r * surface->width + (x0 - surface->x), row_size);
+  }
+}
+
+/******************************************************************************/
+/**
+ * Put a window on top of the stack and compose it.
+ * \param pid Pid of the owner.
+ * \param window The window, in the owner's memory.
+ * \returns the surface id, or -1 if the compositor is full.
+ */
+int32_t compositor_attach(int64_t pid, window_t* window) {
+  if (window == NULL || window->addr == NULL) return -1;
+
+  int32_t id = 0;
+  while (id < MAX_NB_SURFACE && surfaces[id].used) id++;
+  if (id == MAX_NB_SURFACE) return -1;
+
+  surface_t* surface = &surfaces[id];
+  surface->used = true;
+  surface->pid = pid;
+  surface->window = window;
+  surface_sync(surface);
+  z_order[nb_stacked++] = id;
+  surface_expose(surface);
+  return id;
+}
+
+/**
+ * Take a window off the stack. What it covered is composed again.
+ * \param pid Pid of the owner.
+ * \param id Surface id returned by compositor_attach().
+ * \returns true if the surface is removed, else returns false.
+ */
+bool compositor_detach(int64_t pid, int32_t id) {
+  surface_t* surface = surface_get(pid, id);
+  if (surface == NULL) return false;
+
+  surface->used = false;
+  z_order_remove(id);
+  surface_expose(surface);
+  return true;
+}
+
+/**
+ * Take every window of a process off the stack, e.g. when it exits.
+ * \param pid Pid of the owner.
+ */
+void compositor_detach_pid(int64_t pid) {
+  // Unstack them all first: the memory of the process may already be gone, so
+  // none of its windows can be painted while the others are exposed
+  for (int32_t id = 0; id < MAX_NB_SURFACE; id++) {
+    if (surfaces[id].used && surfaces[id].pid == pid) {
+      surfaces[id].used = false;
+      z_order_remove(id);
+    }
+  }
+  for (int32_t id = 0; id < MAX_NB_SURFACE; id++) {
+    if (!surfaces[id].used && surfaces[id].pid == pid) {
+      surface_expose(&surfaces[id]);
+      surfaces[id].pid = 0;
+    }
+  }
+}
+
+/**
+ * Move a window to the top of the stack and compose it.
+ * \param pid Pid of the owner.
+ * \param id Surface id returned by compositor_attach().
+ * \returns true if the surface is raised, else returns false.
+ */
+bool compositor_raise(int64_t pid, int32_t id) {
+  surface_t* surface = surface_get(pid, id);
+  if (surface == NULL) return false;
+
+  z_order_remove(id);
+  z_order[nb_stacked++] = id;
+  surface_expose(surface);
+  return true;
+}
+
+/**
+ * Compose the regions of a window that changed. If the window moved, flipped
+ * or was resized since the last commit, the area it left and the whole new
+ * area are composed instead.
+ * \param pid Pid of the owner.
+ * \param id Surface id returned by compositor_attach().
+ * \param rects Changed regions of the window buffer, or NULL for all of it.
+ * \param nb_rect Number of entries in rects.
+ * \returns true if the surface is composed, else returns false.
+ */
+bool compositor_commit(int64_t pid, int32_t id, const damage_rect_t* rects,
+                       int32_t nb_rect) {
+  surface_t* surface = surface_get(pid, id);
+  if (surface == NULL) return false;
+
+  window_t* window = surface->window;
+  if (window->addr != surface->addr || window->screen_x != surface->x ||
+      window->screen_y != surface->y || window->width != surface->width ||
+      window->height != surface->height || window->flip != surface->flip) {
+    surface_t old = *surface;
+    surface_sync(surface);
+    surface_expose(&old);
+    surface_expose(surface);
+    return true;
+  }
+
+  if (rects == NULL) {
+    surface_expose(surface);
+    return true;
+  }
+  for (int32_t i = 0; i < nb_rect; i++) {
+    // Map the rows of the region to the screen, upside down when flipped
+    int32_t y0 = surface->flip ? surface->height - rects[i].y1 : rects[i].y0;
+    int32_t y1 = surface->flip ? surface->height - rects[i].y0 : rects[i].y1;
+    compositor_expose(surface->x + max(rects[i].x0, 0), surface->y + max(y0, 0),
+                      surface->x + min(rects[i].x1, surface->width),
+                      surface->y + min(y1, surface->height));
+  }
+  return true;
+}
+
+/**
+ * Compose a region of the screen from the background and the windows over
+ * it, bottom to top, into the back buffer.
+ * \param x0,y0 Top-left corner, inclusive.
+ * \param x1,y1 Bottom-right corner, exclusive.
+ */
+void compositor_expose(int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+  x0 = max(x0, 0);
+  y0 = max(y0, 0);
+  x1 = min(x1, screen_w);
+  y1 = min(y1, screen_h);
+  if (x0 >= x1 || y0 >= y1 || buffer_addr == 0) return;
+
+  // The background is black, as after a clear
+  pixel_t* dst = (pixel_t*)buffer_addr;
+  for (int32_t y = y0; y < y1; y++) {
+    kmemset(dst + y * buffer_stride + x0, 0, (x1 - x0) * sizeof(pixel_t));
+  }
+  for (int32_t i = 0; i < nb_stacked; i++) {
+    surface_paint(&surfaces[z_order[i]], x0, y0, x1, y1);
+  }
+  kgraphic_mark_dirty(x0, y0, x1 - x0, y1 - y0);
+}
+
+/**
+ * Whether any window is attached.
+ */
+bool compositor_active() { return nb_stacked > 0; }
@@ -1,6 +1,14 @@
 #include "executable.h"
+#include "compositor.h"
+#include "keyboard.h"
+#include "kgraphic.h"
+#include "ksched.h"
+#include "ktime.h"
 #include "term.h"
 
+// Defined in kprint.c
+extern keyboard_t keyboard;
+
 exe_info_t* exe_list = NULL;
 exe_info_t* current_exe = NULL;
 
@@ -396,7 +404,17 @@ bool run_exe(const char* exe_name) {
   if (!load_exe(exe_name, &fn)) {
     return false;
   }
+  // load_exe() unmapped the lower half, with the pages the kernel shares
+  vdso_map();
+  kb_map_ring(&keyboard);
+  // The program being replaced gives the screen back and its windows leave
+  // the compositor. Its mapping of the screen went with the lower half.
+  kgraphic_release_user(task_current()->pid);
+  compositor_detach_pid(task_current()->pid);
   term_init();
+
+  // The name passed in may live in the unmapped user image, so use ours
+  if (task_create_user(current_exe->exe_name) == NULL) return false;
   to_usermode(fn);
   return true;
 }
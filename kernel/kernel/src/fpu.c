@@ -0,0 +1,260 @@
+#include "fpu.h"
+
+#include "util.h"
+
+// Defined in ksched.c
+extern cpu_t cpus[MAX_NB_CPU];
+extern int32_t nb_cpu_online;
+
+// How the FPU state is saved on this machine
+bool fpu_has_xsave = false;
+bool fpu_has_xsaveopt = false;
+uint64_t fpu_xcr0 = 0;
+size_t fpu_size = FXSAVE_SIZE;
+// Set once fpu_init() has run; the kernel keeps off the FPU until then
+bool fpu_ready = false;
+
+/******************************************************************************/
+// Helper functions
+static inline void xsetbv(uint32_t index, uint64_t value) {
+  __asm__ volatile("xsetbv"
+                   :
+                   : "c"(index), "a"((uint32_t)value),
+                     "d"((uint32_t)(value >> 32)));
+}
+
+static inline void clts() { __asm__ volatile("clts"); }
+
+/**
+ * Set or clear CR0.TS. Writing CR0 is serializing, so skip it when the bit
+ * already has the right value.
+ * \param cpu The current CPU.
+ * \param ts New value of CR0.TS.
+ */
+void fpu_set_ts(cpu_t* cpu, bool ts) {
+  if (cpu->fpu_ts == ts) return;
+  if (ts) {
+    write_cr0(read_cr0() | CR0_TS);
+  } else {
+    clts();
+  }
+  cpu->fpu_ts = ts;
+}
+
+/**
+ * Save the FPU registers into the task's save area. XSAVEOPT skips the
+ * components that are still in their initial state or were not modified since
+ * they were last restored.
+ * \param task Owner of the registers.
+ */
+void fpu_save(task_t* task) {
+  if (fpu_has_xsaveopt) {
+    __asm__ volatile("xsaveopt64 (%0)"
+                     :
+                     : "r"(task->fpu_state), "a"((uint32_t)fpu_xcr0),
+                       "d"((uint32_t)(fpu_xcr0 >> 32))
+                     : "memory");
+  } else if (fpu_has_xsave) {
+    __asm__ volatile("xsave64 (%0)"
+                     :
+                     : "r"(task->fpu_state), "a"((uint32_t)fpu_xcr0),
+                       "d"((uint32_t)(fpu_xcr0 >> 32))
+                     : "memory");
+  } else {
+    __asm__ volatile("fxsave64 (%0)" : : "r"(task->fpu_state) : "memory");
+  }
+}
+
+/**
+ * Load the FPU registers from the task's save area.
+ * \param task The task.
+ */
+void fpu_restore(task_t* task) {
+  if (fpu_has_xsave) {
+    __asm__ volatile("xrstor64 (%0)"
+                     :
+                     : "r"(task->fpu_state), "a"((uint32_t)fpu_xcr0),
+                       "d"((uint32_t)(fpu_xcr0 >> 32))
+                     : "memory");
+  } else {
+    __asm__ volatile("fxrstor64 (%0)" : : "r"(task->fpu_state) : "memory");
+  }
+}
+
+/**
+ * Give a task a clean FPU state the first time it uses the FPU. The save area
+ * is allocated once per task slot and kept when the slot is reused.
+ * \param task The task.
+ * \returns true if the task has a save area, else returns false.
+ */
+bool fpu_state_init(task_t* task) {
+  if (task->fpu_state == NULL) {
+    uintptr_t area = (uintptr_t)kmalloc(fpu_size + FPU_STATE_ALIGN);
+    if (area == 0) return false;
+    area = (area + FPU_STATE_ALIGN - 1) & ~(uintptr_t)(FPU_STATE_ALIGN - 1);
+    task->fpu_state = (void*)area;
+  }
+
+  // An all-zero XSAVE header restores every component to its initial state,
+  // except MXCSR which is always loaded from the legacy area
+  uint8_t* state = (uint8_t*)task->fpu_state;
+  kmemset(state, 0, fpu_size);
+  *(uint16_t*)&state[0] = FPU_DEFAULT_FCW;
+  *(uint32_t*)&state[24] = FPU_DEFAULT_MXCSR;
+  task->fpu_used = true;
+  return true;
+}
+
+/******************************************************************************/
+/**
+ * Detect XSAVE support, program XCR0 and size the per-task save area. Call
+ * after SSE is enabled and before any task is created. CR0.TS is set so the
+ * first FPU instruction of every task traps into fpu_handle_nm().
+ */
+void fpu_init() {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  bool has_avx = ecx & (1 << 28);
+  fpu_has_xsave = ecx & (1 << 26);
+
+  if (fpu_has_xsave) {
+    write_cr4(read_cr4() | CR4_OSXSAVE);
+
+    // Only enable the components user code can actually touch
+    cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+    uint64_t supported = ((uint64_t)edx << 32) | eax;
+    fpu_xcr0 = XCR0_X87 | XCR0_SSE;
+    if (has_avx && (supported & XCR0_AVX)) fpu_xcr0 |= XCR0_AVX;
+    xsetbv(0, fpu_xcr0);
+
+    // EBX now reports the area size for the enabled components
+    cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+    fpu_size = ebx;
+
+    cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+    fpu_has_xsaveopt = eax & 0x1;
+  }
+
+  // Nobody owns the registers yet: the first FPU instruction traps
+  write_cr0(read_cr0() | CR0_TS);
+  this_cpu()->fpu_ts = true;
+  fpu_ready = true;
+}
+
+/**
+ * Give an application processor the FPU setup fpu_init() chose on the boot
+ * CPU. Call on that CPU once it is started.
+ */
+void fpu_init_cpu() {
+  if (fpu_has_xsave) {
+    write_cr4(read_cr4() | CR4_OSXSAVE);
+    xsetbv(0, fpu_xcr0);
+  }
+  write_cr0(read_cr0() | CR0_TS);
+  this_cpu()->fpu_ts = true;
+}
+
+/**
+ * Size in bytes of the FPU state saved for each task.
+ */
+size_t fpu_state_size() { return fpu_size; }
+
+/**
+ * Update CR0.TS when switching tasks on the current CPU. Registers are left
+ * untouched: a task that did not use the FPU never pays for a save or restore.
+ * \param cpu The current CPU.
+ * \param prev The task being switched out.
+ * \param next The task being switched in.
+ */
+void fpu_switch(cpu_t* cpu, task_t* prev, task_t* next) {
+  // The kernel's registers would be lost with the switch
+  if (cpu->fpu_kernel) {
+    kperror("[ERROR] fpu_switch: %s slept in a kernel FPU section\n",
+            prev->name);
+    halt();
+  }
+
+  // With other CPUs online the task may be picked up elsewhere before it next
+  // runs here, so its registers have to reach memory now
+  if (nb_cpu_online > 1 && cpu->fpu_owner == prev && !cpu->fpu_ts &&
+      prev->fpu_cpu == cpu->id) {
+    fpu_save(prev);
+  }
+
+  // The registers still hold next's state if nobody used them since
+  fpu_set_ts(cpu, !(cpu->fpu_owner == next && next->fpu_cpu == cpu->id));
+}
+
+/**
+ * Handle the #NM (device not available) fault raised by the first FPU/SSE
+ * instruction after a switch: save the registers of the previous owner and
+ * load the current task's state.
+ */
+void fpu_handle_nm() {
+  cpu_t* cpu = this_cpu();
+  task_t* task = cpu->current;
+  fpu_set_ts(cpu, false);
+
+  if (cpu->fpu_owner == task && task->fpu_cpu == cpu->id) return;
+
+  // Park the previous owner's registers in its save area
+  task_t* owner = cpu->fpu_owner;
+  if (owner != NULL && owner->fpu_cpu == cpu->id) {
+    fpu_save(owner);
+    owner->fpu_cpu = -1;
+  }
+
+  if (!task->fpu_used && !fpu_state_init(task)) {
+    kperror("[ERROR] fpu_handle_nm: cannot allocate FPU state for %s\n",
+            task->name);
+    halt();
+  }
+  fpu_restore(task);
+  task->fpu_cpu = cpu->id;
+  cpu->fpu_owner = task;
+}
+
+/**
+ * Forget the FPU state of a task that exits.
+ * \param task The exiting task.
+ */
+void fpu_task_exit(task_t* task) {
+  for (int32_t i = 0; i < MAX_NB_CPU; i++) {
+    cpu_t* cpu = &cpus[i];
+    if (cpu->fpu_owner == task) cpu->fpu_owner = NULL;
+  }
+  task->fpu_cpu = -1;
+}
+
+/**
+ * Allow kernel code to use SSE/AVX registers. The registers of the task that
+ * owns them are saved first. Must not sleep before fpu_kernel_end().
+ * \returns false before fpu_init() or inside another kernel FPU section (an
+ * interrupt handler that landed in one), in which case the caller must stick
+ * to the general registers and not call fpu_kernel_end().
+ */
+bool fpu_kernel_begin() {
+  if (!fpu_ready) return false;
+  cpu_t* cpu = this_cpu();
+  // Claim the section first so an interrupt handler cannot enter it too
+  if (cpu->fpu_kernel) return false;
+  cpu->fpu_kernel = true;
+
+  fpu_set_ts(cpu, false);
+  task_t* owner = cpu->fpu_owner;
+  if (owner != NULL && owner->fpu_cpu == cpu->id) {
+    fpu_save(owner);
+    owner->fpu_cpu = -1;
+  }
+  cpu->fpu_owner = NULL;
+  return true;
+}
+
+/**
+ * End a kernel FPU section started by fpu_kernel_begin().
+ */
+void fpu_kernel_end() {
+  cpu_t* cpu = this_cpu();
+  cpu->fpu_kernel = false;
+  fpu_set_ts(cpu, true);
+}
@@ -11,7 +11,7 @@
 #include <stdint.h>
 #include <string.h>
 
-#define MAX_GDT_SIZE 256
+#define MAX_GDT_SIZE (TSS_SELECTOR_CPU(MAX_NB_CPU))
 
 // Reserve space for a GDT that we'll fill in below
 // Reserve space for interrupt handlers to use as a stack
@@ -78,8 +78,8 @@ typedef struct tss {
   uint16_t iomap;
 } __attribute__((packed)) tss_t;
 
-// Declare a task state segment
-tss_t tss;
+// Declare a task state segment for each CPU
+tss_t tss[MAX_NB_CPU];
 
 // Struct definition for a system descriptor
 typedef struct sys_descriptor {
@@ -129,22 +129,57 @@ void gdt_setup() {
   gdt_data_descriptor(KERNEL_DATA_SELECTOR, false);
 
   // Create the user code and data descriptors
-  gdt_code_descriptor(USER_CODE_SELECTOR, true);
   gdt_data_descriptor(USER_DATA_SELECTOR, true);
+  gdt_code_descriptor(USER_CODE_SELECTOR, true);
 
-  // Set up Task State Descriptor
-  gdt_tss_descriptor(TSS_SELECTOR, &tss);
+  // Set up Task State Descriptors
+  for (int32_t cpu = 0; cpu < MAX_NB_CPU; cpu++) {
+    gdt_tss_descriptor(TSS_SELECTOR_CPU(cpu), &tss[cpu]);
+  }
 
+  // Interrupts delivered while in user mode should use this stack pointer
+  gdt_load_cpu(0, (uintptr_t)interrupt_stack + sizeof(interrupt_stack) - 8);
+}
+
+/**
+ * Load the GDT on the calling CPU, reload its segment registers (the
+ * bootloader's selectors point elsewhere in our GDT) and load its TSS.
+ * \param cpu Index of the calling CPU.
+ * \param rsp0 Stack pointer loaded when an interrupt arrives from user mode.
+ */
+void gdt_load_cpu(int32_t cpu, uintptr_t rsp0) {
   // Load the GDT
   gdt_record_t record = {.sz = gdt_size - 1, .base = gdt};
   __asm__("lgdt %0" ::"m"(record));
 
+  // A far return reloads CS; an interrupt returning to the old CS would load
+  // a TSS descriptor
+  __asm__ volatile(
+      "pushq %[cs]\n\t"
+      "leaq 1f(%%rip), %%rax\n\t"
+      "pushq %%rax\n\t"
+      "lretq\n"
+      "1:\n\t"
+      "movw %[ds], %%ax\n\t"
+      "movw %%ax, %%ds\n\t"
+      "movw %%ax, %%es\n\t"
+      "movw %%ax, %%ss"
+      :
+      : [cs] "i"(KERNEL_CODE_SELECTOR), [ds] "i"(KERNEL_DATA_SELECTOR)
+      : "rax", "memory");
+
   // Zero out the TSS
-  kmemset(&tss, 0, sizeof(tss));
+  kmemset(&tss[cpu], 0, sizeof(tss_t));
+  tss[cpu].rsp0 = rsp0;
 
-  // Interrupts delivered while in user mode should use this stack pointer
-  tss.rsp0 = (uintptr_t)interrupt_stack + sizeof(interrupt_stack) - 8;
-  
   // Load the TSS
-  __asm__("ltr %%ax" ::"a"(TSS_SELECTOR));
+  __asm__("ltr %%ax" ::"a"(TSS_SELECTOR_CPU(cpu)));
 }
+
+/**
+ * Set the stack pointer loaded by the CPU when an interrupt or system call
+ * arrives from user mode.
+ * \param cpu Index of the calling CPU.
+ * \param rsp0 Top of the kernel stack of the current task.
+ */
+void gdt_set_kernel_stack(int32_t cpu, uintptr_t rsp0) { tss[cpu].rsp0 = rsp0; }
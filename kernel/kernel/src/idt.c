@@ -1,17 +1,35 @@
 #include "idt.h"
 
+#include "apic.h"
+#include "fpu.h"
 #include "gdt.h"
 #include "keyboard.h"
+#include "klatency.h"
 #include "kprint.h"
+#include "ksched.h"
 #include "pic.h"
 #include "port.h"
+#include "softirq.h"
 #include "syscall.h"
+#include "timer.h"
 #include "util.h"
+#include "waitq.h"
 
 #define KB_IN_PORT 0x60
 
 // keyboard is initialized in kprint.c
 extern keyboard_t keyboard;
+extern waitq_t keyboard_waitq;
+
+/**
+ * Deferred part of the keyboard interrupt: translate the saved scan codes and
+ * wake the readers blocked in kget_c.
+ */
+void keyboard_work_fn(softirq_work_t* work, void* arg) {
+  kb_process_raw(&keyboard);
+  waitq_wake_all(&keyboard_waitq);
+}
+softirq_work_t keyboard_work = SOFTIRQ_WORK_INIT(keyboard_work_fn, NULL);
 /**
  * External functions for system call handler
  *  syscall is defined in asm/syscall.s
@@ -26,6 +44,9 @@ extern void syscall_entry();
 idt_entry_t idt[IDT_NUM_ENTRIES] __attribute__((aligned(8)));
 
 // HANDLERS
+// Only the handlers that return are timed with lat_record_irq(). Every
+// exception but #NM halts, and a page fault ends the program or halts, so
+// there is no exit to time.
 __attribute__((interrupt)) void idt_handler_div_error(
     interrupt_context_t* ctx) {
   kprint_s("[INT 0] Divide Error\n");
@@ -67,10 +88,12 @@ __attribute__((interrupt)) void idt_handler_invalid_opcode(
   halt();
 }
 
+// Raised by the first FPU/SSE instruction after a task switch (CR0.TS is set)
 __attribute__((interrupt)) void idt_handler_dev_unavailable(
     interrupt_context_t* ctx) {
-  kprint_s("[INT 7] Device Not Available (No Math Coprocessor)\n");
-  halt();
+  uint64_t start = read_tsc();
+  fpu_handle_nm();
+  lat_record_irq(7, start);
 }
 
 __attribute__((interrupt)) void idt_handler_double_fault(
@@ -111,6 +134,15 @@ __attribute__((interrupt)) void idt_handler_general_proc(
 
 __attribute__((interrupt)) void idt_handler_page_fault(interrupt_context_t* ctx,
                                                        uint64_t ec) {
+  task_t* task = task_current();
+  if (task != NULL) task->nr_page_fault++;
+
+  // A fault in user mode only kills the faulting program
+  if ((ec & PF_EC_USER) && task != NULL) {
+    kperror("[INT 14] Page Fault in %s at %p (ec = %d)\n", task->name,
+            read_cr2(), ec);
+    exit_handler();
+  }
   kprintf("[INT 14] Page Fault (ec = %d)\n", ec);
   halt();
 }
@@ -153,10 +185,63 @@ __attribute__((interrupt)) void idt_handler_ctrl_proc_exception(
 
 // KEYBOARD INTERRUPT
 __attribute__((interrupt)) void idt_handler_keyboard(interrupt_context_t* ctx) {
-  // Read the scan code value from keyboard and pass it to the keyboard obj
-  kb_input_scan_code(&keyboard, inb(KB_IN_PORT));
+  uint64_t start = read_tsc();
+  bool from_user = ctx->cs & 0x3;
+  if (from_user) acct_enter_kernel();
+  softirq_irq_enter();
+
+  // Read the scan code and leave the rest of the work for later
+  kb_push_raw(&keyboard, inb(KB_IN_PORT), start);
+  softirq_raise(&keyboard_work);
   // Acknowledge the interrupt
-  outb(PIC1_COMMAND, PIC_EOI);
+  irq_eoi(1);
+
+  // The deferred work is not part of the hard IRQ time
+  lat_record_irq(IRQ1_INTERRUPT, start);
+  softirq_irq_exit();
+  if (from_user) acct_exit_kernel();
+}
+
+// TIMER INTERRUPT (LAPIC timer or PIT, both recorded under TIMER_VECTOR)
+__attribute__((interrupt)) void idt_handler_timer(interrupt_context_t* ctx) {
+  uint64_t start = read_tsc();
+  bool from_user = ctx->cs & 0x3;
+  if (from_user) acct_enter_kernel();
+  softirq_irq_enter();
+
+  // Run the expired timers and acknowledge the interrupt
+  timer_interrupt();
+
+  lat_record_irq(TIMER_VECTOR, start);
+  softirq_irq_exit();
+  if (from_user) acct_exit_kernel();
+}
+
+// RESCHEDULE IPI: only wakes the CPU; its idle loop then calls schedule()
+__attribute__((interrupt)) void idt_handler_resched(interrupt_context_t* ctx) {
+  uint64_t start = read_tsc();
+  bool from_user = ctx->cs & 0x3;
+  if (from_user) acct_enter_kernel();
+  lapic_eoi();
+  lat_record_irq(RESCHED_VECTOR, start);
+  if (from_user) acct_exit_kernel();
+}
+
+// LOCAL APIC INTERRUPTS
+// A spurious interrupt is not in service, so it must not be acknowledged
+__attribute__((interrupt)) void idt_handler_apic_spurious(
+    interrupt_context_t* ctx) {
+  lat_record_irq(APIC_SPURIOUS_VECTOR, read_tsc());
+}
+
+__attribute__((interrupt)) void idt_handler_apic_error(
+    interrupt_context_t* ctx) {
+  uint64_t start = read_tsc();
+  // Writing the ESR latches the errors so they can be read
+  lapic_write(LAPIC_ESR, 0);
+  kperror("[ERROR] APIC error (esr = %x)\n", lapic_read(LAPIC_ESR));
+  lapic_eoi();
+  lat_record_irq(APIC_ERROR_VECTOR, start);
 }
 
 /******************************************************************************/
@@ -226,10 +311,30 @@ void idt_setup() {
   // Setup keyboard system handler
   idt_set_handler(IRQ1_INTERRUPT, idt_handler_keyboard, IDT_TYPE_INTERRUPT);
 
+  // Setup timer handlers
+  idt_set_handler(IRQ0_INTERRUPT, idt_handler_timer, IDT_TYPE_INTERRUPT);
+  idt_set_handler(TIMER_VECTOR, idt_handler_timer, IDT_TYPE_INTERRUPT);
+
+  // Setup the reschedule IPI handler
+  idt_set_handler(RESCHED_VECTOR, idt_handler_resched, IDT_TYPE_INTERRUPT);
+
+  // Setup local APIC handlers
+  idt_set_handler(APIC_SPURIOUS_VECTOR, idt_handler_apic_spurious,
+                  IDT_TYPE_INTERRUPT);
+  idt_set_handler(APIC_ERROR_VECTOR, idt_handler_apic_error,
+                  IDT_TYPE_INTERRUPT);
+
   // Setup system call handler
   idt_set_handler(0x80, syscall_entry, IDT_TYPE_TRAP);
 
   // Step 3: Install the IDT
+  idt_load();
+}
+
+/**
+ * Install the IDT on the calling CPU. idt_setup() does it for the boot CPU.
+ */
+void idt_load() {
   idt_record_t record = {.size = sizeof(idt), .base = idt};
   __asm__("lidt %0" ::"m"(record));
 }
\ No newline at end of file
@@ -1,6 +1,10 @@
 #include "keyboard.h"
 
+#include "kmem.h"
 #include "kprint.h"
+#include "page.h"
+#include "port.h"
+#include "util.h"
 
 // True characters based on the scan code
 char pressed_key1[] =
@@ -21,9 +25,13 @@ char pressed_key2[] =
 void cq_init(circular_queue_t* cq) {
   if (cq == NULL) return;
 
+  uint64_t flags = irq_save();
+  spin_lock(&cq->lock);
   cq->size = 0;
   cq->read = 0;
   cq->write = 0;
+  spin_unlock(&cq->lock);
+  irq_restore(flags);
 }
 
 /**
@@ -40,8 +48,12 @@ void cq_init(circular_queue_t* cq) {
 bool cq_read(circular_queue_t* cq, uint64_t* read_val) {
   if (cq == NULL || read_val == NULL) return false;
 
+  uint64_t flags = irq_save();
+  spin_lock(&cq->lock);
   if (cq_is_empty(cq)) {
     // If the buffer is empty, we return false
+    spin_unlock(&cq->lock);
+    irq_restore(flags);
     return false;
   } else {
     // If the buffer is not empty ...
@@ -51,6 +63,8 @@ bool cq_read(circular_queue_t* cq, uint64_t* read_val) {
     cq->read = (cq->read + 1) % KEYBOARD_BUFFER_SIZE;
     // Decrease the size of buffer
     cq->size--;
+    spin_unlock(&cq->lock);
+    irq_restore(flags);
     return true;
   }
 }
@@ -68,6 +82,8 @@ bool cq_read(circular_queue_t* cq, uint64_t* read_val) {
 void cq_write(circular_queue_t* cq, uint64_t write_val) {
   if (cq == NULL) return;
 
+  uint64_t flags = irq_save();
+  spin_lock(&cq->lock);
   if (cq_is_full(cq)) {
     // If the buffer is full, we overwrite value to buffer
     (cq->buffer)[cq->write] = write_val;
@@ -83,6 +99,44 @@ void cq_write(circular_queue_t* cq, uint64_t write_val) {
     // Increase the size of buffer
     cq->size++;
   }
+  spin_unlock(&cq->lock);
+  irq_restore(flags);
+}
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Write a press or release to the event ring and update the key-down bitmap.
+ * The event is complete before head moves, so readers never see it half
+ * written.
+ * \param kb Pointer to keyboard object.
+ * \param val Value of the scan code.
+ * \param tsc TSC when the scan code arrived.
+ */
+void kb_record_event(keyboard_t* kb, uint64_t val, uint64_t tsc) {
+  bool extended = kb->extended;
+  kb->extended = false;
+  key_ring_t* ring = kb->ring;
+  if (ring == NULL) return;
+
+  uint8_t key = (val & ~RELEASE_SS_MASK) | (extended ? KEY_EXTENDED : 0);
+  bool pressed = !(val & RELEASE_SS_MASK);
+  if (pressed) {
+    ring->key_down[key >> 6] |= 1ULL << (key & 63);
+  } else {
+    ring->key_down[key >> 6] &= ~(1ULL << (key & 63));
+  }
+
+  uint64_t head = ring->head;
+  volatile key_event_t* event = &ring->events[head & KEY_RING_MASK];
+  event->tsc = tsc;
+  event->key = key;
+  event->pressed = pressed;
+  event->modifiers = (kb->shift ? KEY_MOD_SHIFT : 0) |
+                     (kb->ctrl ? KEY_MOD_CTRL : 0) |
+                     (kb->alt ? KEY_MOD_ALT : 0) |
+                     (kb->capslock ? KEY_MOD_CAPSLOCK : 0);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
 /******************************************************************************/
@@ -107,6 +161,37 @@ void kb_init(keyboard_t* kb) {
   kb->buffer.read = 0;
   kb->buffer.write = 0;
   kb->buffer.size = 0;
+  kb->extended = false;
+}
+
+/**
+ * Map the keyboard event ring read-only at USER_KEYBOARD, so user programs can
+ * poll keys without a system call (see input.h). The ring is allocated on the
+ * first call. Loading an executable unmaps the lower half, so run_exe() maps
+ * the ring again for each program.
+ * \param kb Pointer to keyboard object.
+ * \returns true if the ring is mapped, else returns false.
+ */
+bool kb_map_ring(keyboard_t* kb) {
+  if (kb == NULL) return false;
+
+  if (kb->ring_page == 0) {
+    uintptr_t page = pmem_alloc();
+    if (page == 0) {
+      kperror("[ERROR] kb_map_ring: cannot allocate the event ring\n");
+      return false;
+    }
+    kmemset((void*)ptov(page), 0, PAGE_SIZE);
+    kb->ring_page = page;
+  }
+
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  if (!vm_map_phys(proot, USER_KEYBOARD, kb->ring_page, true, false, false)) {
+    kperror("[ERROR] kb_map_ring: cannot map the event ring\n");
+    return false;
+  }
+  kb->ring = (key_ring_t*)ptov(kb->ring_page);
+  return true;
 }
 
 /**
@@ -127,9 +212,15 @@ void kb_init(keyboard_t* kb) {
  *
  * \param kb Pointer to keyboard object.
  * \param val Value of the scan code.
+ * \param tsc TSC when the scan code arrived.
  */
-void kb_input_scan_code(keyboard_t* kb, uint64_t val) {
+void kb_input_scan_code(keyboard_t* kb, uint64_t val, uint64_t tsc) {
   if (kb == NULL) return;
+  // The next byte is the extended key's scan code
+  if (val == EXTENDED_SS) {
+    kb->extended = true;
+    return;
+  }
 
   switch (val) {
     // If the Alt key is pressed, we toggle alt variable with ALT_ON_MASK
@@ -165,6 +256,53 @@ void kb_input_scan_code(keyboard_t* kb, uint64_t val) {
                  val | kb->alt | kb->ctrl | kb->shift | kb->capslock);
       }
   }
+
+  // Record the event with the modifiers updated by this key
+  kb_record_event(kb, val, tsc);
+}
+
+/**
+ * Save a scan code read by the interrupt handler. The slow part of the work
+ * is left to kb_process_raw(). If the raw buffer is full, the scan code is
+ * dropped.
+ * \param kb Pointer to keyboard object.
+ * \param val Value of the scan code.
+ * \param tsc TSC when the scan code arrived.
+ * \returns true if the scan code is saved, else returns false.
+ */
+bool kb_push_raw(keyboard_t* kb, uint8_t val, uint64_t tsc) {
+  if (kb == NULL) return false;
+
+  uint32_t head = kb->raw_head;
+  if (head - __atomic_load_n(&kb->raw_tail, __ATOMIC_ACQUIRE) >=
+      KEYBOARD_RAW_SIZE) {
+    return false;
+  }
+  kb->raw_code[head & KEYBOARD_RAW_MASK] = val;
+  kb->raw_tsc[head & KEYBOARD_RAW_MASK] = tsc;
+  __atomic_store_n(&kb->raw_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * Feed the saved scan codes to kb_input_scan_code(). Runs outside of the
+ * interrupt handler, with interrupts enabled.
+ * \param kb Pointer to keyboard object.
+ * \returns the number of scan codes processed.
+ */
+size_t kb_process_raw(keyboard_t* kb) {
+  if (kb == NULL) return 0;
+
+  size_t nb_processed = 0;
+  uint32_t tail = kb->raw_tail;
+  while (tail != __atomic_load_n(&kb->raw_head, __ATOMIC_ACQUIRE)) {
+    kb_input_scan_code(kb, kb->raw_code[tail & KEYBOARD_RAW_MASK],
+                       kb->raw_tsc[tail & KEYBOARD_RAW_MASK]);
+    tail++;
+    __atomic_store_n(&kb->raw_tail, tail, __ATOMIC_RELEASE);
+    nb_processed++;
+  }
+  return nb_processed;
 }
 
 /**
@@ -1,16 +1,351 @@
 #include "kgraphic.h"
 
+#include "fpu.h"
 #include "psf.h"
 
 extern struct stivale2_struct_tag_framebuffer* framebuffer_struct_tag;
+extern struct stivale2_struct_tag_hhdm* hhdm_struct_tag;
 
 int32_t screen_w = 0;
 int32_t screen_h = 0;
+// Where the kernel draws: the back buffer once it exists, else the screen if
+// its layout is XRGB8888, else nothing. Rows are buffer_stride pixels apart.
 uintptr_t buffer_addr = 0;
+int32_t buffer_stride = 0;
+// The framebuffer scanned out to the screen, and its physical address
+uintptr_t scanout_addr = 0;
+uintptr_t buffer_paddr = 0;
+
+// Layout of the framebuffer, and the function converting a row of XRGB8888
+// pixels to it
+pixel_format_t scanout_format = PIXEL_FORMAT_MASKS;
+size_t scanout_pitch = 0;
+int32_t scanout_bytes = 0;  // Bytes per pixel
+// Whether rows are packed (pitch == width * bytes), so full rows are one span
+bool scanout_packed = false;
+kgraphic_blit_t kgraphic_blit = NULL;
+// SSE2 blitter of the layout, or NULL. Only run between fpu_kernel_begin() and
+// fpu_kernel_end(); kgraphic_blit is used when the FPU is not available.
+kgraphic_blit_t kgraphic_blit_sse2 = NULL;
+
+// Changed span [dirty_x0[y], dirty_x1[y]) of each row of the back buffer, and
+// the rows [dirty_y0, dirty_y1) that have one
+int32_t* dirty_x0 = NULL;
+int32_t* dirty_x1 = NULL;
+int32_t dirty_y0 = 0;
+int32_t dirty_y1 = 0;
+
+// With page flipping, the framebuffer holds two pages and scanout_addr is the
+// one on screen. The spans [stale_x0[y], stale_x1[y]) of rows
+// [stale_y0, stale_y1) are where the hidden page lags the back buffer.
+uintptr_t page_addr[2] = {0, 0};
+int32_t front_page = 0;
+int32_t* stale_x0 = NULL;
+int32_t* stale_x1 = NULL;
+int32_t stale_y0 = 0;
+int32_t stale_y1 = 0;
+
+// Pid of the process the framebuffer is mapped into, 0 if none
+int64_t framebuffer_owner = 0;
+
+/******************************************************************************/
+// Helper functions
+// Number of bytes of the framebuffer, rounded up to whole pages
+size_t kgraphic_mapped_size() {
+  size_t size = (size_t)framebuffer_struct_tag->framebuffer_pitch * screen_h;
+  return (size + PAGE_SIZE - 1) & PAGE_ALIGN_MASK;
+}
+
+// TSC cycles taken to write every row of the framebuffer mapped at addr back
+// with its current content. Rows are read outside the timed part.
+uint64_t kgraphic_time_rewrite(uintptr_t addr) {
+  size_t row_size = scanout_pitch;
+  void* row = kmalloc(row_size);
+  if (row == NULL) return 0;
+
+  uint64_t cycles = 0;
+  for (int32_t y = 0; y < screen_h; y++) {
+    void* dst = (void*)(addr + y * scanout_pitch);
+    kmemcpy(row, dst, row_size);
+    uint64_t start = read_tsc();
+    kmemcpy(dst, row, row_size);
+    // Drain the write-combining buffers before stopping the clock
+    __asm__ volatile("sfence" ::: "memory");
+    cycles += read_tsc() - start;
+  }
+  kfree(row);
+  return cycles;
+}
+
+// Row converters from XRGB8888. Each stores a group of pixels with 8- or 4-byte
+// stores, which write-combining merges into full cache line bursts, and the
+// remaining pixels one by one. The kernel is built without SSE, so these use
+// the general registers; XRGB8888 and RGB888 also have an SSE2 version below.
+#define KGRAPHIC_BLITTER(name, group, bytes, store_group, store_one)       \
+  void name(uint8_t* dst, const pixel_t* src, int32_t nb_pixel) {          \
+    int32_t i = 0;                                                         \
+    for (; i + (group) <= nb_pixel; i += (group)) {                        \
+      store_group(dst + i * (bytes), src + i);                             \
+    }                                                                      \
+    for (; i < nb_pixel; i++) store_one(dst + i * (bytes), src[i]);        \
+  }
+
+// Two pixels at a time. The back buffer is written as pixel_t, so the copies
+// need a type that may alias it.
+typedef uint64_t __attribute__((may_alias)) pixel_pair_t;
+
+// XRGB8888: 8 pixels as four 8-byte copies
+void store_xrgb8888_group(uint8_t* dst, const pixel_t* src) {
+  pixel_pair_t* dst_pair = (pixel_pair_t*)dst;
+  const pixel_pair_t* src_pair = (const pixel_pair_t*)src;
+  dst_pair[0] = src_pair[0];
+  dst_pair[1] = src_pair[1];
+  dst_pair[2] = src_pair[2];
+  dst_pair[3] = src_pair[3];
+}
+
+void store_xrgb8888(uint8_t* dst, pixel_t pixel) { *(pixel_t*)dst = pixel; }
+
+// RGB888: 4 pixels packed into three 4-byte stores (B, G, R byte order)
+void store_rgb888_group(uint8_t* dst, const pixel_t* src) {
+  uint32_t p0 = src[0] & 0xFFFFFF;
+  uint32_t p1 = src[1] & 0xFFFFFF;
+  uint32_t p2 = src[2] & 0xFFFFFF;
+  uint32_t p3 = src[3] & 0xFFFFFF;
+  uint32_t* dst_word = (uint32_t*)dst;
+  dst_word[0] = p0 | (p1 << 24);
+  dst_word[1] = (p1 >> 8) | (p2 << 16);
+  dst_word[2] = (p2 >> 16) | (p3 << 8);
+}
+
+void store_rgb888(uint8_t* dst, pixel_t pixel) {
+  dst[0] = pixel;
+  dst[1] = pixel >> 8;
+  dst[2] = pixel >> 16;
+}
+
+// RGB565: 4 pixels packed into one 8-byte store
+uint64_t rgb565(pixel_t pixel) {
+  return ((pixel >> 8) & 0xF800) | ((pixel >> 5) & 0x07E0) |
+         ((pixel >> 3) & 0x001F);
+}
+
+void store_rgb565_group(uint8_t* dst, const pixel_t* src) {
+  *(uint64_t*)dst = rgb565(src[0]) | (rgb565(src[1]) << 16) |
+                    (rgb565(src[2]) << 32) | (rgb565(src[3]) << 48);
+}
+
+void store_rgb565(uint8_t* dst, pixel_t pixel) {
+  *(uint16_t*)dst = rgb565(pixel);
+}
+
+// Any other layout: each channel is scaled to its mask size and shifted to
+// its place, as the framebuffer tag describes them
+uint32_t channel_to_mask(uint32_t value, uint8_t size, uint8_t shift) {
+  value = size <= 8 ? value >> (8 - size) : value << (size - 8);
+  return value << shift;
+}
+
+uint32_t pixel_from_masks(pixel_t pixel) {
+  struct stivale2_struct_tag_framebuffer* tag = framebuffer_struct_tag;
+  return channel_to_mask((pixel >> 16) & 0xFF, tag->red_mask_size,
+                         tag->red_mask_shift) |
+         channel_to_mask((pixel >> 8) & 0xFF, tag->green_mask_size,
+                         tag->green_mask_shift) |
+         channel_to_mask(pixel & 0xFF, tag->blue_mask_size,
+                         tag->blue_mask_shift);
+}
+
+void store_masks(uint8_t* dst, pixel_t pixel) {
+  uint32_t value = pixel_from_masks(pixel);
+  for (int32_t i = 0; i < scanout_bytes; i++) dst[i] = value >> (8 * i);
+}
+
+void store_masks_group(uint8_t* dst, const pixel_t* src) {
+  store_masks(dst, src[0]);
+  store_masks(dst + scanout_bytes, src[1]);
+  store_masks(dst + 2 * scanout_bytes, src[2]);
+  store_masks(dst + 3 * scanout_bytes, src[3]);
+}
+
+KGRAPHIC_BLITTER(blit_xrgb8888, 8, 4, store_xrgb8888_group, store_xrgb8888)
+KGRAPHIC_BLITTER(blit_rgb888, 4, 3, store_rgb888_group, store_rgb888)
+KGRAPHIC_BLITTER(blit_rgb565, 4, 2, store_rgb565_group, store_rgb565)
+KGRAPHIC_BLITTER(blit_masks, 4, scanout_bytes, store_masks_group, store_masks)
+
+// SSE2 converters: groups of 16 pixels written with 16-byte stores. Byte
+// shifts of a whole register are shuffles with a zero vector, which compile to
+// pslldq and psrldq.
+typedef uint8_t v16u8 __attribute__((vector_size(16), aligned(1)));
+typedef uint64_t v2u64 __attribute__((vector_size(16), aligned(1)));
+
+#define V16U8_SHIFT_LEFT(v, n)                                                \
+  __builtin_shufflevector((v16u8){0}, (v), 16 - (n), 17 - (n), 18 - (n),     \
+                          19 - (n), 20 - (n), 21 - (n), 22 - (n), 23 - (n),  \
+                          24 - (n), 25 - (n), 26 - (n), 27 - (n), 28 - (n),  \
+                          29 - (n), 30 - (n), 31 - (n))
+#define V16U8_SHIFT_RIGHT(v, n)                                               \
+  __builtin_shufflevector((v), (v16u8){0}, 0 + (n), 1 + (n), 2 + (n),        \
+                          3 + (n), 4 + (n), 5 + (n), 6 + (n), 7 + (n),       \
+                          8 + (n), 9 + (n), 10 + (n), 11 + (n), 12 + (n),    \
+                          13 + (n), 14 + (n), 15 + (n))
+
+// XRGB8888: 16 pixels as four 16-byte copies
+__attribute__((target("sse2"))) void store_xrgb8888_group_sse2(
+    uint8_t* dst, const pixel_t* src) {
+  v16u8* dst_vec = (v16u8*)dst;
+  const v16u8* src_vec = (const v16u8*)src;
+  dst_vec[0] = src_vec[0];
+  dst_vec[1] = src_vec[1];
+  dst_vec[2] = src_vec[2];
+  dst_vec[3] = src_vec[3];
+}
+
+// Drop the padding byte of 4 XRGB8888 pixels: the 12 bytes of B, G, R land at
+// the bottom of the result and the top 4 bytes are zero
+__attribute__((target("sse2"))) v16u8 pack_rgb888(v16u8 pixels) {
+  // Within each 8-byte half, move the second pixel down by one byte
+  v2u64 halves = (v2u64)pixels;
+  halves = (halves & 0xFFFFFF) | ((halves >> 8) & 0xFFFFFF000000);
+  // Then move the upper half down by two bytes, next to the lower one
+  v16u8 bytes = (v16u8)halves;
+  v16u8 low = (v16u8)((v2u64)bytes & (v2u64){0xFFFFFFFFFFFF, 0});
+  return low | V16U8_SHIFT_RIGHT(bytes ^ low, 2);
+}
+
+// RGB888: 16 pixels packed into three 16-byte stores (B, G, R byte order)
+__attribute__((target("sse2"))) void store_rgb888_group_sse2(
+    uint8_t* dst, const pixel_t* src) {
+  const v16u8* src_vec = (const v16u8*)src;
+  v16u8 p0 = pack_rgb888(src_vec[0]);
+  v16u8 p1 = pack_rgb888(src_vec[1]);
+  v16u8 p2 = pack_rgb888(src_vec[2]);
+  v16u8 p3 = pack_rgb888(src_vec[3]);
+  v16u8* dst_vec = (v16u8*)dst;
+  dst_vec[0] = p0 | V16U8_SHIFT_LEFT(p1, 12);
+  dst_vec[1] = V16U8_SHIFT_RIGHT(p1, 4) | V16U8_SHIFT_LEFT(p2, 8);
+  dst_vec[2] = V16U8_SHIFT_RIGHT(p2, 8) | V16U8_SHIFT_LEFT(p3, 4);
+}
+
+__attribute__((target("sse2")))
+KGRAPHIC_BLITTER(blit_xrgb8888_sse2, 16, 4, store_xrgb8888_group_sse2,
+                 store_xrgb8888)
+__attribute__((target("sse2")))
+KGRAPHIC_BLITTER(blit_rgb888_sse2, 16, 3, store_rgb888_group_sse2,
+                 store_rgb888)
 
+/**
+ * Find the layout of the framebuffer from its tag and pick its blitter.
+ * \returns false if the pixels are not a whole number of bytes (1 to 4).
+ */
+bool kgraphic_select_blit() {
+  struct stivale2_struct_tag_framebuffer* tag = framebuffer_struct_tag;
+  bool rgb = tag->red_mask_shift == 16 && tag->green_mask_shift == 8 &&
+             tag->blue_mask_shift == 0 && tag->red_mask_size == 8 &&
+             tag->green_mask_size == 8 && tag->blue_mask_size == 8;
+  bool rgb565 = tag->red_mask_shift == 11 && tag->green_mask_shift == 5 &&
+                tag->blue_mask_shift == 0 && tag->red_mask_size == 5 &&
+                tag->green_mask_size == 6 && tag->blue_mask_size == 5;
+
+  if (tag->framebuffer_bpp == 32 && rgb) {
+    scanout_format = PIXEL_FORMAT_XRGB8888;
+    kgraphic_blit = blit_xrgb8888;
+    kgraphic_blit_sse2 = blit_xrgb8888_sse2;
+  } else if (tag->framebuffer_bpp == 24 && rgb) {
+    scanout_format = PIXEL_FORMAT_RGB888;
+    kgraphic_blit = blit_rgb888;
+    kgraphic_blit_sse2 = blit_rgb888_sse2;
+  } else if (tag->framebuffer_bpp == 16 && rgb565) {
+    scanout_format = PIXEL_FORMAT_RGB565;
+    kgraphic_blit = blit_rgb565;
+  } else if (tag->framebuffer_bpp % 8 == 0 && tag->framebuffer_bpp >= 8 &&
+             tag->framebuffer_bpp <= 32) {
+    scanout_format = PIXEL_FORMAT_MASKS;
+    kgraphic_blit = blit_masks;
+  } else {
+    kperror("[ERROR] kgraphic_init: %d bits per pixel is not supported\n",
+            tag->framebuffer_bpp);
+    return false;
+  }
+
+  scanout_bytes = tag->framebuffer_bpp / 8;
+  scanout_pitch = tag->framebuffer_pitch;
+  scanout_packed = scanout_pitch == (size_t)screen_w * scanout_bytes;
+  return true;
+}
+
+/**
+ * Copy the spans [x0[y], x1[y]) of rows [y0, y1) of the back buffer to a page
+ * of the framebuffer, converted to its layout.
+ * \returns the number of bytes written.
+ */
+uint64_t kgraphic_blit_spans(uintptr_t page, const int32_t* x0,
+                             const int32_t* x1, int32_t y0, int32_t y1) {
+  // The SSE2 blitter needs the FPU, which may not be set up yet or may be in
+  // use by the code this interrupted
+  kgraphic_blit_t blit = kgraphic_blit;
+  bool sse2 = kgraphic_blit_sse2 != NULL && y0 < y1 && fpu_kernel_begin();
+  if (sse2) blit = kgraphic_blit_sse2;
+
+  uint64_t nb_byte = 0;
+  for (int32_t y = y0; y < y1; y++) {
+    // Start on a multiple of 8 pixels so the groups of the blitters stay
+    // aligned
+    int32_t start = x0[y] & ~7;
+    int32_t end = x1[y];
+    if (start >= end) continue;
+
+    pixel_t* src = (pixel_t*)buffer_addr + y * screen_w + start;
+    uint8_t* dst = (uint8_t*)page + y * scanout_pitch + start * scanout_bytes;
+
+    // On a packed framebuffer, whole rows that follow each other are one span
+    int32_t nb_pixel = end - start;
+    if (scanout_packed && start == 0 && end == screen_w) {
+      while (y + 1 < y1 && x0[y + 1] == 0 && x1[y + 1] == screen_w) {
+        y++;
+        nb_pixel += screen_w;
+      }
+    }
+    blit(dst, src, nb_pixel);
+    nb_byte += (uint64_t)nb_pixel * scanout_bytes;
+  }
+  if (sse2) fpu_kernel_end();
+  return nb_byte;
+}
+
+// Add the dirty spans to the stale ones of the hidden page
+void kgraphic_mark_stale() {
+  for (int32_t y = dirty_y0; y < dirty_y1; y++) {
+    if (dirty_x0[y] < stale_x0[y]) stale_x0[y] = dirty_x0[y];
+    if (dirty_x1[y] > stale_x1[y]) stale_x1[y] = dirty_x1[y];
+  }
+  if (dirty_y0 < stale_y0) stale_y0 = dirty_y0;
+  if (dirty_y1 > stale_y1) stale_y1 = dirty_y1;
+}
+
+// Mark every row clean
+void kgraphic_mark_clean() {
+  for (int32_t y = 0; y < screen_h; y++) {
+    dirty_x0[y] = screen_w;
+    dirty_x1[y] = 0;
+  }
+  dirty_y0 = screen_h;
+  dirty_y1 = 0;
+}
+
+// Unmap the first size bytes at USER_SCANOUT
+void kgraphic_unmap_pages(size_t size) {
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+    vm_unmap_phys(proot, USER_SCANOUT + offset);
+  }
+}
+
+/******************************************************************************/
 /**
  * Read the framebuffer struct tag to gain information about the current
- * framebuffer. The function also initialize psf font. 
+ * framebuffer and pick the blitter of its layout. The function also initialize
+ * psf font. 
  * \returns true if init successfully else returns false.
  */
 bool kgraphic_init() {
@@ -19,7 +354,21 @@ bool kgraphic_init() {
   // Init screen information
   screen_w = framebuffer_struct_tag->framebuffer_width;
   screen_h = framebuffer_struct_tag->framebuffer_height;
-  buffer_addr = framebuffer_struct_tag->framebuffer_addr;
+  scanout_addr = framebuffer_struct_tag->framebuffer_addr;
+  // The tag holds the higher half address of the framebuffer
+  buffer_paddr = scanout_addr - hhdm_struct_tag->addr;
+  if (!kgraphic_select_blit()) return false;
+
+  // Until the back buffer exists, the kernel draws to the screen directly if
+  // it can. Text written before that is lost on other layouts.
+  if (scanout_format == PIXEL_FORMAT_XRGB8888 &&
+      scanout_pitch % sizeof(pixel_t) == 0) {
+    buffer_addr = scanout_addr;
+    buffer_stride = scanout_pitch / sizeof(pixel_t);
+  } else {
+    buffer_addr = 0;
+    buffer_stride = screen_w;
+  }
 
   // Init psf font
   if (!psf_init()) return false;
@@ -31,11 +380,280 @@ bool kgraphic_init() {
  * Set the framebuffer value to 0
  */ 
 void kgraphic_clear_buffer() {
+  if (buffer_addr == 0) return;
+
   uint64_t* cursor = (uint64_t*)buffer_addr;
   uint64_t* buffer_end_addr =
-      (uint64_t*)(buffer_addr + (screen_w * screen_h * sizeof(pixel_t)));
+      (uint64_t*)(buffer_addr + (buffer_stride * screen_h * sizeof(pixel_t)));
 
   while (cursor < buffer_end_addr) {
     *cursor++ = 0;
   }
-}
\ No newline at end of file
+  kgraphic_mark_dirty(0, 0, screen_w, screen_h);
+}
+
+/**
+ * Move the kernel's framebuffer mapping to write-combining pages, and report
+ * how many TSC cycles a full-screen write takes before and after. Call after
+ * init_free_list().
+ * \returns true if the framebuffer is write-combining, else returns false.
+ */
+bool kgraphic_write_combine() {
+  if (framebuffer_struct_tag == NULL) return false;
+
+  // Timed before pat_init(), which writes back what this leaves in the caches
+  uint64_t before = kgraphic_time_rewrite(scanout_addr);
+  if (!pat_init()) return false;
+
+  uintptr_t wc_addr = vm_map_wc(buffer_paddr, kgraphic_mapped_size());
+  if (wc_addr == 0) return false;
+
+  uint64_t after = kgraphic_time_rewrite(wc_addr);
+  if (buffer_addr == scanout_addr) buffer_addr = wc_addr;
+  scanout_addr = wc_addr;
+  kprintf("[INFO] kgraphic_write_combine: full-screen write %d -> %d cycles\n",
+          before, after);
+  return true;
+}
+
+/**
+ * Move drawing to a back buffer in RAM. Clears, window copies and text then
+ * only reach the screen when kgraphic_present() copies the changed spans.
+ * What is on screen is kept. Call after kgraphic_write_combine().
+ * \returns true if the back buffer is in use, else returns false.
+ */
+bool kgraphic_back_buffer_init() {
+  if (framebuffer_struct_tag == NULL) return false;
+
+  size_t size = screen_w * screen_h * sizeof(pixel_t);
+  pixel_t* back = kmalloc(size);
+  int32_t* x0 = kmalloc(screen_h * sizeof(int32_t));
+  int32_t* x1 = kmalloc(screen_h * sizeof(int32_t));
+  if (back == NULL || x0 == NULL || x1 == NULL) {
+    kperror("[ERROR] kgraphic_back_buffer_init: out of memory\n");
+    return false;
+  }
+  dirty_x0 = x0;
+  dirty_x1 = x1;
+
+  // Start from what is on screen if the kernel drew there. Its rows are
+  // buffer_stride pixels apart, the ones of the back buffer are packed.
+  bool drawn = buffer_addr != 0;
+  if (drawn) {
+    for (int32_t y = 0; y < screen_h; y++) {
+      blit_xrgb8888((uint8_t*)(back + y * screen_w),
+                    (pixel_t*)buffer_addr + y * buffer_stride, screen_w);
+    }
+  } else {
+    kmemset(back, 0, size);
+  }
+  kgraphic_mark_clean();
+  // The screen still shows what the bootloader left: replace it
+  if (!drawn) kgraphic_mark_dirty(0, 0, screen_w, screen_h);
+  buffer_addr = (uintptr_t)back;
+  buffer_stride = screen_w;
+  return true;
+}
+
+/**
+ * Record that a rectangle of the back buffer changed. Parts outside the screen
+ * are ignored.
+ * \param x,y Top-left corner in pixels.
+ * \param width,height Size in pixels.
+ */
+void kgraphic_mark_dirty(int32_t x, int32_t y, int32_t width, int32_t height) {
+  if (dirty_x0 == NULL) return;
+
+  int32_t x_end = x + width;
+  int32_t y_end = y + height;
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x_end > screen_w) x_end = screen_w;
+  if (y_end > screen_h) y_end = screen_h;
+  if (x >= x_end || y >= y_end) return;
+
+  for (int32_t row = y; row < y_end; row++) {
+    if (x < dirty_x0[row]) dirty_x0[row] = x;
+    if (x_end > dirty_x1[row]) dirty_x1[row] = x_end;
+  }
+  if (y < dirty_y0) dirty_y0 = y;
+  if (y_end > dirty_y1) dirty_y1 = y_end;
+}
+
+/**
+ * Copy the changed spans of the back buffer to the screen in one pass,
+ * converted to its layout, and mark everything clean. Does nothing without a
+ * back buffer, since drawing then goes to the screen directly.
+ * \returns the number of bytes written to the framebuffer.
+ */
+uint64_t kgraphic_present() {
+  if (dirty_x0 == NULL) return 0;
+
+  uint64_t nb_byte = kgraphic_blit_spans(scanout_addr, dirty_x0, dirty_x1,
+                                         dirty_y0, dirty_y1);
+  // The hidden page misses what was just shown
+  if (stale_x0 != NULL) kgraphic_mark_stale();
+  for (int32_t y = dirty_y0; y < dirty_y1; y++) {
+    dirty_x0[y] = screen_w;
+    dirty_x1[y] = 0;
+  }
+  dirty_y0 = screen_h;
+  dirty_y1 = 0;
+  // Drain the write-combining buffers so the frame is complete on return
+  __asm__ volatile("sfence" ::: "memory");
+  return nb_byte;
+}
+
+/**
+ * Set up page flipping on a Bochs VBE display: the framebuffer gets a second
+ * page below the visible one, and kgraphic_flip() draws the next frame there
+ * and shows it with one register write. Call after kgraphic_back_buffer_init().
+ * \returns true if pages can be flipped, else returns false.
+ */
+bool kgraphic_page_flip_init() {
+  if (framebuffer_struct_tag == NULL || dirty_x0 == NULL) return false;
+  if (!vbe_init(screen_w, screen_h, framebuffer_struct_tag->framebuffer_bpp)) {
+    return false;
+  }
+
+  size_t page_size = scanout_pitch * screen_h;
+  uintptr_t second = vm_map_wc(buffer_paddr + page_size, page_size);
+  int32_t* x0 = kmalloc(screen_h * sizeof(int32_t));
+  int32_t* x1 = kmalloc(screen_h * sizeof(int32_t));
+  if (second == 0 || x0 == NULL || x1 == NULL) {
+    kperror("[ERROR] kgraphic_page_flip_init: out of memory\n");
+    return false;
+  }
+
+  // The second page holds nothing yet
+  for (int32_t y = 0; y < screen_h; y++) {
+    x0[y] = 0;
+    x1[y] = screen_w;
+  }
+  stale_y0 = 0;
+  stale_y1 = screen_h;
+  stale_x0 = x0;
+  stale_x1 = x1;
+  page_addr[0] = scanout_addr;
+  page_addr[1] = second;
+  front_page = 0;
+  kprintf("[INFO] kgraphic_page_flip_init: two pages of %d bytes\n",
+          page_size);
+  return true;
+}
+
+/**
+ * Draw what changed since the last frame to the hidden page and show it.
+ * Without page flipping, the changes are copied to the screen as by
+ * kgraphic_present().
+ * \returns the number of bytes written to the framebuffer.
+ */
+uint64_t kgraphic_flip() {
+  if (stale_x0 == NULL) return kgraphic_present();
+
+  // The hidden page misses this frame and whatever the front page got since
+  // it was last shown
+  kgraphic_mark_stale();
+  int32_t back_page = 1 - front_page;
+  uint64_t nb_byte = kgraphic_blit_spans(page_addr[back_page], stale_x0,
+                                         stale_x1, stale_y0, stale_y1);
+  __asm__ volatile("sfence" ::: "memory");
+  vbe_show_page(back_page);
+  front_page = back_page;
+  scanout_addr = page_addr[front_page];
+
+  // Now the old front page is hidden, and it only misses this frame
+  for (int32_t y = stale_y0; y < stale_y1; y++) {
+    stale_x0[y] = screen_w;
+    stale_x1[y] = 0;
+  }
+  stale_y0 = dirty_y0;
+  stale_y1 = dirty_y1;
+  for (int32_t y = dirty_y0; y < dirty_y1; y++) {
+    stale_x0[y] = dirty_x0[y];
+    stale_x1[y] = dirty_x1[y];
+    dirty_x0[y] = screen_w;
+    dirty_x1[y] = 0;
+  }
+  dirty_y0 = screen_h;
+  dirty_y1 = 0;
+  return nb_byte;
+}
+
+/**
+ * Map the framebuffer at USER_SCANOUT so a process can draw to the screen
+ * without a copy. The process owns the screen until it releases it; the
+ * framebuffer system calls of other processes fail meanwhile.
+ * \param pid Pid of the process.
+ * \returns USER_SCANOUT, or 0 if another process owns the framebuffer or the
+ * mapping fails.
+ */
+uintptr_t kgraphic_map_user(int64_t pid) {
+  if (framebuffer_struct_tag == NULL || pid <= 0) return 0;
+
+  int64_t expected = 0;
+  if (!__atomic_compare_exchange_n(&framebuffer_owner, &expected, pid, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    // Mapping it twice is harmless
+    return expected == pid ? USER_SCANOUT : 0;
+  }
+
+  // The mapping covers the first page, so it must be the one on screen
+  if (front_page != 0) kgraphic_flip();
+
+  size_t size = kgraphic_mapped_size();
+  if (USER_SCANOUT + size > USER_SCANOUT_END) {
+    kperror("[ERROR] kgraphic_map_user: framebuffer too large\n");
+    __atomic_store_n(&framebuffer_owner, 0, __ATOMIC_RELEASE);
+    return 0;
+  }
+
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+    uintptr_t vaddr = USER_SCANOUT + offset;
+    if (!vm_map_phys(proot, vaddr, buffer_paddr + offset, true, true, false)) {
+      kperror("[ERROR] kgraphic_map_user: cannot map %p\n",
+              buffer_paddr + offset);
+      kgraphic_unmap_pages(offset);
+      __atomic_store_n(&framebuffer_owner, 0, __ATOMIC_RELEASE);
+      return 0;
+    }
+    vm_set_write_combining(proot, vaddr);
+  }
+  return USER_SCANOUT;
+}
+
+/**
+ * Unmap the framebuffer from user space if pid owns it.
+ * \param pid Pid of the process.
+ * \returns true if pid owned the framebuffer, else returns false.
+ */
+bool kgraphic_unmap_user(int64_t pid) {
+  if (__atomic_load_n(&framebuffer_owner, __ATOMIC_ACQUIRE) != pid) {
+    return false;
+  }
+  kgraphic_unmap_pages(kgraphic_mapped_size());
+  return kgraphic_release_user(pid);
+}
+
+/**
+ * Give the framebuffer back if pid owns it, without touching the mapping, e.g.
+ * once the lower half holding it is gone.
+ * \param pid Pid of the process.
+ * \returns true if pid owned the framebuffer, else returns false.
+ */
+bool kgraphic_release_user(int64_t pid) {
+  int64_t expected = pid;
+  return __atomic_compare_exchange_n(&framebuffer_owner, &expected, 0, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Whether a process may draw with the framebuffer system calls, i.e. no other
+ * process owns the framebuffer.
+ * \param pid Pid of the process.
+ */
+bool kgraphic_may_draw(int64_t pid) {
+  int64_t owner = __atomic_load_n(&framebuffer_owner, __ATOMIC_ACQUIRE);
+  return owner == 0 || owner == pid;
+}
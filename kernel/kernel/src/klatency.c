@@ -0,0 +1,126 @@
+#include "klatency.h"
+
+#include "syscall.h"
+
+// Histograms of each CPU, allocated by lat_init()
+lat_hist_t* lat_irq[MAX_NB_CPU];
+lat_hist_t* lat_syscall[MAX_NB_CPU];
+
+extern int32_t nb_cpu;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Add one run to a histogram. Interrupts must be disabled.
+ * \param hist The histogram.
+ * \param ns Duration of the run.
+ */
+void lat_hist_add(lat_hist_t* hist, uint64_t ns) {
+  // Bucket b holds [2^b, 2^(b+1)) ns
+  int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+  if (bucket >= LAT_NB_BUCKET) bucket = LAT_NB_BUCKET - 1;
+  hist->buckets[bucket]++;
+  if (hist->count == 0 || ns < hist->min_ns) hist->min_ns = ns;
+  if (ns > hist->max_ns) hist->max_ns = ns;
+  hist->sum_ns += ns;
+  hist->count++;
+}
+
+/**
+ * Copy a histogram into a stat entry.
+ * \param stat The output entry.
+ * \param hist The histogram.
+ * \param cpu CPU the histogram belongs to.
+ * \param kind One of LAT_KIND_*.
+ * \param id Interrupt vector or system call number.
+ */
+void lat_hist_copy(lat_stat_t* stat, lat_hist_t* hist, int32_t cpu,
+                   int32_t kind, int64_t id) {
+  stat->cpu = cpu;
+  stat->kind = kind;
+  stat->id = id;
+  stat->count = hist->count;
+  stat->min_ns = hist->min_ns;
+  stat->max_ns = hist->max_ns;
+  stat->sum_ns = hist->sum_ns;
+  for (int b = 0; b < LAT_NB_BUCKET; b++) stat->buckets[b] = hist->buckets[b];
+}
+
+/******************************************************************************/
+/**
+ * Allocate the histograms of every CPU, including those smp_start() has not
+ * brought online yet. Until then nothing is recorded. Call after sched_init().
+ * \returns true if the histograms are allocated, else returns false.
+ */
+bool lat_init() {
+  for (int32_t i = 0; i < nb_cpu; i++) {
+    size_t irq_size = LAT_NB_VECTOR * sizeof(lat_hist_t);
+    size_t syscall_size = NB_SYSCALL * sizeof(lat_hist_t);
+    lat_hist_t* irq = kmalloc(irq_size);
+    lat_hist_t* sys = kmalloc(syscall_size);
+    if (irq == NULL || sys == NULL) {
+      kperror("[ERROR] lat_init: cannot allocate the histograms\n");
+      return false;
+    }
+    kmemset(irq, 0, irq_size);
+    kmemset(sys, 0, syscall_size);
+    lat_irq[i] = irq;
+    lat_syscall[i] = sys;
+  }
+  return true;
+}
+
+/**
+ * Record the run of an interrupt handler on the calling CPU.
+ * \param vector Interrupt vector.
+ * \param start TSC read when the handler was entered.
+ */
+void lat_record_irq(uint8_t vector, uint64_t start) {
+  uint64_t flags = irq_save();
+  lat_hist_t* hists = lat_irq[cpu_current_id()];
+  if (hists != NULL) lat_hist_add(&hists[vector], tsc_to_ns(read_tsc() - start));
+  irq_restore(flags);
+}
+
+/**
+ * Record the run of a system call on the calling CPU.
+ * \param nr System call number.
+ * \param start TSC read when the system call was entered.
+ */
+void lat_record_syscall(uint64_t nr, uint64_t start) {
+  int32_t slot = syscall_slot(nr);
+  if (slot < 0) return;
+
+  uint64_t flags = irq_save();
+  lat_hist_t* hists = lat_syscall[cpu_current_id()];
+  if (hists != NULL) lat_hist_add(&hists[slot], tsc_to_ns(read_tsc() - start));
+  irq_restore(flags);
+}
+
+/**
+ * Copy every non-empty histogram into stats.
+ * \param stats Output array.
+ * \param max_stat Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t klatstat(lat_stat_t* stats, size_t max_stat) {
+  if (stats == NULL) return -1;
+
+  // Copy with interrupts off so a CPU's own entries are consistent
+  uint64_t flags = irq_save();
+  size_t count = 0;
+  for (int32_t cpu = 0; cpu < nb_cpu; cpu++) {
+    if (lat_irq[cpu] == NULL) continue;
+    for (int v = 0; v < LAT_NB_VECTOR && count < max_stat; v++) {
+      if (lat_irq[cpu][v].count == 0) continue;
+      lat_hist_copy(&stats[count++], &lat_irq[cpu][v], cpu, LAT_KIND_IRQ, v);
+    }
+    for (int s = 0; s < NB_SYSCALL && count < max_stat; s++) {
+      if (lat_syscall[cpu][s].count == 0) continue;
+      lat_hist_copy(&stats[count++], &lat_syscall[cpu][s], cpu,
+                    LAT_KIND_SYSCALL, syscall_number(s));
+    }
+  }
+  irq_restore(flags);
+  return count;
+}
@@ -1,16 +1,21 @@
 #include "kmem.h"
 
+#include "spinlock.h"
+
 // External functions for system call handler. syscall(uint64_t nr, ...) is
 // defined in asm/syscall.s
 extern int64_t syscall(uint64_t nr, ...);
 
 // Pick a initial virtual memory address to map the heap
 static uintptr_t k_heap = KERNEL_HEAP;
+static spinlock_t k_heap_lock = SPINLOCK_INIT;
 
 // Buffer for distributing memory in malloc. The idea is we first map memory to
 // kmbuffer then use it for malloc.
 static void* kmbuffer = NULL;
 static size_t kremain_mbuffer_size = 0;
+// Taken before k_heap_lock when kmalloc() needs a new chunk
+static spinlock_t kmbuffer_lock = SPINLOCK_INIT;
 
 /**
  * Invoke system call to map a chunk of memory, starting at vaddr.
@@ -43,11 +48,16 @@ void* kmmap(void* addr, size_t length, int prot, int flags, int fd,
     ret_addr = addr;
   } else {
     // There isn't any input clue for the virtual address. We choose from kernel
-    // heap. Set cursor to the current kernel heap.
+    // heap. Set cursor to the current kernel heap. Other CPUs may be taking
+    // heap space at the same time.
+    uint64_t flags = irq_save();
+    spin_lock(&k_heap_lock);
     cursor = k_heap;
     // Advance heap pointer to the next page aligned
     k_heap = ROUND_UP(k_heap + length, PAGE_SIZE);
     end = k_heap;
+    spin_unlock(&k_heap_lock);
+    irq_restore(flags);
     ret_addr = (void*)cursor;
   }
 
@@ -78,6 +88,8 @@ void* kmalloc(size_t sz) {
   // Round sz up to a multiple of 16
   sz = ROUND_UP(sz, 16);
 
+  uint64_t flags = irq_save();
+  spin_lock(&kmbuffer_lock);
   // Do we have enough space to satisfy this allocation?
   if (kremain_mbuffer_size < sz) {
     // No. Get some more space using `mmap`
@@ -85,6 +97,8 @@ void* kmalloc(size_t sz) {
     void* newmem = kmmap(NULL, rounded_up, PROT_READ | PROT_WRITE, 0, -1, 0);
     // Check for errors
     if (newmem == NULL) {
+      spin_unlock(&kmbuffer_lock);
+      irq_restore(flags);
       return NULL;
     }
     kmbuffer = newmem;
@@ -94,6 +108,8 @@ void* kmalloc(size_t sz) {
   void* result = kmbuffer;
   kmbuffer = (void*)((uintptr_t)kmbuffer + sz);
   kremain_mbuffer_size -= sz;
+  spin_unlock(&kmbuffer_lock);
+  irq_restore(flags);
 
   return result;
 }
@@ -1,11 +1,14 @@
 #include "kprint.h"
 
+#include "waitq.h"
+
 // Pointers to memmap struct tag and hhdm struct tag to help with printing
 // memory usage
 extern struct stivale2_struct_tag_memmap* mmap_struct_tag;
 extern struct stivale2_struct_tag_hhdm* hhdm_struct_tag;
 
-// Buffers being used to store digit characters when printing number
+// Buffers being used to store digit characters when printing number. Used with
+// the terminal lock held.
 char buffer_dec_uint64[NUM_DIGIT_DEC_UINT64 + 1];
 char buffer_hex_uint64[NUM_DIGIT_HEX_UINT64 + 1];
 // Function to write to terminal. Init as NULL. Set after read terminal
@@ -19,6 +22,8 @@ keyboard_t keyboard = {.buffer = {.read = 0, .write = 0, .size = 0},
                        .ctrl = 0,
                        .shift = 0,
                        .capslock = 0};
+// Readers blocked in kget_c until the keyboard interrupt fills the buffer
+waitq_t keyboard_waitq = WAITQ_INIT;
 
 /******************************************************************************/
 /**
@@ -95,6 +100,7 @@ void kprint_d(uint64_t value) {
   if (value == 0) {
     kprint_c('0');
   } else {
+    term_lock();
     uint64_t remain = 0;
     size_t num_digit = 0;
 
@@ -113,6 +119,7 @@ void kprint_d(uint64_t value) {
     }
 
     term_write(cursor, num_digit);
+    term_unlock();
   }
 }
 
@@ -125,6 +132,7 @@ void kprint_x(uint64_t value) {
   if (value == 0) {
     kprint_c('0');
   } else {
+    term_lock();
     uint64_t remain = 0;
     size_t num_digit = 0;
 
@@ -144,6 +152,7 @@ void kprint_x(uint64_t value) {
     }
 
     term_write(cursor, num_digit);
+    term_unlock();
   }
 }
 
@@ -170,6 +179,9 @@ void kprint_p(void* ptr) {
 void kprintf(const char* format, ...) {
   if (format == NULL) return;
 
+  // Keep the message in one piece when other CPUs print
+  term_lock();
+
   // Set up va_list to read arguments
   const char* cursor = format;
   va_list args;
@@ -205,9 +217,10 @@ void kprintf(const char* format, ...) {
         case 'p':
           kprint_p(va_arg(args, void*));
           break;
-        // case "%" -> print nothing, return
+        // case "%" -> print nothing, stop at the null character
         case '\0':
-          return;
+          cursor--;
+          break;
         // unsupported escape character
         default:
           kprint_s("<not supported>");
@@ -217,6 +230,8 @@ void kprintf(const char* format, ...) {
     }
     cursor++;
   }
+  va_end(args);
+  term_unlock();
 }
 
 /**
@@ -232,6 +247,8 @@ void kprintf(const char* format, ...) {
 void kperror(const char* format, ...) {
   if (format == NULL) return;
 
+  // Keep the message in one piece when other CPUs print
+  term_lock();
   // Set fg color to white and bg color to black
   term_set_color(ARGB32_RED, ARGB32_BLACK);
 
@@ -270,10 +287,10 @@ void kperror(const char* format, ...) {
         case 'p':
           kprint_p(va_arg(args, void*));
           break;
-        // case "%" -> print nothing, return
+        // case "%" -> print nothing, stop at the null character
         case '\0':
-          term_reset_color();
-          return;
+          cursor--;
+          break;
         // unsupported escape character
         default:
           kprint_s("<not supported>");
@@ -283,7 +300,9 @@ void kperror(const char* format, ...) {
     }
     cursor++;
   }
+  va_end(args);
   term_reset_color();
+  term_unlock();
 }
 
 /**
@@ -322,6 +341,9 @@ void kprint_mem_usage() {
 }
 
 /******************************************************************************/
+// Wait condition of keyboard_waitq
+bool kb_has_input(void* kb) { return !cq_is_empty(&((keyboard_t*)kb)->buffer); }
+
 /**
  * Read one character from the keyboard buffer. If the keyboard buffer is empty
  * this function will block until a key is pressed.
@@ -331,8 +353,10 @@ char kget_c() {
   // Read from the keyboard buffer...
   char ret;
   // kb_read_c would return false if it failed to read character off the buffer
-  // and true otherwise. The read character is put in ret variable.
+  // and true otherwise. The read character is put in ret variable. While the
+  // buffer is empty, sleep until the keyboard interrupt wakes us.
   while (!kb_read_c(&keyboard, &ret)) {
+    waitq_wait(&keyboard_waitq, kb_has_input, &keyboard);
   };
   // Return the read character
   return ret;
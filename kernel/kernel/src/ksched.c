@@ -0,0 +1,1143 @@
+#include "ksched.h"
+
+#include "apic.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "page.h"
+#include "util.h"
+
+// Defined in asm/context_switch.s
+extern void context_switch(uintptr_t* prev_ksp, uintptr_t next_ksp);
+extern void kthread_trampoline();
+
+// Every task in the system. Exited slots keep their statistics until reused.
+task_t tasks[MAX_NB_PROCESS];
+int64_t next_pid = 1;
+spinlock_t tasks_lock = SPINLOCK_INIT;
+
+// Scheduler state of each CPU reported by the bootloader
+cpu_t cpus[MAX_NB_CPU];
+int32_t nb_cpu = 0;
+int32_t nb_cpu_online = 0;
+int32_t boot_cpu = 0;
+cpu_mask_t cpu_online_mask = 0;
+// Whether the idle loop waits with monitor/mwait instead of hlt
+bool cpu_mwait = false;
+// Set by smp_park() once cpu_current_id() can read IA32_TSC_AUX
+bool cpu_tsc_aux = false;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Copy a name into a task struct, truncating it if it is too long.
+ * \param task The task to be named.
+ * \param name The name.
+ */
+void task_set_name(task_t* task, const char* name) {
+  size_t i = 0;
+  if (name != NULL) {
+    for (; i < TASK_NAME_LEN - 1 && name[i] != '\0'; i++) {
+      task->name[i] = name[i];
+    }
+  }
+  task->name[i] = '\0';
+}
+
+/**
+ * Timer callback ending ksched_sleep_until().
+ * \param timer The task's sleep_timer.
+ * \param arg The sleeping task.
+ */
+void sched_sleep_timer_fn(ktimer_t* timer, void* arg) {
+  sched_wakeup((task_t*)arg);
+}
+
+/**
+ * Take a task slot. Never used slots are preferred so exited tasks stay
+ * visible for as long as possible. A slot whose task has not finished
+ * switching out is not reused.
+ * \returns pointer to a reset task struct, or NULL if every slot is taken.
+ */
+task_t* task_alloc(const char* name) {
+  task_t* task = NULL;
+  spin_lock(&tasks_lock);
+  for (int32_t i = 0; i < MAX_NB_PROCESS && task == NULL; i++) {
+    if (tasks[i].state == TASK_UNUSED) task = &tasks[i];
+  }
+  for (int32_t i = 0; i < MAX_NB_PROCESS && task == NULL; i++) {
+    if (tasks[i].state == TASK_EXITED && !tasks[i].on_cpu) task = &tasks[i];
+  }
+  if (task != NULL) {
+    // Keep the kernel stack and FPU area of a reused slot since kfree cannot
+    // release them
+    uintptr_t kstack = task->kstack;
+    void* fpu_state = task->fpu_state;
+    kmemset(task, 0, sizeof(task_t));
+    task->kstack = kstack;
+    task->fpu_state = fpu_state;
+    task->fpu_cpu = -1;
+    task->pid = next_pid++;
+    task->state = TASK_BLOCKED;
+    task->affinity = CPU_MASK_ALL;
+    task->cpu = -1;
+    task->sched_class = SCHED_NORMAL;
+    task->dl_cpu = -1;
+    ktimer_init(&task->sleep_timer, sched_sleep_timer_fn, task);
+    task_set_name(task, name);
+  }
+  spin_unlock(&tasks_lock);
+  return task;
+}
+
+/**
+ * Make sure a task owns a kernel stack.
+ * \param task The task.
+ * \returns true if the task has a kernel stack, else returns false.
+ */
+bool task_alloc_kstack(task_t* task) {
+  if (task->kstack == 0) {
+    task->kstack = (uintptr_t)kmalloc(TASK_KSTACK_SIZE);
+    if (task->kstack == 0) return false;
+  }
+  // Interrupt frames need a 16-byte aligned stack
+  task->kstack_top = (task->kstack + TASK_KSTACK_SIZE) & ~(uintptr_t)0xF;
+  return true;
+}
+
+/**
+ * Build the initial stack of a kernel thread. The frame matches what
+ * context_switch() pops: six callee-saved registers and a return address that
+ * lands in kthread_trampoline, which calls fn(arg) from r12 and r13.
+ * \param task The kernel thread.
+ * \param fn Function the thread runs.
+ * \param arg Argument passed to fn.
+ */
+void kthread_init_stack(task_t* task, kthread_fn_t fn, void* arg) {
+  uint64_t* sp = (uint64_t*)(task->kstack_top - 16);
+  *sp = (uint64_t)kthread_trampoline;
+  *(--sp) = 0;              // rbp
+  *(--sp) = 0;              // rbx
+  *(--sp) = (uint64_t)fn;   // r12
+  *(--sp) = (uint64_t)arg;  // r13
+  *(--sp) = 0;              // r14
+  *(--sp) = 0;              // r15
+  task->ksp = (uintptr_t)sp;
+}
+
+/******************************************************************************/
+// Run queue
+/**
+ * Number of tasks waiting in a run queue. Only a snapshot when read by another
+ * CPU.
+ * \param rq The run queue.
+ */
+uint64_t runqueue_length(runqueue_t* rq) {
+  uint64_t head = __atomic_load_n(&rq->head, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&rq->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+/**
+ * Push a task at the tail of the run queue. Only the owner CPU pushes.
+ * \param rq The run queue of the current CPU.
+ * \param task The task to be pushed.
+ * \returns true if the task is queued, false if the queue is full.
+ */
+bool runqueue_push(runqueue_t* rq, task_t* task) {
+  uint64_t tail = rq->tail;
+  if (tail - __atomic_load_n(&rq->head, __ATOMIC_ACQUIRE) >= RUNQUEUE_SIZE) {
+    return false;
+  }
+  rq->slots[tail & RUNQUEUE_MASK] = task;
+  // Publish the slot before the new tail
+  __atomic_store_n(&rq->tail, tail + 1, __ATOMIC_RELEASE);
+  rq->nr_push++;
+  return true;
+}
+
+/**
+ * Whether a CPU may steal a task: the task must be allowed there and its
+ * context must be saved.
+ * \param task The task.
+ * \param cpu The stealing CPU.
+ */
+bool task_stealable(task_t* task, cpu_t* cpu) {
+  return (task->affinity & CPU_MASK(cpu->id)) != 0 &&
+         !__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Take the task at the head of a run queue. The owner and thieves race on
+ * head with a compare-and-swap, so each task is taken once.
+ * \param rq The run queue.
+ * \param thief The stealing CPU, or NULL if the caller owns the queue.
+ * \returns the task, or NULL if the queue is empty or a thief may not take its
+ * head task.
+ */
+task_t* runqueue_pop(runqueue_t* rq, cpu_t* thief) {
+  uint64_t head = __atomic_load_n(&rq->head, __ATOMIC_ACQUIRE);
+  while (true) {
+    if (head == __atomic_load_n(&rq->tail, __ATOMIC_ACQUIRE)) return NULL;
+    task_t* task = rq->slots[head & RUNQUEUE_MASK];
+    if (thief != NULL && !task_stealable(task, thief)) return NULL;
+    // On failure head is reloaded and we try the next task
+    if (__atomic_compare_exchange_n(&rq->head, &head, head + 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return task;
+    }
+  }
+}
+
+/******************************************************************************/
+/**
+ * Insert a task into a sorted deadline list.
+ * \param list Head of the list.
+ * \param task The task to be inserted.
+ * \param by_release Sort by release time instead of by deadline.
+ */
+void dl_insert(task_t** list, task_t* task, bool by_release) {
+  uint64_t key = by_release ? task->dl_release : task->dl_deadline;
+  while (*list != NULL &&
+         (by_release ? (*list)->dl_release : (*list)->dl_deadline) <= key) {
+    list = &(*list)->next;
+  }
+  task->next = *list;
+  *list = task;
+}
+
+/**
+ * Queue a runnable task on the current CPU: deadline tasks go to the EDF list,
+ * the others to the run queue, where idle CPUs may steal them.
+ * \param cpu The current CPU.
+ * \param task The task to be queued.
+ */
+void cpu_enqueue_local(cpu_t* cpu, task_t* task) {
+  if (task->sched_class == SCHED_DEADLINE) {
+    dl_insert(&cpu->dl_ready, task, false);
+  } else {
+    runqueue_push(&cpu->rq, task);
+  }
+}
+
+/**
+ * Move the tasks other CPUs sent to this CPU into its queues, oldest first.
+ * \param cpu The current CPU.
+ */
+void cpu_drain_inbox(cpu_t* cpu) {
+  if (__atomic_load_n(&cpu->inbox, __ATOMIC_ACQUIRE) == NULL) return;
+  spin_lock(&cpu->inbox_lock);
+  task_t* list = cpu->inbox;
+  cpu->inbox = NULL;
+  spin_unlock(&cpu->inbox_lock);
+
+  // The inbox is a stack: reverse it to keep the arrival order
+  task_t* order = NULL;
+  while (list != NULL) {
+    task_t* task = list;
+    list = task->next;
+    task->next = order;
+    order = task;
+  }
+  while (order != NULL) {
+    task_t* task = order;
+    order = task->next;
+    task->next = NULL;
+    cpu_enqueue_local(cpu, task);
+  }
+}
+
+/**
+ * Make a CPU go through schedule(). A remote CPU waiting in hlt is woken with
+ * an IPI; one waiting in mwait wakes up on the write to need_resched.
+ * \param cpu The CPU.
+ */
+void cpu_kick(cpu_t* cpu) {
+  cpu->need_resched = true;
+  if (cpu->id == cpu_current_id() || !cpu->online || cpu_mwait) return;
+  // Sent even if the CPU looks busy: it may be about to halt
+  if (apic_enabled()) lapic_send_ipi(cpu->lapic_id, RESCHED_VECTOR);
+}
+
+/**
+ * Hand a runnable task to another CPU. The task is queued there by the owner
+ * at its next schedule().
+ * \param cpu The target CPU.
+ * \param task The task.
+ */
+void cpu_send(cpu_t* cpu, task_t* task) {
+  spin_lock(&cpu->inbox_lock);
+  task->next = cpu->inbox;
+  __atomic_store_n(&cpu->inbox, task, __ATOMIC_RELEASE);
+  spin_unlock(&cpu->inbox_lock);
+  cpu_kick(cpu);
+}
+
+/**
+ * Kick an idle CPU that may run a task just queued on the busy current CPU,
+ * so it steals the task instead of letting it wait.
+ * \param cpu The current CPU.
+ * \param task The queued task.
+ */
+void cpu_kick_thief(cpu_t* cpu, task_t* task) {
+  if (cpu->current == cpu->idle) return;
+  cpu_mask_t online = __atomic_load_n(&cpu_online_mask, __ATOMIC_ACQUIRE);
+  for (int32_t i = 0; i < nb_cpu; i++) {
+    cpu_t* other = &cpus[i];
+    if (other == cpu || (online & task->affinity & CPU_MASK(i)) == 0) continue;
+    if (other->current == other->idle) {
+      cpu_kick(other);
+      return;
+    }
+  }
+}
+
+/**
+ * xorshift64 generator picking the first victim of a steal, so idle CPUs do
+ * not all hit the same queue.
+ * \param cpu The current CPU.
+ */
+uint64_t cpu_rand(cpu_t* cpu) {
+  uint64_t x = cpu->rand_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  cpu->rand_state = x;
+  return x;
+}
+
+/**
+ * Steal the head task of another online CPU's run queue. Victims are tried in
+ * order from a random one.
+ * \param cpu The current CPU.
+ * \returns the stolen task, or NULL if no queue had a task for this CPU.
+ */
+task_t* cpu_steal(cpu_t* cpu) {
+  cpu_mask_t online = __atomic_load_n(&cpu_online_mask, __ATOMIC_ACQUIRE);
+  if ((online & ~CPU_MASK(cpu->id)) == 0) return NULL;
+
+  int32_t start = (int32_t)(cpu_rand(cpu) % (uint64_t)nb_cpu);
+  for (int32_t i = 0; i < nb_cpu; i++) {
+    cpu_t* victim = &cpus[(start + i) % nb_cpu];
+    if (victim == cpu || (online & CPU_MASK(victim->id)) == 0) continue;
+    task_t* task = runqueue_pop(&victim->rq, cpu);
+    if (task != NULL) {
+      __atomic_add_fetch(&victim->rq.nr_stolen, 1, __ATOMIC_RELAXED);
+      cpu->nr_steal++;
+      return task;
+    }
+  }
+  cpu->nr_steal_fail++;
+  return NULL;
+}
+
+/**
+ * Whether another online CPU has a task at the head of its run queue that
+ * this CPU could steal.
+ * \param cpu The current CPU.
+ */
+bool cpu_can_steal(cpu_t* cpu) {
+  cpu_mask_t online = __atomic_load_n(&cpu_online_mask, __ATOMIC_ACQUIRE);
+  for (int32_t i = 0; i < nb_cpu; i++) {
+    runqueue_t* rq = &cpus[i].rq;
+    if (i == cpu->id || (online & CPU_MASK(i)) == 0) continue;
+    uint64_t head = __atomic_load_n(&rq->head, __ATOMIC_ACQUIRE);
+    if (head == __atomic_load_n(&rq->tail, __ATOMIC_ACQUIRE)) continue;
+    if (task_stealable(rq->slots[head & RUNQUEUE_MASK], cpu)) return true;
+  }
+  return false;
+}
+
+/**
+ * Take the next task of the current CPU's run queue. Tasks that are no longer
+ * allowed here (see ksched_setaffinity()) are forwarded to a CPU that may run
+ * them. The previous task cannot move before its context is saved, so it is
+ * requeued after the switch instead.
+ * \param cpu The current CPU.
+ * \param prev The task being switched out.
+ * \param requeue Set if prev was found in the queue and must be requeued.
+ * \returns the task, or NULL if the queue has nothing for this CPU.
+ */
+task_t* cpu_pop(cpu_t* cpu, task_t* prev, bool* requeue) {
+  // Bounded by the length so a task that comes back cannot loop forever
+  for (uint64_t n = runqueue_length(&cpu->rq); n > 0; n--) {
+    task_t* task = runqueue_pop(&cpu->rq, NULL);
+    if (task == NULL) break;
+    cpu->rq.nr_pop++;
+    if ((task->affinity & CPU_MASK(cpu->id)) != 0) return task;
+    if (task == prev) {
+      *requeue = true;
+    } else {
+      sched_enqueue(task);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Release the deadline tasks whose next period has started.
+ * \param cpu The current CPU.
+ * \param now Current TSC value.
+ */
+void cpu_release_deadline(cpu_t* cpu, uint64_t now) {
+  while (cpu->dl_wait != NULL && cpu->dl_wait->dl_release <= now) {
+    task_t* task = cpu->dl_wait;
+    cpu->dl_wait = task->next;
+    task->dl_runtime = 0;
+    task->state = TASK_RUNNABLE;
+    dl_insert(&cpu->dl_ready, task, false);
+  }
+}
+
+/**
+ * Move a deadline task to its next period, which starts at the current
+ * deadline. Periods that already ended without the task finishing count as
+ * missed.
+ * \param task The deadline task.
+ * \param now Current TSC value.
+ */
+void dl_next_period(task_t* task, uint64_t now) {
+  uint64_t release = task->dl_deadline;
+  if (now >= release + task->dl_period) {
+    uint64_t skipped = (now - release) / task->dl_period;
+    release += skipped * task->dl_period;
+    task->dl_nr_missed += skipped;
+  }
+  task->dl_release = release;
+  task->dl_deadline = release + task->dl_period;
+}
+
+/**
+ * Take a deadline task that used up its budget off the CPU until its next
+ * period, when cpu_release_deadline() gives it a full budget again.
+ * \param task The running deadline task.
+ * \param now Current TSC value.
+ */
+void dl_throttle(task_t* task, uint64_t now) {
+  task->dl_nr_overrun++;
+  dl_next_period(task, now);
+  task->state = TASK_BLOCKED;
+  dl_insert(&cpus[task->dl_cpu].dl_wait, task, true);
+}
+
+/**
+ * Mark a task as exited and give back the bandwidth it reserved.
+ * \param task The task.
+ */
+void task_retire(task_t* task) {
+  fpu_task_exit(task);
+  ktimer_cancel(&task->sleep_timer);
+  if (task->sched_class == SCHED_DEADLINE) {
+    cpus[task->dl_cpu].dl_bw -= task->dl_bw;
+    task->sched_class = SCHED_NORMAL;
+  }
+  task->state = TASK_EXITED;
+}
+
+/**
+ * Point both user-mode entries at a task's kernel stack: the TSS for
+ * interrupts and int 0x80, the cpu_t for the SYSCALL entry.
+ * \param cpu The current CPU.
+ * \param kstack_top Top of the kernel stack of the task.
+ */
+void cpu_set_kernel_stack(cpu_t* cpu, uintptr_t kstack_top) {
+  gdt_set_kernel_stack(cpu->id, kstack_top);
+  cpu->kstack_top = kstack_top;
+}
+
+/**
+ * Whether this CPU has a task to run other than the idle task, including one
+ * it could steal.
+ * \param cpu The current CPU.
+ */
+bool cpu_has_work(cpu_t* cpu) {
+  if (runqueue_length(&cpu->rq) != 0 || cpu->dl_ready != NULL) return true;
+  if (__atomic_load_n(&cpu->inbox, __ATOMIC_ACQUIRE) != NULL) return true;
+  if (cpu->dl_wait != NULL && cpu->dl_wait->dl_release <= read_tsc()) {
+    return true;
+  }
+  return cpu_can_steal(cpu);
+}
+
+/**
+ * Timer callback waking a CPU for the release of a deadline task. Timer
+ * interrupts reach the boot CPU only, so other CPUs are kicked; schedule()
+ * does the release.
+ * \param timer The CPU's dl_timer.
+ * \param arg The CPU.
+ */
+void sched_dl_timer_fn(ktimer_t* timer, void* arg) { cpu_kick((cpu_t*)arg); }
+
+/**
+ * Body of the idle task of each CPU. Interrupts are disabled while checking
+ * for work so a wakeup cannot slip in between the check and the wait; "sti;
+ * hlt" and "sti; mwait" only open the interrupt window once the CPU waits.
+ *
+ * No timer is armed while idle unless a deadline task waits for its next
+ * period; then a kernel timer wakes the CPU at the release time. Without
+ * timer interrupts the CPU polls instead.
+ */
+void idle_loop(void* arg) {
+  cpu_t* cpu = (cpu_t*)arg;
+  while (true) {
+    __asm__ volatile("cli");
+    if (cpu_mwait) cpu_monitor(&cpu->need_resched);
+    if (cpu_has_work(cpu) || cpu->need_resched) {
+      __asm__ volatile("sti");
+      schedule();
+      continue;
+    }
+
+    if (cpu->dl_wait != NULL && !timer_enabled()) {
+      __asm__ volatile("sti; pause");
+      continue;
+    }
+    if (cpu->dl_wait != NULL) {
+      ktimer_arm(&cpu->dl_timer, ktime_from_tsc(cpu->dl_wait->dl_release));
+    }
+    if (cpu_mwait) {
+      cpu_sti_mwait(MWAIT_HINT_C1);
+    } else {
+      __asm__ volatile("sti; hlt");
+    }
+  }
+}
+
+/******************************************************************************/
+/**
+ * Initialize the per-CPU scheduler state. CPUs are enumerated from the SMP
+ * struct tag; the bootstrap CPU becomes CPU 0 and is the only one online until
+ * smp_start(). The function creates the idle task of every CPU and a "boot"
+ * task that stands for the current context until the first user program
+ * starts.
+ * \param smp_tag SMP struct tag from the bootloader (may be NULL).
+ */
+void sched_init(struct stivale2_struct_tag_smp* smp_tag) {
+  kmemset(tasks, 0, sizeof(tasks));
+  kmemset(cpus, 0, sizeof(cpus));
+
+  // Enumerate the CPUs. Without the SMP tag we only know about ourselves. The
+  // bootstrap CPU owns the first TSS (see gdt_setup()), so it comes first.
+  nb_cpu = 1;
+  if (smp_tag != NULL) {
+    cpus[0].lapic_id = smp_tag->bsp_lapic_id;
+    for (uint64_t i = 0; i < smp_tag->cpu_count && nb_cpu < MAX_NB_CPU; i++) {
+      if (smp_tag->smp_info[i].lapic_id == smp_tag->bsp_lapic_id) continue;
+      cpus[nb_cpu++].lapic_id = smp_tag->smp_info[i].lapic_id;
+    }
+  }
+  for (int32_t i = 0; i < nb_cpu; i++) {
+    cpus[i].self = &cpus[i];
+    cpus[i].id = i;
+    cpus[i].rand_state = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+    spin_init(&cpus[i].inbox_lock);
+    ktimer_init(&cpus[i].dl_timer, sched_dl_timer_fn, &cpus[i]);
+  }
+
+  // Bring the bootstrap CPU online. The other CPUs stay parked until
+  // smp_start().
+  cpu_t* cpu = &cpus[0];
+  boot_cpu = 0;
+  cpu->online = true;
+  nb_cpu_online = 1;
+  cpu_online_mask = CPU_MASK(0);
+
+  // MONITOR/MWAIT support
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  cpu_mwait = ecx & (1 << 3);
+
+  // The boot context becomes a task so it can be switched away from
+  task_t* boot = task_alloc("boot");
+  boot->affinity = CPU_MASK(0);
+  boot->state = TASK_RUNNING;
+  boot->cpu = 0;
+  boot->on_cpu = true;
+  boot->acct_last = read_tsc();
+  cpu->current = boot;
+
+  // The idle tasks never sit in a run queue; schedule() falls back to them.
+  // An application processor starts out running its idle task, on its stack.
+  for (int32_t i = 0; i < nb_cpu; i++) {
+    task_t* idle = task_alloc("idle");
+    if (idle == NULL || !task_alloc_kstack(idle)) {
+      kperror("[ERROR] sched_init: cannot create the idle task\n");
+      // CPUs without an idle task stay in the bootloader
+      nb_cpu = i > 0 ? i : 1;
+      return;
+    }
+    idle->affinity = CPU_MASK(i);
+    idle->state = TASK_RUNNING;
+    idle->cpu = i;
+    cpus[i].idle = idle;
+    if (i == 0) {
+      kthread_init_stack(idle, idle_loop, cpu);
+    } else {
+      idle->on_cpu = true;
+      cpus[i].current = idle;
+    }
+  }
+}
+
+/**
+ * Mark the calling application processor online and run its idle task. Called
+ * by ap_entry() once the CPU is set up. Does not return.
+ */
+void sched_cpu_online() {
+  cpu_t* cpu = this_cpu();
+  cpu->online = true;
+  __atomic_or_fetch(&cpu_online_mask, CPU_MASK(cpu->id), __ATOMIC_RELEASE);
+  __atomic_add_fetch(&nb_cpu_online, 1, __ATOMIC_RELEASE);
+  idle_loop(cpu);
+}
+
+/**
+ * Index of the CPU this code runs on. Once application processors are started
+ * every CPU holds its index in IA32_TSC_AUX, which RDTSCP reads.
+ * \returns the CPU index.
+ */
+int32_t cpu_current_id() {
+  if (!cpu_tsc_aux) return boot_cpu;
+  uint32_t aux;
+  __asm__ volatile("rdtscp" : "=c"(aux) : : "rax", "rdx");
+  return (int32_t)aux;
+}
+
+/**
+ * Get the scheduler state of the CPU this code runs on.
+ * \returns pointer to the current CPU struct.
+ */
+cpu_t* this_cpu() { return &cpus[cpu_current_id()]; }
+
+/**
+ * Get the task currently running on this CPU.
+ * \returns pointer to the running task.
+ */
+task_t* task_current() { return this_cpu()->current; }
+
+/**
+ * Find a live task by pid.
+ * \param pid Pid of the task.
+ * \returns pointer to the task, or NULL if no live task has that pid.
+ */
+task_t* task_find(int64_t pid) {
+  for (int32_t i = 0; i < MAX_NB_PROCESS; i++) {
+    if (tasks[i].pid == pid && tasks[i].state != TASK_UNUSED &&
+        tasks[i].state != TASK_EXITED) {
+      return &tasks[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Create the task for a freshly loaded user program and make it the current
+ * task of this CPU. The previous task is retired since its image has been
+ * replaced. The caller is expected to jump to user mode right after.
+ * \param name Name of the executable.
+ * \returns pointer to the new task, or NULL if no task slot is available.
+ */
+task_t* task_create_user(const char* name) {
+  task_t* task = task_alloc(name);
+  if (task == NULL || !task_alloc_kstack(task)) {
+    kperror("[ERROR] task_create_user: cannot create task for %s\n", name);
+    return NULL;
+  }
+
+  uint64_t flags = irq_save();
+  cpu_t* cpu = this_cpu();
+  task_t* prev = cpu->current;
+
+  task->user = true;
+  task->state = TASK_RUNNING;
+  task->cpu = cpu->id;
+  task->on_cpu = true;
+  task->acct_user = true;
+  task->acct_last = read_tsc();
+  cpu->current = task;
+
+  // We are still running on the old task's stack, but never return to it
+  if (prev != NULL && prev != cpu->idle) {
+    task_retire(prev);
+    prev->on_cpu = false;
+  }
+
+  // Interrupts and system calls from user mode land on the new stack
+  cpu_set_kernel_stack(cpu, task->kstack_top);
+  fpu_switch(cpu, prev, task);
+  irq_restore(flags);
+  return task;
+}
+
+/**
+ * Create a kernel thread and put it on a run queue.
+ * \param name Name of the thread.
+ * \param fn Function the thread runs.
+ * \param arg Argument passed to fn.
+ * \param affinity CPUs the thread may run on.
+ * \returns pointer to the new task, or NULL if it cannot be created.
+ */
+task_t* kthread_create(const char* name, kthread_fn_t fn, void* arg,
+                       cpu_mask_t affinity) {
+  if (fn == NULL || (affinity & cpu_online_mask) == 0) {
+    kperror("[ERROR] kthread_create: invalid argument for %s\n", name);
+    return NULL;
+  }
+
+  task_t* task = task_alloc(name);
+  if (task == NULL || !task_alloc_kstack(task)) {
+    kperror("[ERROR] kthread_create: cannot create task for %s\n", name);
+    return NULL;
+  }
+  task->affinity = affinity;
+  kthread_init_stack(task, fn, arg);
+  sched_enqueue(task);
+  return task;
+}
+
+/**
+ * Terminate the calling kernel thread. Does not return.
+ */
+void kthread_exit() {
+  irq_save();
+  task_retire(task_current());
+  schedule();
+  // An exited task is never picked again
+  halt();
+}
+
+/******************************************************************************/
+/**
+ * Make a task runnable and queue it on a CPU it is allowed to run on. The
+ * current CPU is preferred so the task stays cache-warm; an idle CPU is then
+ * kicked so it can steal the task.
+ * \param task The task to be queued.
+ */
+void sched_enqueue(task_t* task) {
+  uint64_t flags = irq_save();
+  cpu_t* cpu = this_cpu();
+  task->state = TASK_RUNNABLE;
+
+  // A task still on this CPU cannot move before its context is saved, and a
+  // deadline task only runs on the CPU holding its bandwidth
+  cpu_t* target = cpu;
+  if (task->sched_class == SCHED_DEADLINE) {
+    target = &cpus[task->dl_cpu];
+  } else if (!task->on_cpu && (task->affinity & CPU_MASK(cpu->id)) == 0) {
+    cpu_mask_t allowed =
+        task->affinity & __atomic_load_n(&cpu_online_mask, __ATOMIC_ACQUIRE);
+    for (int32_t i = 0; i < nb_cpu; i++) {
+      if ((allowed & CPU_MASK(i)) != 0) {
+        target = &cpus[i];
+        break;
+      }
+    }
+  }
+
+  if (target == cpu) {
+    cpu_enqueue_local(cpu, task);
+    if (task->sched_class == SCHED_NORMAL) cpu_kick_thief(cpu, task);
+  } else {
+    cpu_send(target, task);
+  }
+  irq_restore(flags);
+}
+
+/**
+ * Wake up a blocked task. Does nothing if the task is not blocked. A task that
+ * blocked on another CPU is queued once that CPU has saved its context.
+ * \param task The task to be woken up.
+ */
+void sched_wakeup(task_t* task) {
+  if (task == NULL) return;
+  if (__atomic_compare_exchange_n(&task->state, &(task_state_t){TASK_BLOCKED},
+                                  TASK_RUNNABLE, false, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_RELAXED)) {
+    // The other CPU is on its way into schedule() with interrupts disabled
+    while (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE) &&
+           task->cpu != cpu_current_id()) {
+      __asm__ volatile("pause");
+    }
+    sched_enqueue(task);
+  }
+}
+
+/**
+ * Finish a context switch on the new task's stack: the previous task's context
+ * is saved, so it may now run elsewhere and is queued again if it was still
+ * runnable. Called by schedule() and by the kernel thread entry trampoline.
+ */
+void sched_finish_switch() {
+  cpu_t* cpu = this_cpu();
+  task_t* prev = cpu->prev;
+  if (prev == NULL) return;
+  cpu->prev = NULL;
+  __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+  if (cpu->requeue_prev) {
+    cpu->requeue_prev = false;
+    sched_enqueue(prev);
+  }
+}
+
+/**
+ * Pick the next task and switch to it. Released deadline tasks run first in
+ * earliest-deadline order, then best-effort tasks from the run queue, then a
+ * task stolen from another CPU. If the current task is still running it is
+ * queued again. A task that wants to sleep sets its state to TASK_BLOCKED
+ * before calling this function.
+ */
+void schedule() {
+  uint64_t flags = irq_save();
+  cpu_t* cpu = this_cpu();
+  task_t* prev = cpu->current;
+  cpu->need_resched = false;
+  cpu_drain_inbox(cpu);
+
+  uint64_t now = read_tsc();
+
+  // Charge the deadline task for the time it ran. Once its budget is used up
+  // it waits for the next period instead of being queued again.
+  if (prev->sched_class == SCHED_DEADLINE) {
+    prev->dl_runtime += now - prev->dl_exec_start;
+    prev->dl_exec_start = now;
+    if (prev->state == TASK_RUNNING && prev->dl_runtime >= prev->dl_budget) {
+      dl_throttle(prev, now);
+    }
+  }
+  cpu_release_deadline(cpu, now);
+
+  // The current task is requeued once the switch has saved its context. A
+  // running deadline task keeps the CPU unless an earlier deadline is ready.
+  bool requeue = prev->state == TASK_RUNNING && prev != cpu->idle;
+  task_t* next = NULL;
+  if (requeue && prev->sched_class == SCHED_DEADLINE &&
+      (cpu->dl_ready == NULL ||
+       prev->dl_deadline < cpu->dl_ready->dl_deadline)) {
+    next = prev;
+  } else if (cpu->dl_ready != NULL) {
+    next = cpu->dl_ready;
+    cpu->dl_ready = next->next;
+    next->next = NULL;
+  } else {
+    next = cpu_pop(cpu, prev, &requeue);
+    // Only steal if this CPU would otherwise go idle
+    if (next == NULL && !requeue) next = cpu_steal(cpu);
+  }
+  if (next == NULL) {
+    bool allowed = (prev->affinity & CPU_MASK(cpu->id)) != 0;
+    next = prev->state == TASK_RUNNING && allowed ? prev : cpu->idle;
+  }
+
+  next->state = TASK_RUNNING;
+  if (next == prev) {
+    irq_restore(flags);
+    return;
+  }
+
+  next->dl_exec_start = now;
+
+  // A switch always happens in the kernel
+  prev->stime += now - prev->acct_last;
+  prev->nr_switch++;
+  next->acct_last = now;
+
+  if (requeue) {
+    prev->state = TASK_RUNNABLE;
+    cpu->requeue_prev = true;
+  }
+
+  next->cpu = cpu->id;
+  next->on_cpu = true;
+  cpu->current = next;
+  cpu->prev = prev;
+  cpu->nr_switch++;
+  if (next->kstack_top != 0) cpu_set_kernel_stack(cpu, next->kstack_top);
+  fpu_switch(cpu, prev, next);
+  // The task may have changed its mappings while running on another CPU
+  if (next->user) vm_sync_tlb(&cpu->vm_gen);
+
+  context_switch(&prev->ksp, next->ksp);
+
+  // Back on prev's stack
+  sched_finish_switch();
+  irq_restore(flags);
+}
+
+/**
+ * Give up the CPU to the next runnable task, if any.
+ */
+void sched_yield() { schedule(); }
+
+/**
+ * Restrict a task to the given CPUs. If the task is running on a CPU that is
+ * no longer allowed, it is moved at the next reschedule.
+ * \param pid Pid of the task. 0 means the current task.
+ * \param mask Allowed CPUs. Must include at least one online CPU.
+ * \returns true if the affinity is changed, else returns false.
+ */
+bool ksched_setaffinity(int64_t pid, cpu_mask_t mask) {
+  task_t* task = pid == 0 ? task_current() : task_find(pid);
+  if (task == NULL) return false;
+
+  if ((mask & __atomic_load_n(&cpu_online_mask, __ATOMIC_ACQUIRE)) == 0) {
+    kperror("[ERROR] sched_setaffinity: mask %x has no online CPU\n", mask);
+    return false;
+  }
+  if (task->sched_class == SCHED_DEADLINE &&
+      (mask & CPU_MASK(task->dl_cpu)) == 0) {
+    kperror("[ERROR] sched_setaffinity: deadline task must keep CPU %d\n",
+            task->dl_cpu);
+    return false;
+  }
+  task->affinity = mask;
+
+  // Queued tasks are forwarded when popped; a running one is rescheduled
+  int32_t cpu = task->cpu;
+  if (task->on_cpu && cpu >= 0 && (mask & CPU_MASK(cpu)) == 0) {
+    cpu_kick(&cpus[cpu]);
+  }
+  return true;
+}
+
+/**
+ * Read the affinity of a task.
+ * \param pid Pid of the task. 0 means the current task.
+ * \returns the affinity mask, or 0 if no such task.
+ */
+cpu_mask_t ksched_getaffinity(int64_t pid) {
+  task_t* task = pid == 0 ? task_current() : task_find(pid);
+  return task == NULL ? 0 : task->affinity;
+}
+
+/**
+ * Copy the run queue counters of every CPU into stats.
+ * \param stats Output array.
+ * \param max_cpu Number of entries in stats.
+ * \returns the number of entries written.
+ */
+int64_t ksched_get_stat(runqueue_stat_t* stats, size_t max_cpu) {
+  if (stats == NULL) return -1;
+
+  int64_t count = 0;
+  for (int32_t i = 0; i < nb_cpu && (size_t)i < max_cpu; i++) {
+    cpu_t* cpu = &cpus[i];
+    stats[i].cpu = cpu->id;
+    stats[i].online = cpu->online;
+    stats[i].length = runqueue_length(&cpu->rq);
+    stats[i].nr_push = cpu->rq.nr_push;
+    stats[i].nr_pop = cpu->rq.nr_pop;
+    stats[i].nr_steal = cpu->nr_steal;
+    stats[i].nr_steal_fail = cpu->nr_steal_fail;
+    stats[i].nr_stolen = cpu->rq.nr_stolen;
+    stats[i].nr_switch = cpu->nr_switch;
+    count++;
+  }
+  return count;
+}
+
+/******************************************************************************/
+/**
+ * Move a task into the deadline class. Only the calling task may change its
+ * own class. The request is rejected if the bandwidth budget / period does not
+ * fit in what is left of the CPU.
+ * \param pid Pid of the task. 0 means the current task.
+ * \param period_ns Length of a period in nanoseconds. 0 moves the task back to
+ * the best-effort class.
+ * \param budget_ns Run time needed per period in nanoseconds.
+ * \returns true if the class is changed, else returns false.
+ */
+bool ksched_setdeadline(int64_t pid, uint64_t period_ns, uint64_t budget_ns) {
+  task_t* task = task_current();
+  if (pid != 0 && pid != task->pid) {
+    kperror("[ERROR] sched_setdeadline: only the caller can change class\n");
+    return false;
+  }
+
+  uint64_t flags = irq_save();
+  cpu_t* cpu = this_cpu();
+
+  // Back to best-effort
+  if (period_ns == 0) {
+    if (task->sched_class == SCHED_DEADLINE) {
+      cpus[task->dl_cpu].dl_bw -= task->dl_bw;
+      task->sched_class = SCHED_NORMAL;
+    }
+    irq_restore(flags);
+    return true;
+  }
+
+  if (budget_ns == 0 || budget_ns > period_ns) {
+    kperror("[ERROR] sched_setdeadline: budget must be in (0, period]\n");
+    irq_restore(flags);
+    return false;
+  }
+
+  // Admission control: the CPU the task runs on must have room for it
+  uint64_t bw = budget_ns * DL_BW_UNIT / period_ns;
+  uint64_t old_bw = task->sched_class == SCHED_DEADLINE ? task->dl_bw : 0;
+  cpu_t* target =
+      task->sched_class == SCHED_DEADLINE ? &cpus[task->dl_cpu] : cpu;
+  if (target->dl_bw - old_bw + bw > DL_BW_LIMIT) {
+    kperror("[ERROR] sched_setdeadline: not enough bandwidth on CPU %d\n",
+            target->id);
+    irq_restore(flags);
+    return false;
+  }
+  target->dl_bw = target->dl_bw - old_bw + bw;
+
+  // The first period starts now
+  uint64_t now = read_tsc();
+  task->sched_class = SCHED_DEADLINE;
+  task->dl_cpu = target->id;
+  task->dl_bw = bw;
+  task->dl_period = ns_to_tsc(period_ns);
+  task->dl_budget = ns_to_tsc(budget_ns);
+  task->dl_release = now;
+  task->dl_deadline = now + task->dl_period;
+  task->dl_runtime = 0;
+  task->dl_exec_start = now;
+  task->dl_nr_period = 0;
+  task->dl_nr_missed = 0;
+  task->dl_nr_overrun = 0;
+  irq_restore(flags);
+  return true;
+}
+
+/**
+ * End the current period of the calling deadline task and sleep until the
+ * next one starts. Missed deadlines and budget overruns are counted here.
+ * \returns the number of deadlines missed so far, or -1 if the calling task is
+ * not in the deadline class.
+ */
+int64_t ksched_wait_period() {
+  uint64_t flags = irq_save();
+  task_t* task = task_current();
+  if (task->sched_class != SCHED_DEADLINE) {
+    irq_restore(flags);
+    return -1;
+  }
+
+  uint64_t now = read_tsc();
+  task->dl_runtime += now - task->dl_exec_start;
+  task->dl_exec_start = now;
+  task->dl_nr_period++;
+  if (task->dl_runtime > task->dl_budget) task->dl_nr_overrun++;
+  if (now > task->dl_deadline) task->dl_nr_missed++;
+
+  dl_next_period(task, now);
+  if (task->dl_release > now) {
+    // Sleep until the next period is released by schedule() or idle
+    task->state = TASK_BLOCKED;
+    dl_insert(&cpus[task->dl_cpu].dl_wait, task, true);
+    schedule();
+  } else {
+    task->dl_runtime = 0;
+  }
+
+  int64_t missed = task->dl_nr_missed;
+  irq_restore(flags);
+  return missed;
+}
+
+/**
+ * Throttle the calling deadline task if it used up the budget of its period.
+ * The kernel does not preempt, so the budget is enforced here, before each
+ * return from a system call, and whenever the task calls schedule().
+ */
+void ksched_enforce_budget() {
+  task_t* task = task_current();
+  if (task == NULL || task->sched_class != SCHED_DEADLINE) return;
+  if (task->dl_runtime + (read_tsc() - task->dl_exec_start) >=
+      task->dl_budget) {
+    schedule();
+  }
+}
+
+/**
+ * Block the calling task until a given time. The CPU runs other tasks or
+ * halts meanwhile. Without timer interrupts the task yields until the time
+ * has passed.
+ * \param deadline Time to wake up at, in ns since boot (see ktime_ns()).
+ * \returns 0 once the time has passed.
+ */
+int64_t ksched_sleep_until(uint64_t deadline) {
+  if (!timer_enabled()) {
+    while (ktime_ns() < deadline) sched_yield();
+    return 0;
+  }
+
+  uint64_t flags = irq_save();
+  if (ktime_ns() < deadline) {
+    task_t* task = task_current();
+    task->state = TASK_BLOCKED;
+    ktimer_arm(&task->sleep_timer, deadline);
+    schedule();
+    // Someone else may have woken us early
+    ktimer_cancel(&task->sleep_timer);
+  }
+  irq_restore(flags);
+  return 0;
+}
+
+/******************************************************************************/
+/**
+ * Charge the time since the last transition to the current task's user time
+ * and mark it as running in the kernel. Called when a system call or an
+ * interrupt arrives from user mode.
+ */
+void acct_enter_kernel() {
+  task_t* task = task_current();
+  if (task == NULL) return;
+  uint64_t now = read_tsc();
+  if (task->acct_user) {
+    task->utime += now - task->acct_last;
+  } else {
+    task->stime += now - task->acct_last;
+  }
+  task->acct_last = now;
+  task->acct_user = false;
+}
+
+/**
+ * Charge the time since the last transition to the current task's system time.
+ * Called right before returning to user mode.
+ */
+void acct_exit_kernel() {
+  task_t* task = task_current();
+  if (task == NULL) return;
+  uint64_t now = read_tsc();
+  task->stime += now - task->acct_last;
+  task->acct_last = now;
+  task->acct_user = task->user;
+}
+
+/**
+ * Copy the statistics of every task that is or was alive into stats.
+ * \param stats Output array.
+ * \param max_proc Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t ksched_procstat(proc_stat_t* stats, size_t max_proc) {
+  if (stats == NULL) return -1;
+
+  // Bring the caller's own counters up to date
+  acct_enter_kernel();
+
+  int64_t count = 0;
+  for (int32_t i = 0; i < MAX_NB_PROCESS && (size_t)count < max_proc; i++) {
+    task_t* task = &tasks[i];
+    if (task->state == TASK_UNUSED) continue;
+
+    proc_stat_t* stat = &stats[count++];
+    stat->pid = task->pid;
+    kmemcpy(stat->name, task->name, TASK_NAME_LEN);
+    stat->state = task->state;
+    stat->cpu = task->cpu;
+    stat->sched_class = task->sched_class;
+    stat->user = task->user;
+    stat->utime_ns = tsc_to_ns(task->utime);
+    stat->stime_ns = tsc_to_ns(task->stime);
+    stat->nr_switch = task->nr_switch;
+    stat->nr_page_fault = task->nr_page_fault;
+    stat->dl_nr_missed = task->dl_nr_missed;
+  }
+  return count;
+}
@@ -0,0 +1,172 @@
+#include "ktime.h"
+
+#include "kmem.h"
+#include "page.h"
+#include "util.h"
+
+// Length of one calibration run and the number of runs
+#define CALIBRATE_MS 10
+#define CALIBRATE_RUNS 3
+// Frequency assumed if the PIT does not respond, so time still moves forward
+#define TSC_FALLBACK_KHZ 1000000
+
+// Scale factors between TSC ticks and nanoseconds, as 32.32 fixed point
+uint64_t tsc_freq_khz = 0;
+uint64_t tsc_to_ns_mult = 0;
+uint64_t ns_to_tsc_mult = 0;
+uint64_t tsc_boot = 0;
+
+// Kernel view of the time page shared with user programs, and its physical
+// address
+vdso_time_t* vdso_time = NULL;
+uintptr_t vdso_page = 0;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Count TSC ticks while PIT channel 2 counts down CALIBRATE_MS milliseconds.
+ * \returns the number of TSC ticks, or 0 if the PIT never fires.
+ */
+uint64_t calibrate_once() {
+  uint16_t count = PIT_FREQ_HZ * CALIBRATE_MS / 1000;
+
+  // Gate high, speaker off
+  outb(PIT_CH2_GATE_PORT, (inb(PIT_CH2_GATE_PORT) & ~0x02) | 0x01);
+
+  // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+  outb(PIT_COMMAND, 0xB0);
+  outb(PIT_CHANNEL2, count & 0xFF);
+  outb(PIT_CHANNEL2, count >> 8);
+
+  // Restart the count by toggling the gate
+  uint8_t gate = inb(PIT_CH2_GATE_PORT) & ~0x01;
+  outb(PIT_CH2_GATE_PORT, gate);
+  outb(PIT_CH2_GATE_PORT, gate | 0x01);
+
+  uint64_t start = read_tsc();
+  // Output goes high at terminal count. Bail out if the PIT seems dead.
+  for (uint64_t spin = 0; !(inb(PIT_CH2_GATE_PORT) & 0x20); spin++) {
+    if (spin > 100000000) return 0;
+  }
+  return read_tsc() - start;
+}
+
+/******************************************************************************/
+/**
+ * Calibrate the TSC against PIT channel 2. Must be called before any other
+ * function in this file. If the PIT does not respond, a 1 GHz TSC is assumed.
+ * \returns true if calibration succeeds, else returns false.
+ */
+bool ktime_init() {
+  // Keep the shortest run: a longer one was disturbed by an SMI or the host
+  uint64_t best = 0;
+  for (int32_t i = 0; i < CALIBRATE_RUNS; i++) {
+    uint64_t ticks = calibrate_once();
+    if (ticks != 0 && (best == 0 || ticks < best)) best = ticks;
+  }
+  tsc_freq_khz = best != 0 ? best / CALIBRATE_MS : TSC_FALLBACK_KHZ;
+  tsc_to_ns_mult = (NS_PER_MS << 32) / tsc_freq_khz;
+  ns_to_tsc_mult = (tsc_freq_khz << 32) / NS_PER_MS;
+  tsc_boot = read_tsc();
+
+  // Without an invariant TSC the scale changes with the CPU frequency
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+  if (!(edx & (1 << 8))) {
+    kprintf("[WARNING] ktime_init: TSC is not invariant\n");
+  }
+  vdso_init();
+
+  if (best == 0) {
+    kperror("[ERROR] ktime_init: PIT calibration failed\n");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Publish the TSC scale factors in a read-only page mapped at USER_VDSO, so
+ * user programs can read the time without a system call (see clock_ns() in
+ * the stdlib). Called by ktime_init().
+ * \returns true if the page is mapped, else returns false.
+ */
+bool vdso_init() {
+  uintptr_t page = pmem_alloc();
+  if (page == 0) {
+    kperror("[ERROR] vdso_init: cannot allocate the time page\n");
+    return false;
+  }
+  vdso_page = page;
+  vdso_time = (vdso_time_t*)ptov(page);
+  kmemset(vdso_time, 0, PAGE_SIZE);
+
+  // Readers retry while seq is odd
+  vdso_time->seq++;
+  vdso_time->tsc_boot = tsc_boot;
+  vdso_time->tsc_to_ns_mult = tsc_to_ns_mult;
+  vdso_time->tsc_khz = tsc_freq_khz;
+  vdso_time->seq++;
+  return vdso_map();
+}
+
+/**
+ * Map the time page at USER_VDSO. Loading an executable unmaps the lower half,
+ * so run_exe() maps the page again for each program.
+ * \returns true if the page is mapped, else returns false.
+ */
+bool vdso_map() {
+  if (vdso_page == 0) return false;
+
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  if (!vm_map_phys(proot, USER_VDSO, vdso_page, true, false, false)) {
+    kperror("[ERROR] vdso_map: cannot map the time page\n");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Frequency of the TSC measured at boot.
+ * \returns the TSC frequency in kHz.
+ */
+uint64_t tsc_khz() { return tsc_freq_khz; }
+
+/**
+ * Convert a TSC delta to nanoseconds.
+ * \param tsc Number of TSC ticks.
+ * \returns the duration in nanoseconds.
+ */
+uint64_t tsc_to_ns(uint64_t tsc) {
+  return (uint64_t)(((unsigned __int128)tsc * tsc_to_ns_mult) >> 32);
+}
+
+/**
+ * Convert nanoseconds to a TSC delta.
+ * \param ns Duration in nanoseconds.
+ * \returns the number of TSC ticks.
+ */
+uint64_t ns_to_tsc(uint64_t ns) {
+  return (uint64_t)(((unsigned __int128)ns * ns_to_tsc_mult) >> 32);
+}
+
+/**
+ * Nanoseconds elapsed since ktime_init().
+ * \returns the current time in nanoseconds.
+ */
+uint64_t ktime_ns() { return tsc_to_ns(read_tsc() - tsc_boot); }
+
+/**
+ * Time of an absolute TSC value.
+ * \param tsc A TSC value read on this machine.
+ * \returns the time in nanoseconds since ktime_init().
+ */
+uint64_t ktime_from_tsc(uint64_t tsc) {
+  return tsc > tsc_boot ? tsc_to_ns(tsc - tsc_boot) : 0;
+}
+
+/**
+ * TSC value at a given time.
+ * \param ns Time in nanoseconds since ktime_init().
+ * \returns the TSC value at that time.
+ */
+uint64_t ktime_to_tsc(uint64_t ns) { return tsc_boot + ns_to_tsc(ns); }
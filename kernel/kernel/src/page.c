@@ -1,5 +1,7 @@
 #include "page.h"
 
+#include "spinlock.h"
+
 // hhdm struct allow us to get the base virtual address
 extern struct stivale2_struct_tag_hhdm* hhdm_struct_tag;
 // memmap struct tag allows us to find the usable memory regions
@@ -7,6 +9,20 @@ extern struct stivale2_struct_tag_memmap* mmap_struct_tag;
 
 // Pointer that point to the head of the page structure
 page_4kb_t* vfree_list_header = NULL;
+spinlock_t pmem_lock = SPINLOCK_INIT;
+
+// Every CPU shares the page tables. Taken by the functions that change them,
+// before pmem_lock when they allocate or free a table.
+spinlock_t vm_lock = SPINLOCK_INIT;
+// Bumped whenever a mapping is removed or changed. The other CPUs may still
+// cache the old translation until they call vm_sync_tlb().
+uint64_t vm_gen = 0;
+
+// Next free virtual address for device registers
+uintptr_t mmio_next = KERNEL_MMIO;
+
+// Whether PAT entry 1 is write-combining (see pat_init())
+bool pat_wc = false;
 
 /******************************************************************************/
 /**
@@ -63,13 +79,19 @@ bool init_free_list() {
  * \returns the physical address of the allocated physical memory or 0 on error.
  */
 uintptr_t pmem_alloc() {
+  uint64_t flags = irq_save();
+  spin_lock(&pmem_lock);
   if (vfree_list_header == NULL) {
+    spin_unlock(&pmem_lock);
+    irq_restore(flags);
     return 0;
   } else {
     // Get the virtual addr of the new allocated page
     uintptr_t vret_addr = (uintptr_t)vfree_list_header;
     // Advance the free list header to the next page
     vfree_list_header = (page_4kb_t*)(vfree_list_header->elems[0]);
+    spin_unlock(&pmem_lock);
+    irq_restore(flags);
     // Subtract vret_addr to hhdm base addr to get physical address
     return vret_addr - hhdm_struct_tag->addr;
   }
@@ -93,11 +115,15 @@ void pmem_free(uintptr_t p) {
   // free list.
   page_4kb_t* vfree_addr = (page_4kb_t*)(p + hhdm_struct_tag->addr);
 
+  uint64_t flags = irq_save();
+  spin_lock(&pmem_lock);
   // Update the free list' new header by first set the next of vfree_addr to
   // vfree_list_header
   vfree_addr->elems[0] = (uint64_t)vfree_list_header;
   // Make freed page to be the top of the free list
   vfree_list_header = vfree_addr;
+  spin_unlock(&pmem_lock);
+  irq_restore(flags);
 }
 
 /**
@@ -108,20 +134,17 @@ inline void vmem_free(uintptr_t v) { pmem_free(v - hhdm_struct_tag->addr); }
 
 /******************************************************************************/
 /**
- * Map a single page of memory into a virtual address space.
- * \param root The physical address of the top-level page table structure.
- * \param vaddress The virtual address to map into the address space.
- * \param user Boolean for user-accessible (also used for read permission).
- * \param writable Boolean for write permission.
- * \param executable Boolean for execute permission.
- * \returns true if the mapping succeeded, else return false.
+ * Find the page table entry of a virtual address, allocating the missing
+ * intermediate tables. The caller holds vm_lock.
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address.
+ * \returns pointer to the page table entry, or NULL on error.
  */
-bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
-            bool executable) {
+pt_4kb_entry_t* vm_walk(uintptr_t proot, uintptr_t vaddress) {
   // Early exit if root address = 0
   if (proot == 0) {
-    perror("[ERROR] vm_map: proot is NULL\n");
-    return false;
+    perror("[ERROR] vm_walk: proot is NULL\n");
+    return NULL;
   }
 
   // Get the based address given by hhdm. In this case we assume that it is in
@@ -148,7 +171,7 @@ bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
     // Allocate place for new pdpt and set its entries to 0
     // vpdpte is currently pointing to first entry of the pdpt
     vpdpte = (pdpt_entry_t*)pmem_alloc();
-    if ((uintptr_t)vpdpte == 0) return false;
+    if ((uintptr_t)vpdpte == 0) return NULL;
     vpml4e->pdpt_phyaddr = (uint64_t)vpdpte >> 12;
     vpdpte = (pdpt_entry_t*)((uintptr_t)vpdpte + base_vaddr);
     for (int i = 0; i < NUM_PT_ENTRIES; i++) ((uint64_t*)vpdpte)[i] = 0;
@@ -169,7 +192,7 @@ bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
     // Allocate place for new pd and set its entries to 0
     // vpde is currently pointing to first entry of the pd
     vpde = (pd_entry_t*)pmem_alloc();
-    if ((uintptr_t)vpde == 0) return false;
+    if ((uintptr_t)vpde == 0) return NULL;
     vpdpte->pd_phyaddr = (uint64_t)vpde >> 12;
     vpde = (pd_entry_t*)((uintptr_t)vpde + base_vaddr);
     for (int i = 0; i < NUM_PT_ENTRIES; i++) ((uint64_t*)vpde)[i] = 0;
@@ -189,7 +212,7 @@ bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
     // Allocate place for new pt and set its entries to 0
     // vpte is currently pointing to first entry of the pd
     vpte = (pt_4kb_entry_t*)pmem_alloc();
-    if ((uintptr_t)vpte == 0) return false;
+    if ((uintptr_t)vpte == 0) return NULL;
     vpde->pt_phyaddr = (uint64_t)vpte >> 12;
     vpte = (pt_4kb_entry_t*)((uintptr_t)vpte + base_vaddr);
     for (int i = 0; i < NUM_PT_ENTRIES; i++) ((uint64_t*)vpte)[i] = 0;
@@ -205,10 +228,37 @@ bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
         (pt_4kb_entry_t*)((vpde->pt_phyaddr << 12) + base_vaddr) + indices[1];
   }
 
+  return vpte;
+}
+
+/**
+ * Map a single page of memory into a virtual address space.
+ * \param root The physical address of the top-level page table structure.
+ * \param vaddress The virtual address to map into the address space.
+ * \param user Boolean for user-accessible (also used for read permission).
+ * \param writable Boolean for write permission.
+ * \param executable Boolean for execute permission.
+ * \returns true if the mapping succeeded, else return false.
+ */
+bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
+            bool executable) {
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
+  pt_4kb_entry_t* vpte = vm_walk(proot, vaddress);
+  if (vpte == NULL) {
+    spin_unlock(&vm_lock);
+    irq_restore(flags);
+    return false;
+  }
+
   // Map the page to address space
   if (vpte->present == 0) {
     uintptr_t pnew_page_addr = pmem_alloc();
-    if (pnew_page_addr == 0) return false;
+    if (pnew_page_addr == 0) {
+      spin_unlock(&vm_lock);
+      irq_restore(flags);
+      return false;
+    }
     vpte->phyaddr = pnew_page_addr >> 12;
     vpte->user_access = user ? 1 : 0;
     vpte->writable = writable ? 1 : 0;
@@ -220,16 +270,201 @@ bool vm_map(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
     vpte->writable = writable ? 1 : 0;
     vpte->exe_disable = executable ? 0 : 1;
   }
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
   return true;
 }
 
 /**
- * Unmap the page from the memory address space.
+ * Map a virtual page to a given physical page, e.g. a page shared between the
+ * kernel and every process. The physical page is not owned by the mapping:
+ * it must not be released with vm_unmap().
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address to map into the address space.
+ * \param paddress The page-aligned physical address to map to.
+ * \param user Boolean for user-accessible (also used for read permission).
+ * \param writable Boolean for write permission.
+ * \param executable Boolean for execute permission.
+ * \returns true if the mapping succeeded, else return false.
+ */
+bool vm_map_phys(uintptr_t proot, uintptr_t vaddress, uintptr_t paddress,
+                 bool user, bool writable, bool executable) {
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
+  pt_4kb_entry_t* vpte = vm_walk(proot, vaddress);
+  if (vpte == NULL) {
+    spin_unlock(&vm_lock);
+    irq_restore(flags);
+    return false;
+  }
+
+  bool remap = vpte->present;
+  vpte->phyaddr = paddress >> 12;
+  vpte->user_access = user ? 1 : 0;
+  vpte->writable = writable ? 1 : 0;
+  vpte->exe_disable = executable ? 0 : 1;
+  vpte->present = 1;
+  if (remap) {
+    __asm__ volatile("invlpg (%0)" ::"r"(vaddress) : "memory");
+    __atomic_add_fetch(&vm_gen, 1, __ATOMIC_RELEASE);
+  }
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
+  return true;
+}
+
+/**
+ * Remove a mapping made with vm_map_phys(). The physical page is not freed.
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address to unmap.
+ * \returns true if the page is no longer mapped, else return false.
+ */
+bool vm_unmap_phys(uintptr_t proot, uintptr_t vaddress) {
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
+  pt_4kb_entry_t* vpte = vm_walk(proot, vaddress);
+  if (vpte != NULL && vpte->present) {
+    vpte->present = 0;
+    __asm__ volatile("invlpg (%0)" ::"r"(vaddress) : "memory");
+    __atomic_add_fetch(&vm_gen, 1, __ATOMIC_RELEASE);
+  }
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
+  return vpte != NULL;
+}
+
+/**
+ * Map physical memory at the next free address of the KERNEL_MMIO range.
+ * \param paddress Physical address of the memory.
+ * \param size Size of the memory in bytes.
+ * \param write_combining Map write-combining rather than uncached.
+ * \returns the virtual address of paddress, or 0 on error.
+ */
+uintptr_t vm_map_io(uintptr_t paddress, size_t size, bool write_combining) {
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  uintptr_t pstart = paddress & PAGE_ALIGN_MASK;
+  uintptr_t pend = paddress + size;
+
+  // Reserve the whole range first
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
+  uintptr_t vstart = mmio_next;
+  mmio_next += ROUND_UP(pend - pstart, PAGE_SIZE);
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
+
+  for (uintptr_t p = pstart; p < pend; p += PAGE_SIZE) {
+    uintptr_t v = vstart + (p - pstart);
+    if (!vm_map_phys(proot, v, p, false, true, false)) {
+      kperror("[ERROR] vm_map_io: cannot map %p\n", p);
+      return 0;
+    }
+    if (write_combining) {
+      vm_set_write_combining(proot, v);
+    } else {
+      // Registers must not be cached or have their writes combined
+      flags = irq_save();
+      spin_lock(&vm_lock);
+      pt_4kb_entry_t* vpte = vm_walk(proot, v);
+      vpte->cache_disable = 1;
+      vpte->page_write_through = 1;
+      spin_unlock(&vm_lock);
+      irq_restore(flags);
+    }
+  }
+  return vstart + (paddress - pstart);
+}
+
+/**
+ * Map device registers into the kernel's address space, uncached.
+ * \param paddress Physical address of the registers.
+ * \param size Size of the register window in bytes.
+ * \returns the virtual address of paddress, or 0 on error.
+ */
+uintptr_t vm_map_mmio(uintptr_t paddress, size_t size) {
+  return vm_map_io(paddress, size, false);
+}
+
+/**
+ * Map memory written in bulk by the CPU, such as a framebuffer, into the
+ * kernel's address space, write-combining.
+ * \param paddress Physical address of the memory.
+ * \param size Size of the memory in bytes.
+ * \returns the virtual address of paddress, or 0 on error.
+ */
+uintptr_t vm_map_wc(uintptr_t paddress, size_t size) {
+  return vm_map_io(paddress, size, true);
+}
+
+/**
+ * Make a mapped page write-combining: writes are buffered and sent to memory
+ * in bursts, reads are not cached. Suits framebuffers, which are written far
+ * more than read. Without the PAT the page is made uncached instead.
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address of the page.
+ * \returns true if the page is mapped, else return false.
+ */
+bool vm_set_write_combining(uintptr_t proot, uintptr_t vaddress) {
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
+  pt_4kb_entry_t* vpte = vm_walk(proot, vaddress);
+  if (vpte != NULL) {
+    // PAT entry 1 (see PAT_LAYOUT), or entry 3 (uncached) without the PAT
+    vpte->PAT = 0;
+    vpte->cache_disable = pat_wc ? 0 : 1;
+    vpte->page_write_through = 1;
+    __asm__ volatile("invlpg (%0)" ::"r"(vaddress) : "memory");
+    __atomic_add_fetch(&vm_gen, 1, __ATOMIC_RELEASE);
+  }
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
+  return vpte != NULL;
+}
+
+/**
+ * Program the PAT so that pages with only PWT set are write-combining. Call
+ * on every CPU before it maps such pages; every CPU must use the same layout.
+ * \returns true if write-combining is available, else returns false.
+ */
+bool pat_init() {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  if ((edx & CPUID_1_EDX_PAT) == 0) {
+    kprintf("[WARNING] pat_init: no PAT, write-combining is not available\n");
+    return false;
+  }
+
+  // Caches and TLBs must not hold lines of the old types across the change
+  uint64_t flags = irq_save();
+  __asm__ volatile("wbinvd" ::: "memory");
+  write_msr(MSR_PAT, PAT_LAYOUT);
+  __asm__ volatile("wbinvd" ::: "memory");
+  write_cr3(read_cr3());
+  irq_restore(flags);
+  pat_wc = true;
+  return true;
+}
+
+/**
+ * Flush the TLB of the calling CPU if a mapping was removed or changed since
+ * it last did. Called before a user task runs on the CPU, since the task may
+ * have changed its mappings while running on another CPU.
+ * \param seen Generation the calling CPU last flushed at. Updated.
+ */
+void vm_sync_tlb(uint64_t* seen) {
+  uint64_t gen = __atomic_load_n(&vm_gen, __ATOMIC_ACQUIRE);
+  if (*seen == gen) return;
+  *seen = gen;
+  write_cr3(read_cr3());
+}
+
+/**
+ * Unmap the page from the memory address space. The caller holds vm_lock.
  * \param proot The physical address of the top-level page table structure.
  * \param vaddress The virtual address to unmap from the address space.
  * \returns true if unmap successfully, else returns false.
  */
-bool vm_unmap(uintptr_t proot, uintptr_t vaddress) {
+bool vm_unmap_entry(uintptr_t proot, uintptr_t vaddress) {
   // Early exit if root address = 0
   if (proot == 0) {
     perror("[ERROR] vm_unmap: proot is NULL\n");
@@ -314,9 +549,26 @@ bool vm_unmap(uintptr_t proot, uintptr_t vaddress) {
   return true;
 }
 
+/**
+ * Unmap the page from the memory address space.
+ * \param proot The physical address of the top-level page table structure.
+ * \param vaddress The virtual address to unmap from the address space.
+ * \returns true if unmap successfully, else returns false.
+ */
+bool vm_unmap(uintptr_t proot, uintptr_t vaddress) {
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
+  bool ret = vm_unmap_entry(proot, vaddress);
+  __atomic_add_fetch(&vm_gen, 1, __ATOMIC_RELEASE);
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
+  return ret;
+}
+
 /**
  * Change the protection mode of the mapped page. If the virtual address is not
- * mapped, we return false. Return true if mode change success.
+ * mapped, we return false. Return true if mode change success. The caller
+ * holds vm_lock.
  * \param root The physical address of the top-level page table structure.
  * \param vaddress The virtual address.
  * \param user Boolean for user-accessible (also used for read permission).
@@ -324,8 +576,8 @@ bool vm_unmap(uintptr_t proot, uintptr_t vaddress) {
  * \param executable Boolean for execute permission.
  * \returns true if the changing permission succeeded, else return false.
  */
-bool vm_protect(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
-                bool executable) {
+bool vm_protect_entry(uintptr_t proot, uintptr_t vaddress, bool user,
+                      bool writable, bool executable) {
   // Early exit if root address = 0
   if (proot == 0) {
     perror("[ERROR] vm_protect: proot is NULL\n");
@@ -391,6 +643,27 @@ bool vm_protect(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
   }
 }
 
+/**
+ * Change the protection mode of the mapped page. If the virtual address is not
+ * mapped, we return false. Return true if mode change success.
+ * \param root The physical address of the top-level page table structure.
+ * \param vaddress The virtual address.
+ * \param user Boolean for user-accessible (also used for read permission).
+ * \param writable Boolean for write permission.
+ * \param executable Boolean for execute permission.
+ * \returns true if the changing permission succeeded, else return false.
+ */
+bool vm_protect(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
+                bool executable) {
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
+  bool ret = vm_protect_entry(proot, vaddress, user, writable, executable);
+  __atomic_add_fetch(&vm_gen, 1, __ATOMIC_RELEASE);
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
+  return ret;
+}
+
 /**
  * By professor Charlie Curtsinger
  * src:
@@ -401,6 +674,8 @@ bool vm_protect(uintptr_t proot, uintptr_t vaddress, bool user, bool writable,
  * \param root The physical address of the top-level page table structure.
  */
 void unmap_lower_half(uintptr_t root) {
+  uint64_t flags = irq_save();
+  spin_lock(&vm_lock);
   // We can reclaim memory used to hold page tables, but NOT the mapped pages
   pt_entry_t* l4_table = (pt_entry_t*)ptov(root);
   for (size_t l4_index = 0; l4_index < 256; l4_index++) {
@@ -435,6 +710,9 @@ void unmap_lower_half(uintptr_t root) {
   }
   // Reload CR3 to flush any cached address translations
   write_cr3(read_cr3());
+  __atomic_add_fetch(&vm_gen, 1, __ATOMIC_RELEASE);
+  spin_unlock(&vm_lock);
+  irq_restore(flags);
 }
 
 /******************************************************************************/
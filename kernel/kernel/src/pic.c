@@ -104,3 +104,16 @@ void pic_unmask_irq(uint8_t num) {
     outb(PIC2_DATA, mask);
   }
 }
+
+/// Mask every IRQ, once the APICs deliver interrupts instead
+void pic_disable() {
+  outb(PIC1_DATA, 0xFF);
+  outb(PIC2_DATA, 0xFF);
+}
+
+/// Acknowledge an IRQ by number (0-15)
+void pic_eoi(uint8_t num) {
+  // IRQs of the secondary PIC go through both
+  if (num >= 8) outb(PIC2_COMMAND, PIC_EOI);
+  outb(PIC1_COMMAND, PIC_EOI);
+}
@@ -11,6 +11,7 @@ extern char _binary_fonts_font_psf_end;
 extern int32_t screen_w;
 extern int32_t screen_h;
 extern uintptr_t buffer_addr;
+extern int32_t buffer_stride;
 
 // Global variables related to the loaded psf font
 int32_t psf_font_w = 0;
@@ -24,6 +25,51 @@ char* psf_glyph_start = NULL;
 int32_t term_w = 0;
 int32_t term_h = 0;
 
+// Two pixels at a time. Cache rows are written as pixel_t, so the copies need
+// a type that may alias them.
+typedef uint64_t __attribute__((may_alias)) pixel_pair_t;
+
+// Expanded glyph rows of the recently used color pairs
+psf_cache_entry_t psf_cache[PSF_CACHE_SIZE];
+uint64_t psf_cache_clock = 0;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Find the expanded rows of a color pair, building them in place of the least
+ * recently used pair if needed.
+ */
+psf_cache_entry_t* psf_cache_get(color_t fg, color_t bg) {
+  psf_cache_clock++;
+  psf_cache_entry_t* victim = &psf_cache[0];
+  for (int32_t i = 0; i < PSF_CACHE_SIZE; i++) {
+    psf_cache_entry_t* entry = &psf_cache[i];
+    if (entry->used && entry->fg == fg && entry->bg == bg) {
+      entry->last_used = psf_cache_clock;
+      return entry;
+    }
+    // Free entries go first, then the least recently used
+    if (!entry->used ||
+        (victim->used && entry->last_used < victim->last_used)) {
+      victim = entry;
+    }
+  }
+
+  // Bit 7 of a glyph byte is its leftmost pixel
+  for (int32_t bits = 0; bits < 256; bits++) {
+    for (int32_t j = 0; j < 8; j++) {
+      victim->rows[bits][j] = (bits & (0x80 >> j)) ? fg : bg;
+    }
+  }
+  victim->used = true;
+  victim->fg = fg;
+  victim->bg = bg;
+  victim->last_used = psf_cache_clock;
+  return victim;
+}
+
+/******************************************************************************/
+
 /**
  * Init the information regarding the current psf font.
  * Requirement: The screen pixel width must be a multiple of each glyph's width.
@@ -49,8 +95,8 @@ bool psf_init() {
 }
 
 /**
- * Using the glyphs table to draw pixel-by-pixel the characters onto the frame
- * framebuffer.
+ * Draw a character onto the frame buffer, one glyph row at a time, from the
+ * pixel rows cached for its colors.
  * \param c: Character to be printed.
  * \param pixel_row: The row index of the top left pixel.
  * \param pixel_col: The col index of the top left pixel.
@@ -61,37 +107,72 @@ bool psf_init() {
  */
 bool psf_put_char(char c, int32_t pixel_row, int32_t pixel_col, color_t fg,
                   color_t bg) {
-  // Check for out of bound
-  if (pixel_row >= screen_h - psf_font_h ||
-      pixel_col >= screen_w - psf_font_w || c < 0 || c >= psf_nglyph) {
-    return false;
+  if (c < 0 || c >= psf_nglyph) return false;
+  return psf_put_chars(&c, 1, pixel_row, pixel_col, fg, bg) == 1;
+}
+
+/**
+ * Draw a run of characters in the same colors side by side. The run is drawn
+ * one pixel row at a time across all its characters, with one look-up of the
+ * color pair.
+ * \param s: Characters to be printed.
+ * \param n: Number of characters.
+ * \param pixel_row: The row index of the top left pixel.
+ * \param pixel_col: The col index of the top left pixel of the first one.
+ * \param fg: Foreground color of the characters.
+ * \param bg: Background color of the characters.
+ * \returns the number of characters drawn; the ones past the right edge are
+ * not.
+ */
+int32_t psf_put_chars(const char* s, int32_t n, int32_t pixel_row,
+                      int32_t pixel_col, color_t fg, color_t bg) {
+  // Check for out of bound. A glyph may start left of screen_w - psf_font_w.
+  int32_t room = screen_w - psf_font_w - pixel_col;
+  if (pixel_row >= screen_h - psf_font_h || pixel_row < 0 || pixel_col < 0 ||
+      room <= 0 || buffer_addr == 0) {
+    return 0;
   }
+  int32_t nb_fit = (room + psf_font_w - 1) / psf_font_w;
+  if (n > nb_fit) n = nb_fit;
+  if (n <= 0) return 0;
 
-  // 1. Find the address of the glymph that corresponds to character c:
-  char* glyph = &psf_glyph_start[(uint32_t)c * psf_glyph_sz];
+  // 1. Find the pixels of every byte of glyph bits in these colors:
+  psf_cache_entry_t* entry = psf_cache_get(fg, bg);
+  int32_t bytes_per_row = (psf_font_w + 7) / 8;
 
   // 2. Find location on the frame buffer to print:
-  pixel_t* row_start = (pixel_t*)buffer_addr + pixel_row * screen_w + pixel_col;
+  pixel_t* row_start =
+      (pixel_t*)buffer_addr + pixel_row * buffer_stride + pixel_col;
 
-  // 3. Print each row in the glyph to the frame buffer with fg and bg colors:
+  // 3. Copy row i of each glyph, 8 pixels per byte of bits. Rows of glyphs
+  // wider than 8 pixels take several bytes. Characters out of the font are
+  // left as they were.
   for (int i = 0; i < psf_font_h; i++) {
-    // cursor points to current pixel in the frame buffer
     pixel_t* cursor = row_start;
-    // cur_glyph_row points to the current row in the printed glyph
-    uint8_t cur_glyph_row = glyph[i];
-    uint8_t mask = 0x80;
-
-    // Each bits in the glyph corresponds to a pixel in the frame buffer.
-    // If the bit is 0, we put background color to the frame buffer, else
-    // we put foreground color to the frame buffer.
-    for (int j = 0; j < psf_font_w; j++) {
-      *cursor = ((cur_glyph_row & mask) == 0) ? (pixel_t)bg : (pixel_t)fg;
-      mask >>= 1;
-      cursor++;
+    for (int32_t k = 0; k < n; k++, cursor += psf_font_w) {
+      char c = s[k];
+      if (c < 0 || c >= psf_nglyph) continue;
+      const uint8_t* bits =
+          (const uint8_t*)&psf_glyph_start[(uint32_t)c * psf_glyph_sz] +
+          i * bytes_per_row;
+      for (int j = 0; j < psf_font_w; j += 8) {
+        const pixel_t* pixels = entry->rows[*bits++];
+        if (psf_font_w - j >= 8) {
+          pixel_pair_t* dst = (pixel_pair_t*)(cursor + j);
+          const pixel_pair_t* src = (const pixel_pair_t*)pixels;
+          dst[0] = src[0];
+          dst[1] = src[1];
+          dst[2] = src[2];
+          dst[3] = src[3];
+        } else {
+          for (int p = 0; p < psf_font_w - j; p++) cursor[j + p] = pixels[p];
+        }
+      }
     }
 
     // Advance to the next row_start in the frame buffer.
-    row_start += screen_w;
+    row_start += buffer_stride;
   }
-  return true;
+  kgraphic_mark_dirty(pixel_col, pixel_row, n * psf_font_w, psf_font_h);
+  return n;
 }
@@ -0,0 +1,131 @@
+#include "smp.h"
+
+// Defined in ksched.c
+extern cpu_t cpus[MAX_NB_CPU];
+extern int32_t nb_cpu;
+extern int32_t nb_cpu_online;
+extern int32_t boot_cpu;
+extern bool cpu_tsc_aux;
+// Defined in page.c
+extern bool pat_wc;
+// Defined in boot.c
+extern void enable_sse();
+
+// Page tables of the boot CPU
+uintptr_t smp_cr3 = 0;
+// CPUs that reached ap_entry()
+int32_t nb_cpu_parked = 0;
+// Set by smp_start() to release the parked CPUs
+bool smp_go = false;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Find the CPU with a given APIC ID.
+ * \param lapic_id APIC ID from the SMP struct tag.
+ * \returns pointer to the CPU struct, or NULL if sched_init() left it out.
+ */
+cpu_t* smp_find_cpu(uint32_t lapic_id) {
+  for (int32_t i = 0; i < nb_cpu; i++) {
+    if (cpus[i].lapic_id == lapic_id) return &cpus[i];
+  }
+  return NULL;
+}
+
+/**
+ * Entry point of an application processor. The bootloader jumps here on the
+ * stack of the CPU's idle task, with interrupts disabled. Does not return.
+ * \param info The CPU's entry in the SMP struct tag.
+ */
+void ap_entry(struct stivale2_smp_info* info) {
+  int32_t id = (int32_t)info->extra_argument;
+  cpu_t* cpu = &cpus[id];
+
+  // Leave the bootloader's tables. cpu_current_id() works from here on.
+  write_cr3(smp_cr3);
+  gdt_load_cpu(id, cpu->idle->kstack_top);
+  idt_load();
+  write_msr(MSR_TSC_AUX, id);
+  __atomic_add_fetch(&nb_cpu_parked, 1, __ATOMIC_RELEASE);
+
+  while (!__atomic_load_n(&smp_go, __ATOMIC_ACQUIRE)) {
+    __asm__ volatile("pause");
+  }
+
+  // Repeat the per-CPU part of setup_kernel()
+  enable_sse();
+  write_cr0(read_cr0() | CR0_WP);
+  if (pat_wc) pat_init();
+  lapic_init();
+  fpu_init_cpu();
+  syscall_fast_init();
+  sched_cpu_online();
+}
+
+/******************************************************************************/
+/**
+ * Move the application processors out of the bootloader. Each one loads the
+ * GDT, its TSS and the IDT on the stack of its idle task, then waits for
+ * smp_start() with interrupts disabled. Call after sched_init() and
+ * apic_init(), and before unmap_lower_half() takes the bootloader's code away
+ * from them.
+ * \param smp_tag SMP struct tag from the bootloader (may be NULL).
+ * \returns the number of CPUs parked.
+ */
+int32_t smp_park(struct stivale2_struct_tag_smp* smp_tag) {
+  if (smp_tag == NULL || nb_cpu == 1) return 0;
+
+  // cpu_current_id() reads IA32_TSC_AUX, and CPUs signal each other through
+  // the local APIC
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+  if (!apic_enabled() || !(edx & CPUID_EXT_EDX_RDTSCP)) {
+    kprintf("[WARNING] smp_park: no local APIC or RDTSCP, using one CPU\n");
+    return 0;
+  }
+  write_msr(MSR_TSC_AUX, boot_cpu);
+  cpu_tsc_aux = true;
+  smp_cr3 = read_cr3();
+
+  int32_t nb_sent = 0;
+  for (uint64_t i = 0; i < smp_tag->cpu_count; i++) {
+    struct stivale2_smp_info* info = &smp_tag->smp_info[i];
+    cpu_t* cpu = smp_find_cpu(info->lapic_id);
+    if (cpu == NULL || cpu->id == boot_cpu || cpu->idle == NULL) continue;
+    info->extra_argument = cpu->id;
+    info->target_stack = cpu->idle->kstack_top;
+    // The CPU jumps as soon as it sees goto_address
+    __atomic_store_n(&info->goto_address, (uint64_t)ap_entry,
+                     __ATOMIC_RELEASE);
+    nb_sent++;
+  }
+
+  for (uint64_t spin = 0; spin < SMP_PARK_SPINS; spin++) {
+    if (__atomic_load_n(&nb_cpu_parked, __ATOMIC_ACQUIRE) == nb_sent) break;
+    __asm__ volatile("pause");
+  }
+  if (nb_cpu_parked != nb_sent) {
+    kperror("[ERROR] smp_park: %d of %d CPUs answered\n", nb_cpu_parked,
+            nb_sent);
+  }
+  return nb_cpu_parked;
+}
+
+/**
+ * Let the parked CPUs finish their setup and run their idle task. Call at the
+ * end of setup_kernel(), once everything they share is initialized.
+ * \returns the number of CPUs online.
+ */
+int32_t smp_start() {
+  int32_t expected = 1 + __atomic_load_n(&nb_cpu_parked, __ATOMIC_ACQUIRE);
+  if (expected == 1) return nb_cpu_online;
+
+  __atomic_store_n(&smp_go, true, __ATOMIC_RELEASE);
+  uint64_t end = read_tsc() + ns_to_tsc(SMP_START_TIMEOUT_NS);
+  while (__atomic_load_n(&nb_cpu_online, __ATOMIC_ACQUIRE) < expected &&
+         read_tsc() < end) {
+    __asm__ volatile("pause");
+  }
+  kprintf("[INFO] smp_start: %d of %d CPUs online\n", nb_cpu_online, nb_cpu);
+  return nb_cpu_online;
+}
@@ -0,0 +1,167 @@
+#include "softirq.h"
+
+// Deferred work of each CPU
+softirq_cpu_t softirq_cpus[MAX_NB_CPU];
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Unlink the first pending item of a CPU. Interrupts must be disabled.
+ * \param sc The CPU's deferred work state.
+ * \returns the item, or NULL if none is pending.
+ */
+softirq_work_t* softirq_pop(softirq_cpu_t* sc) {
+  softirq_work_t* work = sc->head;
+  if (work == NULL) return NULL;
+  sc->head = work->next;
+  if (sc->head == NULL) sc->tail = NULL;
+  work->next = NULL;
+  return work;
+}
+
+// Wait condition of softirqd
+bool softirq_pending(void* arg) { return ((softirq_cpu_t*)arg)->head != NULL; }
+
+/**
+ * Wake the softirqd thread of a CPU and have it run at the next reschedule.
+ * \param sc The CPU's deferred work state.
+ */
+void softirq_wake_thread(softirq_cpu_t* sc) {
+  if (sc->thread == NULL) return;
+  waitq_wake_one(&sc->waitq);
+  this_cpu()->need_resched = true;
+}
+
+/**
+ * Run pending work on the calling CPU. Called with interrupts disabled; they
+ * are enabled while each item runs.
+ * \param sc The CPU's deferred work state.
+ * \param limited Whether to stop after SOFTIRQ_BUDGET items or
+ * SOFTIRQ_TIME_LIMIT_NS.
+ * \returns true if the queue is empty, or false if the limits were hit.
+ */
+bool softirq_drain(softirq_cpu_t* sc, bool limited) {
+  sc->running = true;
+  uint64_t start = read_tsc();
+  uint64_t time_limit = ns_to_tsc(SOFTIRQ_TIME_LIMIT_NS);
+  size_t budget = SOFTIRQ_BUDGET;
+
+  softirq_work_t* work;
+  while ((work = softirq_pop(sc)) != NULL) {
+    uint64_t now = read_tsc();
+    uint64_t latency = now - work->raised_tsc;
+    // Cleared first so the function may raise the item again
+    work->queued = false;
+    work->last_latency = latency;
+    if (latency > work->max_latency) work->max_latency = latency;
+    if (latency > sc->max_latency) sc->max_latency = latency;
+    work->nr_run++;
+    sc->nr_run++;
+
+    __asm__ volatile("sti");
+    work->fn(work, work->arg);
+    __asm__ volatile("cli");
+
+    if (limited && (--budget == 0 || read_tsc() - start >= time_limit)) break;
+  }
+
+  sc->running = false;
+  return sc->head == NULL;
+}
+
+/**
+ * Body of the softirqd thread of a CPU: sleep until work is queued, then run
+ * it in batches, yielding between them so the thread does not starve tasks.
+ * \param arg The CPU's deferred work state.
+ */
+void softirqd_loop(void* arg) {
+  softirq_cpu_t* sc = (softirq_cpu_t*)arg;
+  while (true) {
+    waitq_wait(&sc->waitq, softirq_pending, sc);
+    uint64_t flags = irq_save();
+    if (!sc->running) softirq_drain(sc, true);
+    irq_restore(flags);
+    sched_yield();
+  }
+}
+
+/******************************************************************************/
+/**
+ * Start the softirqd thread of each online CPU. Work raised before runs on
+ * interrupt exit only. Call after sched_init().
+ * \returns true if the threads are created, else returns false.
+ */
+bool softirq_init() {
+  cpu_t* cpu = this_cpu();
+  softirq_cpu_t* sc = &softirq_cpus[cpu->id];
+  waitq_init(&sc->waitq);
+  sc->thread = kthread_create("softirqd", softirqd_loop, sc, CPU_MASK(cpu->id));
+  if (sc->thread == NULL) {
+    kperror("[ERROR] softirq_init: cannot create softirqd\n");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Prepare a work item.
+ * \param work The work item.
+ * \param fn Function to run.
+ * \param arg Argument passed to fn.
+ */
+void softirq_work_init(softirq_work_t* work, softirq_fn_t fn, void* arg) {
+  *work = (softirq_work_t)SOFTIRQ_WORK_INIT(fn, arg);
+}
+
+/**
+ * Queue a work item on the calling CPU. Safe in interrupt context. From an
+ * interrupt handler the item runs on interrupt exit; otherwise softirqd is
+ * woken up to run it.
+ * \param work The work item.
+ * \returns true if the item is queued, or false if it was already pending.
+ */
+bool softirq_raise(softirq_work_t* work) {
+  uint64_t flags = irq_save();
+  if (work->queued) {
+    irq_restore(flags);
+    return false;
+  }
+
+  softirq_cpu_t* sc = &softirq_cpus[cpu_current_id()];
+  work->queued = true;
+  work->raised_tsc = read_tsc();
+  work->next = NULL;
+  if (sc->tail == NULL) {
+    sc->head = work;
+  } else {
+    sc->tail->next = work;
+  }
+  sc->tail = work;
+  sc->nr_raise++;
+
+  // Nobody would run it soon outside of an interrupt or a drain
+  if (sc->irq_depth == 0 && !sc->running) softirq_wake_thread(sc);
+  irq_restore(flags);
+  return true;
+}
+
+/**
+ * Mark the start of an interrupt handler. Pair with softirq_irq_exit().
+ */
+void softirq_irq_enter() { softirq_cpus[cpu_current_id()].irq_depth++; }
+
+/**
+ * Mark the end of an interrupt handler. The outermost handler runs pending
+ * work with interrupts enabled, within SOFTIRQ_BUDGET items and
+ * SOFTIRQ_TIME_LIMIT_NS, and leaves the rest to softirqd. Interrupts are
+ * disabled again on return.
+ */
+void softirq_irq_exit() {
+  softirq_cpu_t* sc = &softirq_cpus[cpu_current_id()];
+  if (--sc->irq_depth != 0 || sc->running || sc->head == NULL) return;
+
+  if (!softirq_drain(sc, true)) {
+    sc->nr_defer++;
+    softirq_wake_thread(sc);
+  }
+}
@@ -1,5 +1,8 @@
 #include "syscall.h"
 
+#include "gdt.h"
+#include "klatency.h"
+
 // External functions for system call handler. syscall(uint64_t nr, ...) is
 // defined in asm/syscall.s
 extern int64_t syscall(uint64_t nr, ...);
@@ -7,96 +10,420 @@ extern struct stivale2_struct_tag_framebuffer* framebuffer_struct_tag;
 extern int32_t screen_w;
 extern int32_t screen_h;
 extern uintptr_t buffer_addr;
+extern int32_t buffer_stride;
+extern keyboard_t keyboard;
+// Defined in asm/syscall_fast_entry.s
+extern void syscall_fast_entry();
+
+// Dispatch table, indexed by SYSCALL_INDEX_*
+#define SYSCALL_TABLE_ENTRY(NAME, func, num, argc) \
+  {.fn = ksys_##func, .name = #func, .nr = num, .nb_args = argc},
+syscall_entry_t syscall_table[NB_SYSCALL] = {SYSCALL_LIST(SYSCALL_TABLE_ENTRY)};
+
+// Index in syscall_table plus one for each system call number, 0 for unused
+// numbers
+#define SYSCALL_SLOT_ENTRY(NAME, name, num, argc) \
+  [num] = SYSCALL_INDEX_##NAME + 1,
+const uint16_t syscall_slot_map[SYSCALL_NR_LIMIT] = {
+    SYSCALL_LIST(SYSCALL_SLOT_ENTRY)};
 
 /**
  * syscall_handler(...) is being called inside syscall_entry(). Notice that
- * syscall_entry() is invoked by the interrupt 80. Based on the value of arg nr,
- * the function would invoke the appropriate system call handlers.
+ * syscall_entry() is invoked by the interrupt 80. The time spent in the kernel
+ * is charged to the calling process.
  */
 int64_t syscall_handler(uint64_t nr, uint64_t arg0, uint64_t arg1,
                         uint64_t arg2, uint64_t arg3, uint64_t arg4,
                         uint64_t arg5) {
-  uintptr_t proot = 0;
-  switch (nr) {
-    case SYSCALL_READ:
-      /**
-       * arg0: file descriptor
-       * arg1: pointer to buffer
-       * arg2: read size
-       * arg3: boolean include newline or not
-       * arg4: boolean echo input char to terminal or not.
-       * arg5: the number of read character so far.
-       */
-      return read_handler(arg0, (char*)arg1, arg2, (bool)arg3, (bool)arg4,
-                          (int64_t)arg5);
-    case SYSCALL_WRITE:
-      /**
-       * arg0: file descriptor
-       * arg1: pointer to string to be printed
-       * arg2: write size
-       */
-      return write_handler(arg0, (const char*)arg1, arg2);
-    case SYSCALL_MMAP:
-      proot = read_cr3() & PAGE_ALIGN_MASK;
-      /**
-       * arg0: vaddress
-       * arg1: user permission (currently same with readable)
-       * arg2: write permission
-       * arg3: execute permission
-       */
-      return vm_map(proot, (uintptr_t)arg0, (bool)arg1, (bool)arg2, (bool)arg3);
-    case SYSCALL_MPROTECT:
-      proot = read_cr3() & PAGE_ALIGN_MASK;
-      /**
-       * arg0: vaddress
-       * arg1: user permission (currently same with readable)
-       * arg2: write permission
-       * arg3: execute permission
-       */
-      return vm_protect(proot, (uintptr_t)arg0, (bool)arg1, (bool)arg2,
-                        (bool)arg3);
-    case SYSCALL_MUNMAP:
-      proot = read_cr3() & PAGE_ALIGN_MASK;
-      /**
-       * arg0: vaddress to be unmapped
-       */
-      return vm_unmap(proot, (uintptr_t)arg0);
-    case SYSCALL_EXEC:
-      /**
-       * arg0: name of the executable to be exec.
-       */
-      return exec_handler((const char*)arg0);
-    case SYSCALL_EXIT:
-      return exit_handler();
-    case SYSCALL_GET_FRAMEBUFFER_INFO:
-      /**
-       * arg0: pointer to the framebuffer_info_t struct.
-       */
-      return get_framebuffer_info_handler((framebuffer_info_t*)arg0);
-    case SYSCALL_FRAMEBUFFER_CPY:
-      /**
-       * arg0: source address.
-       * arg1: x in pixel coordinate of dst buffer. (top-left origin)
-       * arg2: y in pixel coordinate of dst buffer. (top-left origin)
-       * arg3: source's buffer width in pixel.
-       * arg4: source's buffer height in pixel.
-       * arg5: whether we would flip the window.
-       */
-      return framebuffer_cpy_handler((pixel_t*)arg0, (int32_t)arg1,
-                                     (int32_t)arg2, (int32_t)arg3,
-                                     (int32_t)arg4, (bool)arg5);
-    case SYSCALL_PEEK_CHAR:
-      return kpeek_c();
-    case SYSCALL_FRAMEBUFFER_CLEAR:
-      kgraphic_clear_buffer();
-      return true;
-    default:
-      return -1;
+  uint64_t start = read_tsc();
+  acct_enter_kernel();
+  int64_t ret = syscall_dispatch(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+  ksched_enforce_budget();
+  acct_exit_kernel();
+  lat_record_syscall(nr, start);
+  return ret;
+}
+
+/**
+ * Enable the SYSCALL/SYSRET fast path on the current CPU: user programs then
+ * enter the kernel through syscall_fast_entry() instead of interrupt 0x80.
+ * Call after gdt_setup() and sched_init().
+ */
+void syscall_fast_init() {
+  write_msr(MSR_EFER, read_msr(MSR_EFER) | EFER_SCE);
+  // SYSCALL loads CS/SS from STAR[47:32], SYSRET from STAR[63:48] (see gdt.h)
+  write_msr(MSR_STAR, ((uint64_t)(USER_DATA_SELECTOR - 8) << 48) |
+                          ((uint64_t)KERNEL_CODE_SELECTOR << 32));
+  write_msr(MSR_LSTAR, (uintptr_t)syscall_fast_entry);
+  // Enter with interrupts off until the entry is on the kernel stack
+  write_msr(MSR_FMASK, SYSCALL_FMASK);
+  // swapgs in the entry finds this CPU's kernel stack through GS
+  write_msr(MSR_KERNEL_GS_BASE, (uintptr_t)this_cpu());
+}
+
+/**
+ * Dense index of a system call, used to keep per system call statistics.
+ * \param nr System call number.
+ * \returns the index (below NB_SYSCALL), or -1 if nr is not a system call.
+ */
+int32_t syscall_slot(uint64_t nr) {
+  if (nr >= SYSCALL_NR_LIMIT) return -1;
+  return (int32_t)syscall_slot_map[nr] - 1;
+}
+
+/**
+ * System call number of a dense index.
+ * \param slot Index returned by syscall_slot().
+ * \returns the system call number.
+ */
+uint64_t syscall_number(int32_t slot) { return syscall_table[slot].nr; }
+
+/**
+ * Look up the handler of system call nr in the dispatch table and call it. The
+ * call and the TSC ticks it takes are counted in its table entry.
+ */
+int64_t syscall_dispatch(uint64_t nr, uint64_t arg0, uint64_t arg1,
+                         uint64_t arg2, uint64_t arg3, uint64_t arg4,
+                         uint64_t arg5) {
+  int32_t slot = syscall_slot(nr);
+  if (slot < 0) return -1;
+
+  syscall_entry_t* entry = &syscall_table[slot];
+  // Counted before the call since exec and exit do not return
+  __atomic_fetch_add(&entry->count, 1, __ATOMIC_RELAXED);
+  uint64_t start = read_tsc();
+  int64_t ret = entry->fn(arg0, arg1, arg2, arg3, arg4, arg5);
+  __atomic_fetch_add(&entry->cycles, read_tsc() - start, __ATOMIC_RELAXED);
+  return ret;
+}
+
+/**
+ * Copy the counters of every system call into stats.
+ * \param stats Output array.
+ * \param max_stat Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t ksyscallstat(syscall_stat_t* stats, size_t max_stat) {
+  if (stats == NULL) return -1;
+
+  int64_t count = 0;
+  for (int32_t i = 0; i < NB_SYSCALL && (size_t)i < max_stat; i++) {
+    syscall_entry_t* entry = &syscall_table[i];
+    stats[i].nr = entry->nr;
+    size_t len = kstrlen(entry->name);
+    if (len >= SYSCALL_NAME_LEN) len = SYSCALL_NAME_LEN - 1;
+    kmemcpy(stats[i].name, (void*)entry->name, len);
+    stats[i].name[len] = '\0';
+    stats[i].nb_args = entry->nb_args;
+    stats[i].count = __atomic_load_n(&entry->count, __ATOMIC_RELAXED);
+    stats[i].cycles = __atomic_load_n(&entry->cycles, __ATOMIC_RELAXED);
+    count++;
   }
+  return count;
+}
+
+/******************************************************************************/
+// System call entry points: unpack the arguments for the handlers below
+SYSCALL_DEFINE(read) {
+  /**
+   * arg0: file descriptor
+   * arg1: pointer to buffer
+   * arg2: read size
+   * arg3: boolean include newline or not
+   * arg4: boolean echo input char to terminal or not.
+   * arg5: the number of read character so far.
+   */
+  return read_handler(arg0, (char*)arg1, arg2, (bool)arg3, (bool)arg4,
+                      (int64_t)arg5);
+}
+
+SYSCALL_DEFINE(write) {
+  /**
+   * arg0: file descriptor
+   * arg1: pointer to string to be printed
+   * arg2: write size
+   */
+  return write_handler(arg0, (const char*)arg1, arg2);
+}
+
+SYSCALL_DEFINE(mmap) {
+  /**
+   * arg0: vaddress
+   * arg1: user permission (currently same with readable)
+   * arg2: write permission
+   * arg3: execute permission
+   */
+  if (!user_page_owned(arg0)) return false;
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  return vm_map(proot, (uintptr_t)arg0, (bool)arg1, (bool)arg2, (bool)arg3);
+}
+
+SYSCALL_DEFINE(mprotect) {
+  /**
+   * arg0: vaddress
+   * arg1: user permission (currently same with readable)
+   * arg2: write permission
+   * arg3: execute permission
+   */
+  if (!user_page_owned(arg0)) return false;
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  return vm_protect(proot, (uintptr_t)arg0, (bool)arg1, (bool)arg2,
+                    (bool)arg3);
+}
+
+SYSCALL_DEFINE(munmap) {
+  /**
+   * arg0: vaddress to be unmapped
+   */
+  if (!user_page_owned(arg0)) return false;
+  uintptr_t proot = read_cr3() & PAGE_ALIGN_MASK;
+  return vm_unmap(proot, (uintptr_t)arg0);
+}
+
+SYSCALL_DEFINE(nanosleep) {
+  /**
+   * arg0: duration in ns.
+   */
+  return clock_nanosleep_handler(CLOCK_MONOTONIC, 0, arg0);
+}
+
+SYSCALL_DEFINE(getpid) { return task_current()->pid; }
+
+SYSCALL_DEFINE(exec) {
+  /**
+   * arg0: name of the executable to be exec.
+   */
+  return exec_handler((const char*)arg0);
+}
+
+SYSCALL_DEFINE(exit) { return exit_handler(); }
+
+SYSCALL_DEFINE(clock_nanosleep) {
+  /**
+   * arg0: clock id (only CLOCK_MONOTONIC).
+   * arg1: flags (TIMER_ABSTIME for a deadline).
+   * arg2: duration, or deadline in ns since boot.
+   */
+  return clock_nanosleep_handler((int)arg0, (int)arg1, arg2);
+}
+
+SYSCALL_DEFINE(get_framebuffer_info) {
+  /**
+   * arg0: pointer to the framebuffer_info_t struct.
+   */
+  return get_framebuffer_info_handler((framebuffer_info_t*)arg0);
+}
+
+SYSCALL_DEFINE(framebuffer_cpy) {
+  /**
+   * arg0: source address.
+   * arg1: x in pixel coordinate of dst buffer. (top-left origin)
+   * arg2: y in pixel coordinate of dst buffer. (top-left origin)
+   * arg3: source's buffer width in pixel.
+   * arg4: source's buffer height in pixel.
+   * arg5: whether we would flip the window.
+   */
+  return framebuffer_cpy_handler((pixel_t*)arg0, (int32_t)arg1, (int32_t)arg2,
+                                 (int32_t)arg3, (int32_t)arg4, (bool)arg5,
+                                 NULL, 0);
+}
+
+SYSCALL_DEFINE(framebuffer_damage) {
+  /**
+   * arg0: pointer to the window_t to copy from.
+   * arg1: array of damage_rect_t, the regions of the window to copy.
+   * arg2: number of entries in the array.
+   */
+  window_t* window = (window_t*)arg0;
+  if (window == NULL || (const damage_rect_t*)arg1 == NULL) return false;
+  return framebuffer_cpy_handler(window->addr, window->screen_x,
+                                 window->screen_y, window->width,
+                                 window->height, window->flip,
+                                 (const damage_rect_t*)arg1, (int32_t)arg2);
+}
+
+// The handlers drawing on the screen hold the terminal lock, since the
+// terminal draws on it from any CPU
+SYSCALL_DEFINE(surface_attach) {
+  /**
+   * arg0: pointer to the window_t to put on top of the stack.
+   */
+  if (!kgraphic_may_draw(task_current()->pid)) return -1;
+  term_lock();
+  int64_t ret = compositor_attach(task_current()->pid, (window_t*)arg0);
+  term_unlock();
+  return ret;
+}
+
+SYSCALL_DEFINE(surface_detach) {
+  /**
+   * arg0: surface id returned by SYSCALL_SURFACE_ATTACH.
+   */
+  term_lock();
+  int64_t ret = compositor_detach(task_current()->pid, (int32_t)arg0);
+  term_unlock();
+  return ret;
+}
+
+SYSCALL_DEFINE(surface_raise) {
+  /**
+   * arg0: surface id returned by SYSCALL_SURFACE_ATTACH.
+   */
+  if (!kgraphic_may_draw(task_current()->pid)) return false;
+  term_lock();
+  int64_t ret = compositor_raise(task_current()->pid, (int32_t)arg0);
+  term_unlock();
+  return ret;
+}
+
+SYSCALL_DEFINE(surface_commit) {
+  /**
+   * arg0: surface id returned by SYSCALL_SURFACE_ATTACH.
+   * arg1: array of damage_rect_t, the regions of the window that changed (NULL
+   * for the whole window).
+   * arg2: number of entries in the array.
+   */
+  if (!kgraphic_may_draw(task_current()->pid)) return false;
+  term_lock();
+  int64_t ret = compositor_commit(task_current()->pid, (int32_t)arg0,
+                                  (const damage_rect_t*)arg1, (int32_t)arg2);
+  term_unlock();
+  return ret;
+}
+
+SYSCALL_DEFINE(framebuffer_clear) {
+  if (!kgraphic_may_draw(task_current()->pid)) return false;
+  term_lock();
+  kgraphic_clear_buffer();
+  // The attached windows stay on screen
+  if (compositor_active()) compositor_expose(0, 0, INT32_MAX, INT32_MAX);
+  term_unlock();
+  return true;
+}
+
+SYSCALL_DEFINE(map_framebuffer) {
+  // Mapping may flip the page on screen
+  term_lock();
+  int64_t ret = kgraphic_map_user(task_current()->pid);
+  term_unlock();
+  return ret;
+}
+
+SYSCALL_DEFINE(unmap_framebuffer) {
+  return kgraphic_unmap_user(task_current()->pid);
+}
+
+SYSCALL_DEFINE(present) {
+  if (!kgraphic_may_draw(task_current()->pid)) return -1;
+  term_lock();
+  int64_t ret = kgraphic_present();
+  term_unlock();
+  return ret;
+}
+
+SYSCALL_DEFINE(flip) {
+  if (!kgraphic_may_draw(task_current()->pid)) return -1;
+  term_lock();
+  int64_t ret = kgraphic_flip();
+  term_unlock();
+  return ret;
+}
+
+SYSCALL_DEFINE(peek_char) { return kpeek_c(); }
+
+SYSCALL_DEFINE(sched_setaffinity) {
+  /**
+   * arg0: pid of the task (0 for the calling task).
+   * arg1: mask of allowed CPUs.
+   */
+  return sched_setaffinity_handler((int64_t)arg0, (cpu_mask_t)arg1);
+}
+
+SYSCALL_DEFINE(sched_getaffinity) {
+  /**
+   * arg0: pid of the task (0 for the calling task).
+   */
+  return ksched_getaffinity((int64_t)arg0);
+}
+
+SYSCALL_DEFINE(sched_stat) {
+  /**
+   * arg0: pointer to an array of runqueue_stat_t.
+   * arg1: number of entries in the array.
+   */
+  return ksched_get_stat((runqueue_stat_t*)arg0, (size_t)arg1);
+}
+
+SYSCALL_DEFINE(sched_setdeadline) {
+  /**
+   * arg0: pid of the task (0 for the calling task).
+   * arg1: period in nanoseconds.
+   * arg2: budget per period in nanoseconds.
+   */
+  return ksched_setdeadline((int64_t)arg0, arg1, arg2);
+}
+
+SYSCALL_DEFINE(sched_wait_period) { return ksched_wait_period(); }
+
+SYSCALL_DEFINE(procstat) {
+  /**
+   * arg0: pointer to an array of proc_stat_t.
+   * arg1: number of entries in the array.
+   */
+  return ksched_procstat((proc_stat_t*)arg0, (size_t)arg1);
+}
+
+SYSCALL_DEFINE(latstat) {
+  /**
+   * arg0: pointer to an array of lat_stat_t.
+   * arg1: number of entries in the array.
+   */
+  return klatstat((lat_stat_t*)arg0, (size_t)arg1);
+}
+
+SYSCALL_DEFINE(syscallstat) {
+  /**
+   * arg0: pointer to an array of syscall_stat_t.
+   * arg1: number of entries in the array.
+   */
+  return ksyscallstat((syscall_stat_t*)arg0, (size_t)arg1);
+}
+
+SYSCALL_DEFINE(ring_enter) {
+  /**
+   * arg0: pointer to the syscall_ring_t.
+   * arg1: number of entries to run.
+   */
+  return ring_enter_handler((syscall_ring_t*)arg0, (uint32_t)arg1);
 }
 
 /******************************************************************************/
 // Syscall handlers: functions to process system calls
+/**
+ * Whether a process may map, protect or unmap a page itself. Pages the kernel
+ * shares with every process (the time page, the keyboard ring and the
+ * framebuffer) are off limits.
+ * \param vaddress The virtual address.
+ * \returns true if the page belongs to the process, else returns false.
+ */
+bool user_page_owned(uintptr_t vaddress) {
+  uintptr_t page = vaddress & PAGE_ALIGN_MASK;
+  if (page >= USER_SCANOUT && page < USER_SCANOUT_END) return false;
+  return page != USER_VDSO && page != USER_KEYBOARD;
+}
+
+/**
+ * Echo a character read from the keyboard in the input color.
+ * \param c The character.
+ */
+void read_echo(char c) {
+  term_lock();
+  term_set_color(ARGB32_LIGHT_GREEN, ARGB32_BLACK);
+  term_puts(&c, 1);
+  term_reset_color();
+  term_unlock();
+}
+
 /**
  * Handlers for read system call. Return the number of read characters
  * (excluding the null-terminate AND backspace). The function is not responsible
@@ -133,9 +460,6 @@ int64_t read_handler(uint64_t f_descriptor, char* buff, size_t read_size,
   if (f_descriptor != STD_IN || buff == NULL) {
     return -1;
   } else {
-    // Set input text color
-    term_set_color(ARGB32_LIGHT_GREEN, ARGB32_BLACK);
-
     // Count the number of read characters so far.
     // This variable is also used as the index for the next available slot for
     // new character to be read.
@@ -147,7 +471,7 @@ int64_t read_handler(uint64_t f_descriptor, char* buff, size_t read_size,
         // Add newline to buffer
         if (incl_newln) buff[read_char_counter++] = c;
         // Print newline character and exit loop
-        if (echo_char) term_putchar(c);
+        if (echo_char) read_echo(c);
         break;
       }
 
@@ -157,16 +481,14 @@ int64_t read_handler(uint64_t f_descriptor, char* buff, size_t read_size,
         if (read_char_counter > 0) {
           read_char_counter = read_char_counter - 1;
           buff[read_char_counter] = '\0';
-          if (echo_char) term_putchar(c);
+          if (echo_char) read_echo(c);
         }
       } else {
         // Put the valid character into the buffer
         buff[read_char_counter++] = c;
-        if (echo_char) term_putchar(c);
+        if (echo_char) read_echo(c);
       }
     }
-    // Reset the color setting
-    term_reset_color();
     // If we finished reading return the number of read characters
     return read_char_counter;
   }
@@ -194,21 +516,16 @@ int64_t write_handler(uint64_t f_descriptor, const char* str,
   // Set terminal color based on
   color_t fg = (f_descriptor == STD_ERR) ? ARGB32_RED : ARGB32_WHITE;
   color_t bg = ARGB32_BLACK;
+  term_lock();
   term_set_color(fg, bg);
 
-  // Repeat printing characters one by one. If we print null terminate, we
-  int i = 0;
-  while (i < write_size) {
-    if (str[i] != '\0') {
-      term_putchar(str[i]);
-      i++;
-    } else {
-      term_reset_color();
-      return i;
-    }
-  }
+  // Lay out the characters up to the first null terminate in the text grid,
+  // then draw the rows they changed in one pass
+  int64_t nb_written = term_write_buf(str, write_size);
   term_reset_color();
-  return i;
+  term_flush();
+  term_unlock();
+  return nb_written;
 }
 
 /******************************************************************************/
@@ -224,10 +541,83 @@ bool exec_handler(const char* exe_name) { return run_exe(exe_name); }
  * \returns true if the function is executed successfully, else return falses.
  */
 bool exit_handler() {
+  // Programs that poll the event ring leave their keys in the character
+  // buffer; do not hand them to the shell
+  cq_init(&keyboard.buffer);
   term_init();
   return run_exe("shell");
 }
 
+/**
+ * Handler for the nanosleep system calls. The caller is blocked on a kernel
+ * timer.
+ * \param clock_id The clock, only CLOCK_MONOTONIC is supported.
+ * \param flags 0 or TIMER_ABSTIME.
+ * \param ns Duration, or deadline in ns since boot with TIMER_ABSTIME.
+ * \returns 0 on success, or -1 if the clock is not supported.
+ */
+int64_t clock_nanosleep_handler(int clock_id, int flags, uint64_t ns) {
+  if (clock_id != CLOCK_MONOTONIC) return -1;
+  if (flags & TIMER_ABSTIME) return ksched_sleep_until(ns);
+
+  uint64_t now = ktime_ns();
+  return ksched_sleep_until(ns > UINT64_MAX - now ? UINT64_MAX : now + ns);
+}
+
+/**
+ * Handler for the ring_enter system call. Runs the queued entries of a
+ * submission ring in order, through the same dispatch table as syscall(), and
+ * writes one completion per entry. Entries that would not return here (exec,
+ * exit) and nested ring_enter complete with -1. Stops early when the
+ * completion queue is full.
+ * \param ring The ring, in the caller's memory.
+ * \param to_submit Maximum number of entries to run.
+ * \returns the number of entries run, or -1 on error.
+ */
+int64_t ring_enter_handler(syscall_ring_t* ring, uint32_t to_submit) {
+  if (ring == NULL) return -1;
+
+  uint32_t head = ring->sq_head;
+  uint32_t tail = ring->sq_tail;
+  if (tail - head > RING_SIZE) return -1;
+
+  int64_t nb_run = 0;
+  while (head != tail && (uint32_t)nb_run < to_submit) {
+    uint32_t cq_tail = ring->cq_tail;
+    if (cq_tail - ring->cq_head >= RING_SIZE) break;
+
+    // Copy the entry so the program cannot change it while it runs
+    ring_sqe_t sqe = ring->sqes[head & RING_MASK];
+    int64_t res = -1;
+    if (sqe.nr != SYSCALL_EXEC && sqe.nr != SYSCALL_EXIT &&
+        sqe.nr != SYSCALL_RING_ENTER) {
+      res = syscall_dispatch(sqe.nr, sqe.args[0], sqe.args[1], sqe.args[2],
+                             sqe.args[3], sqe.args[4], sqe.args[5]);
+    }
+
+    ring_cqe_t* cqe = &ring->cqes[cq_tail & RING_MASK];
+    cqe->user_data = sqe.user_data;
+    cqe->res = res;
+    ring->cq_tail = cq_tail + 1;
+    ring->sq_head = ++head;
+    nb_run++;
+  }
+  return nb_run;
+}
+
+/**
+ * Handler to change the CPU affinity of a task. If the calling task is no
+ * longer allowed on this CPU, it is migrated before returning to user mode.
+ * \param pid Pid of the task. 0 means the calling task.
+ * \param mask Allowed CPUs.
+ * \returns true if the affinity is changed, else returns false.
+ */
+bool sched_setaffinity_handler(int64_t pid, cpu_mask_t mask) {
+  if (!ksched_setaffinity(pid, mask)) return false;
+  if (this_cpu()->need_resched) schedule();
+  return true;
+}
+
 /******************************************************************************/
 /**
  * Handler to handler query kernel's framebuffer information. The information is
@@ -270,83 +660,51 @@ bool get_framebuffer_info_handler(framebuffer_info_t* fb_info) {
  * \param src_w The width of the source buffer.
  * \param src_h The height of the source buffer.
  * \param flip Boolean whether we flip the source buffer.
+ * \param rects Regions of the source buffer to copy (in source rows, before
+ * the flip), or NULL to copy all of it.
+ * \param nb_rect Number of entries in rects.
  * \returns true if copy successfully and false otherwise.
  */
 bool framebuffer_cpy_handler(pixel_t* src, int32_t dst_x, int32_t dst_y,
-                             int32_t src_w, int32_t src_h, bool flip) {
+                             int32_t src_w, int32_t src_h, bool flip,
+                             const damage_rect_t* rects, int32_t nb_rect) {
   // Check if the buffer is available
-  if (framebuffer_struct_tag == NULL) return false;
-
-  // Check for out of bound, in this case we do not need to print
-  int32_t dst_x_end = dst_x + src_w;
-  int32_t dst_y_end = dst_y + src_h;
-  if (dst_x >= screen_w || dst_y >= screen_h || dst_x_end <= 0 ||
-      dst_y_end <= 0)
-    return true;
-
-  // Compute the offset in x and y direction in src buffer:
-  int32_t src_x = 0;
-  int32_t src_y = 0;
-  int32_t src_x_end = src_w;
-  int32_t src_y_end = src_h;
-
-  // If printing destination starts out of left edge ...
-  if (dst_x < 0) {
-    src_x = -dst_x;
-    dst_x = 0;
+  if (framebuffer_struct_tag == NULL || src == NULL || buffer_addr == 0) {
+    return false;
   }
+  if (!kgraphic_may_draw(task_current()->pid)) return false;
 
-  // If printing destination starts out of top edge ...
-  if (dst_y < 0) {
-    src_y = -dst_y;
-    dst_y = 0;
+  damage_rect_t whole = {0, 0, src_w, src_h};
+  if (rects == NULL) {
+    rects = &whole;
+    nb_rect = 1;
   }
 
-  // If printing destination ends out of right edge ...
-  if (dst_x_end > screen_w) {
-    src_x_end = src_w - (dst_x_end - screen_w);
-    dst_x_end = screen_w;
-  }
-
-  // If printing destination ends out of bottom edge ...
-  if (dst_y_end > screen_h) {
-    src_y_end = src_h - (dst_y_end - screen_h);
-    dst_y_end = screen_h;
-  }
+  pixel_t* dst = (pixel_t*)buffer_addr;
+  term_lock();
+  for (int32_t i = 0; i < nb_rect; i++) {
+    // Clip the region to the source buffer, then its columns to the screen
+    int32_t x0 = max(max(rects[i].x0, 0), -dst_x);
+    int32_t x1 = min(min(rects[i].x1, src_w), screen_w - dst_x);
+    int32_t y0 = max(rects[i].y0, 0);
+    int32_t y1 = min(rects[i].y1, src_h);
+    if (x0 >= x1 || y0 >= y1) continue;
 
-  // Check if offset in source is still within bound
-  if (src_x >= src_w || src_y >= src_h || src_x_end <= 0 || src_y_end <= 0)
-    return true;
-
-  // Paint the source buffer depend on whether you would flip it
-  if (flip) {
-    src_y = src_h - src_y;
-    src_y_end = src_h - src_y_end;
-
-    // Compute memory addressess for source and destination
-    src += src_w * src_y + src_x;  // the start of first printed line in src
-    pixel_t* dst = (pixel_t*)buffer_addr;
-    dst += screen_w * dst_y + dst_x;  // the start of first printed line in dst
-    size_t copied_row_byte_size = (src_x_end - src_x) * sizeof(pixel_t);
-
-    for (int i = src_y_end; i < src_y; i++) {
-      kmemcpy(dst, src, copied_row_byte_size);
-      src -= src_w;
-      dst += screen_w;
-    }
-  } else {
-    // Compute memory addressess for source and destination
-    src += src_w * src_y + src_x;  // the start of first printed line in src
-    pixel_t* dst = (pixel_t*)buffer_addr;
-    dst += screen_w * dst_y + dst_x;  // the start of first printed line in dst
-    size_t copied_row_byte_size = (src_x_end - src_x) * sizeof(pixel_t);
-
-    for (int i = src_y; i < src_y_end; i++) {
-      kmemcpy(dst, src, copied_row_byte_size);
-      src += src_w;
-      dst += screen_w;
+    // Row r of the source lands on row dst_y + r, or dst_y + src_h - 1 - r
+    // when flipped. Rows off the screen are skipped.
+    size_t copied_row_byte_size = (x1 - x0) * sizeof(pixel_t);
+    int32_t screen_y0 = screen_h;
+    int32_t screen_y1 = 0;
+    for (int32_t r = y0; r < y1; r++) {
+      int32_t y = flip ? dst_y + src_h - 1 - r : dst_y + r;
+      if (y < 0 || y >= screen_h) continue;
+      kmemcpy(dst + y * buffer_stride + dst_x + x0, src + r * src_w + x0,
+              copied_row_byte_size);
+      if (y < screen_y0) screen_y0 = y;
+      if (y >= screen_y1) screen_y1 = y + 1;
     }
+    kgraphic_mark_dirty(dst_x + x0, screen_y0, x1 - x0, screen_y1 - screen_y0);
   }
-
+  term_unlock();
   return true;
-}
\ No newline at end of file
+}
@@ -5,26 +5,120 @@
  */
 #include "term.h"
 
+#include "ksched.h"
+
 // Defined in psf.c
 extern int32_t psf_font_w;
 extern int32_t psf_font_h;
 extern int32_t term_h;
 extern int32_t term_w;
 
-// Defined in kgraphic.c
-extern int32_t screen_h;
-extern int32_t screen_w;
-extern uintptr_t buffer_addr;
-
 // Struct to hold the current state of the terminal
 terminal_t term;
 
+// Serializes the terminal and the screen it draws on between CPUs. The CPU
+// holding it may take it again, e.g. kprintf() for each piece of a message.
+spinlock_t term_spinlock = SPINLOCK_INIT;
+int32_t term_owner = -1;
+int32_t term_depth = 0;
+
+/******************************************************************************/
+// Helper functions
+// Grid row shown on screen row r
+int32_t term_grid_row(int32_t r) { return (term.head + r) % term_h; }
+
+// Mark columns [x0, x1) of grid row r as changed
+void term_mark_dirty(int32_t r, int32_t x0, int32_t x1) {
+  if (x0 < term.dirty_x0[r]) term.dirty_x0[r] = x0;
+  if (x1 > term.dirty_x1[r]) term.dirty_x1[r] = x1;
+}
+
+// Fill grid row r with blanks of the given background
+void term_blank_row(int32_t r, color_t bg) {
+  for (int32_t col = 0; col < term_w; col++) {
+    term.cells[r][col] = (term_cell_t){' ', ARGB32_WHITE, bg};
+  }
+}
+
+// Store character c at the cursor
+void term_put_cell(char c) {
+  int32_t r = term_grid_row(term.row);
+  term.cells[r][term.col] = (term_cell_t){c, term.fg, term.bg};
+  term_mark_dirty(r, term.col, term.col + 1);
+}
+
+// Draw columns [x0, x1) of screen row r, one psf_put_chars() per run of cells
+// in the same colors
+void term_draw_row(int32_t r, int32_t x0, int32_t x1) {
+  term_cell_t* cells = term.cells[term_grid_row(r)];
+  char run[TERM_MAX_COLS];
+  int32_t col = x0;
+  while (col < x1) {
+    int32_t start = col;
+    color_t fg = cells[col].fg;
+    color_t bg = cells[col].bg;
+    while (col < x1 && cells[col].fg == fg && cells[col].bg == bg) {
+      run[col - start] = cells[col].c;
+      col++;
+    }
+    psf_put_chars(run, col - start, r * psf_font_h, start * psf_font_w, fg, bg);
+  }
+}
+
+// Move the cursor to the start of the next line, scrolling if needed: the top
+// grid row becomes the new bottom line, blank. Every row moved on screen, so
+// the next flush draws them all.
+void term_newline() {
+  term.col = 0;
+  term.row++;
+  if (term.row == term_h) {
+    // Set cursor to the start of the bottom line
+    term.row--;
+    term_blank_row(term.head, ARGB32_BLACK);
+    term.head = (term.head + 1) % term_h;
+    term.redraw = true;
+  }
+}
+
+// Whether c moves the cursor rather than being printed
+bool term_is_control(char c) {
+  return c == '\r' || c == '\n' || c == '\f' || c == '\b' || c == '\0';
+}
+
 /******************************************************************************/
+// Take the terminal lock, which serializes the terminal and the screen it draws
+// on between CPUs. The CPU holding it may take it again, so an interrupt
+// handler that prints does not deadlock. Interrupts stay enabled while it is
+// held; they are only disabled while the owner is updated.
+void term_lock() {
+  uint64_t flags = irq_save();
+  int32_t cpu = cpu_current_id();
+  if (__atomic_load_n(&term_owner, __ATOMIC_RELAXED) != cpu) {
+    spin_lock(&term_spinlock);
+    term_owner = cpu;
+  }
+  term_depth++;
+  irq_restore(flags);
+}
+
+// Release the terminal lock taken with term_lock()
+void term_unlock() {
+  uint64_t flags = irq_save();
+  if (--term_depth == 0) {
+    __atomic_store_n(&term_owner, -1, __ATOMIC_RELAXED);
+    spin_unlock(&term_spinlock);
+  }
+  irq_restore(flags);
+}
+
 // Initialize the terminal
 void term_init() {
+  term_lock();
   // Init terminal's state values and clear buffer
   term_reset();
   term_clear();
+  kgraphic_present();
+  term_unlock();
 }
 
 // Reset the color of the terminal to white and black
@@ -46,74 +140,115 @@ void term_reset() {
   term.fg = ARGB32_WHITE;
   term.bg = ARGB32_BLACK;
   term.enable_cursor = true;
-  // Number of byte in frame buffer buffer for each row of the terminal
-  term.byte_per_row = screen_w * psf_font_h * sizeof(pixel_t);
+  // The grid is as large as the screen allows, up to the cells we keep
+  if (term_w > TERM_MAX_COLS) term_w = TERM_MAX_COLS;
+  if (term_h > TERM_MAX_ROWS) term_h = TERM_MAX_ROWS;
 }
 
 // Clear the terminal
 void term_clear() {
-  // Clear the framebuffer
+  // Clear the framebuffer; the blank grid then matches it
   kgraphic_clear_buffer();
-}
-
-// Draw psf glyph of character c to the terminal
-bool term_put_psf_char(char c) {
-  return psf_put_char(c, term.row * psf_font_h, term.col * psf_font_w, term.fg,
-                      term.bg);
+  term.head = 0;
+  term.redraw = false;
+  for (int32_t r = 0; r < term_h; r++) {
+    term_blank_row(r, ARGB32_BLACK);
+    term.dirty_x0[r] = term_w;
+    term.dirty_x1[r] = 0;
+  }
 }
 
 // Write one character to the terminal
 void term_putchar(char c) {
+  // No grid without a screen
+  if (term_h == 0) return;
+
   // Handle characters that do not consume extra space (no scrolling necessary)
   if (c == '\r') {
     term.col = 0;
     return;
+  } else if (c == '\f') {
+    // Form feed clears the screen, e.g. for programs that redraw a full page
+    term.row = 0;
+    term.col = 0;
+    term_clear();
+    return;
   } else if (c == '\b') {
     if (term.col > 0) {
       term.col--;
-      term_put_psf_char(' ');
+      term_put_cell(' ');
     } else if (term.row > 0) {
       term.row--;
       term.col = term_w - 1;
-      term_put_psf_char(' ');
+      term_put_cell(' ');
     }
     return;
   }
 
   // Handle newline
   if (c == '\n') {
-    term.col = 0;
-    term.row++;
-  } else {
-    term_put_psf_char(c);
-    term.col++;
+    term_newline();
+    return;
   }
+  term_put_cell(c);
+  term.col++;
 
   // Make sure the cursor is in the writable location
   // Wrap if needed
-  if (term.col == term_w) {
-    term.col = 0;
-    term.row++;
-  }
+  if (term.col == term_w) term_newline();
+}
 
-  // Scroll if needed
-  if (term.row == term_h) {
-    // Shift characters up a row
-    uintptr_t src = buffer_addr + term.byte_per_row;
-    size_t copy_size = term.byte_per_row * (term_h - 1);
-    kmemcpy((void*)buffer_addr, (void*)src, copy_size);
-    // Set cursor to the start of the bottom line
-    term.row--;
+// Write string to the terminal
+void term_puts(const char* s, size_t size) {
+  term_lock();
+  term_write_buf(s, size);
+  term_flush();
+  term_unlock();
+}
+
+// Lay out a buffer in the grid, up to its first null character. Printable
+// characters are stored a run at a time, each run up to the next control
+// character or the end of the row; nothing is drawn until term_flush(). Returns
+// the number of characters written.
+size_t term_write_buf(const char* s, size_t size) {
+  if (term_h == 0) return 0;
 
-    // Clear the last row
-    uintptr_t last_row = buffer_addr + copy_size;
-    kmemset((void*)last_row, 0, term.byte_per_row);
+  size_t i = 0;
+  while (i < size && s[i] != '\0') {
+    if (term_is_control(s[i])) {
+      term_putchar(s[i++]);
+      continue;
+    }
+
+    // The run ends at a control character or at the right edge
+    int32_t r = term_grid_row(term.row);
+    term_cell_t* cell = &term.cells[r][term.col];
+    int32_t start = term.col;
+    while (i < size && term.col < term_w && !term_is_control(s[i])) {
+      *cell++ = (term_cell_t){s[i++], term.fg, term.bg};
+      term.col++;
+    }
+    term_mark_dirty(r, start, term.col);
+    if (term.col == term_w) term_newline();
   }
+  return i;
 }
 
-// Write string to the terminal
-void term_puts(const char* s, size_t size) {
-  for (int i = 0; i < size; i++) {
-    term_putchar(s[i]);
+// Draw the characters that changed since the last call and show them
+void term_flush() {
+  for (int32_t r = 0; r < term_h; r++) {
+    int32_t grid_row = term_grid_row(r);
+    if (term.redraw) {
+      term_draw_row(r, 0, term_w);
+    } else if (term.dirty_x0[grid_row] < term.dirty_x1[grid_row]) {
+      term_draw_row(r, term.dirty_x0[grid_row], term.dirty_x1[grid_row]);
+    }
+    term.dirty_x0[grid_row] = term_w;
+    term.dirty_x1[grid_row] = 0;
   }
+  term.redraw = false;
+  kgraphic_present();
 }
+
+// Draw every character again on the next term_flush()
+void term_redraw() { term.redraw = true; }
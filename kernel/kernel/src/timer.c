@@ -0,0 +1,368 @@
+#include "timer.h"
+
+// Clock event device and the time it is programmed for (UINT64_MAX if none)
+clockevent_mode_t ce_mode = CLOCKEVENT_NONE;
+uint64_t ce_programmed = UINT64_MAX;
+uint64_t lapic_timer_khz = 0;
+
+// Hierarchical timer wheel. wheel_clk is the current level 0 slot, in units
+// of 2^TIMER_WHEEL_SHIFT ns; slots behind it have been processed.
+ktimer_t* wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+uint64_t wheel_clk = 0;
+spinlock_t wheel_lock = SPINLOCK_INIT;
+
+// Defined in apic.c
+extern uint32_t boot_lapic_id;
+
+const char* clockevent_names[] = {"none", "TSC-deadline", "LAPIC one-shot",
+                                  "PIT"};
+
+/******************************************************************************/
+// Helper functions
+// Number of wheel units spanned by one slot of a level
+static inline uint64_t level_span(int32_t level) {
+  return 1ULL << (TIMER_WHEEL_BITS * level);
+}
+
+/**
+ * Put a timer in the slot matching its expiry. Expired timers go into the
+ * current slot. Timers beyond the range of the wheel wait in the last level
+ * and are placed again when that slot cascades.
+ * \param timer The timer, which must not be pending.
+ */
+void wheel_insert(ktimer_t* timer) {
+  uint64_t unit = timer->expires >> TIMER_WHEEL_SHIFT;
+  if (unit < wheel_clk) unit = wheel_clk;
+  uint64_t delta = unit - wheel_clk;
+
+  int32_t level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= level_span(level + 1)) {
+    level++;
+  }
+  if (delta >= level_span(TIMER_WHEEL_LEVELS)) {
+    unit = wheel_clk + level_span(TIMER_WHEEL_LEVELS) - 1;
+  }
+
+  ktimer_t** slot =
+      &wheel[level][(unit >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = *slot;
+  if (*slot != NULL) (*slot)->prev = timer;
+  *slot = timer;
+}
+
+/**
+ * Take a pending timer out of its slot.
+ * \param timer The timer.
+ */
+void wheel_remove(ktimer_t* timer) {
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    *timer->slot = timer->next;
+  }
+  if (timer->next != NULL) timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->slot = NULL;
+}
+
+/**
+ * Move the timers of the current slot of a level down to the finer levels.
+ * Called when wheel_clk reaches the start of that slot.
+ * \param level Level to cascade (>= 1).
+ */
+void wheel_cascade(int32_t level) {
+  uint64_t index = (wheel_clk >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  ktimer_t* timer = wheel[level][index];
+  wheel[level][index] = NULL;
+  while (timer != NULL) {
+    ktimer_t* next = timer->next;
+    wheel_insert(timer);
+    timer = next;
+  }
+}
+
+/**
+ * Next wheel unit after wheel_clk where something happens: a non-empty level
+ * 0 slot comes due or a non-empty slot of a coarser level cascades.
+ * \param first_expiry Set to the earliest expiry in ns of that event.
+ * \returns the unit, or UINT64_MAX if the wheel is empty.
+ */
+uint64_t wheel_next_unit(uint64_t* first_expiry) {
+  uint64_t next = UINT64_MAX;
+  *first_expiry = UINT64_MAX;
+
+  // A level 0 slot holds timers of a single unit: use their exact expiry
+  for (uint64_t i = 1; i < TIMER_WHEEL_SLOTS; i++) {
+    ktimer_t* timer = wheel[0][(wheel_clk + i) & TIMER_WHEEL_MASK];
+    if (timer == NULL) continue;
+    next = wheel_clk + i;
+    for (; timer != NULL; timer = timer->next) {
+      if (timer->expires < *first_expiry) *first_expiry = timer->expires;
+    }
+    break;
+  }
+
+  // Coarser slots are looked at again when they cascade
+  for (int32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t base = wheel_clk >> (TIMER_WHEEL_BITS * level);
+    for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+      if (wheel[level][(base + i) & TIMER_WHEEL_MASK] == NULL) continue;
+      uint64_t unit = (base + i) << (TIMER_WHEEL_BITS * level);
+      if (unit < next) {
+        next = unit;
+        *first_expiry = unit << TIMER_WHEEL_SHIFT;
+      }
+      break;
+    }
+  }
+  return next;
+}
+
+/**
+ * Earliest time the wheel needs the CPU: the expiry of the first timer in the
+ * current or next level 0 slot, or the next cascade.
+ * \returns the time in ns, or UINT64_MAX if no timer is pending.
+ */
+uint64_t wheel_next_expiry() {
+  uint64_t expiry;
+  wheel_next_unit(&expiry);
+  for (ktimer_t* timer = wheel[0][wheel_clk & TIMER_WHEEL_MASK]; timer != NULL;
+       timer = timer->next) {
+    if (timer->expires < expiry) expiry = timer->expires;
+  }
+  return expiry;
+}
+
+/**
+ * Advance the wheel to now and unlink every expired timer.
+ * \param now Current time in ns.
+ * \returns the list of expired timers, linked through next.
+ */
+ktimer_t* wheel_advance(uint64_t now) {
+  uint64_t now_unit = now >> TIMER_WHEEL_SHIFT;
+  ktimer_t* expired = NULL;
+
+  while (true) {
+    ktimer_t* timer = wheel[0][wheel_clk & TIMER_WHEEL_MASK];
+    while (timer != NULL) {
+      ktimer_t* next = timer->next;
+      if (timer->expires <= now) {
+        wheel_remove(timer);
+        timer->next = expired;
+        expired = timer;
+      }
+      timer = next;
+    }
+    if (wheel_clk >= now_unit) break;
+
+    // Skip the units where nothing happens, then cascade every level whose
+    // slot starts here
+    uint64_t expiry;
+    uint64_t next = wheel_next_unit(&expiry);
+    wheel_clk = next < now_unit ? next : now_unit;
+    for (int32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if ((wheel_clk & (level_span(level) - 1)) == 0) wheel_cascade(level);
+    }
+  }
+  return expired;
+}
+
+/**
+ * Raise the timer interrupt at a given time.
+ * \param expiry Time in ns since boot, or UINT64_MAX to stop the device.
+ */
+void clockevent_program(uint64_t expiry) {
+  ce_programmed = expiry;
+  uint64_t now = ktime_ns();
+  uint64_t delta = expiry > now ? expiry - now : 0;
+  // Longer delays do not fit the counters anyway; the interrupt comes early
+  // and the device is programmed again
+  if (delta > TIMER_MAX_DELAY_NS) delta = TIMER_MAX_DELAY_NS;
+
+  switch (ce_mode) {
+    case CLOCKEVENT_TSC_DEADLINE:
+      // Writing 0 disarms; a deadline in the past fires right away
+      write_msr(MSR_TSC_DEADLINE,
+                expiry == UINT64_MAX ? 0 : ktime_to_tsc(expiry));
+      break;
+    case CLOCKEVENT_LAPIC_ONESHOT: {
+      uint64_t ticks = 0;
+      if (expiry != UINT64_MAX) {
+        ticks = delta * lapic_timer_khz / NS_PER_MS;
+        if (ticks == 0) ticks = 1;
+        if (ticks > UINT32_MAX) ticks = UINT32_MAX;
+      }
+      lapic_write(LAPIC_TIMER_INIT, (uint32_t)ticks);
+      break;
+    }
+    case CLOCKEVENT_PIT: {
+      // The PIT cannot be stopped; a stray interrupt finds nothing to do
+      if (expiry == UINT64_MAX) break;
+      uint64_t ticks = delta * PIT_FREQ_HZ / NS_PER_SEC;
+      if (ticks == 0) ticks = 1;
+      if (ticks > 0xFFFF) ticks = 0xFFFF;
+      // Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count)
+      outb(PIT_COMMAND, 0x30);
+      outb(PIT_CHANNEL0, ticks & 0xFF);
+      outb(PIT_CHANNEL0, ticks >> 8);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/**
+ * Measure the LAPIC timer frequency against the TSC.
+ * \returns the frequency in kHz, or 0 if the timer does not count.
+ */
+uint64_t lapic_timer_calibrate() {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+  lapic_write(LAPIC_TIMER_INIT, UINT32_MAX);
+
+  uint64_t end = read_tsc() + ns_to_tsc(LAPIC_CALIBRATE_NS);
+  while (read_tsc() < end) {
+    __asm__ volatile("pause");
+  }
+  uint32_t elapsed = UINT32_MAX - lapic_read(LAPIC_TIMER_CUR);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+  return (uint64_t)elapsed * NS_PER_MS / LAPIC_CALIBRATE_NS;
+}
+
+/******************************************************************************/
+/**
+ * Pick the best clock event device (TSC-deadline, then LAPIC one-shot, then
+ * the PIT). The handlers of TIMER_VECTOR and IRQ0 are installed by
+ * idt_setup(). Call after ktime_init() and apic_init().
+ * \returns true if a device can raise timer interrupts, else returns false.
+ */
+bool timer_init() {
+  wheel_clk = ktime_ns() >> TIMER_WHEEL_SHIFT;
+
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  if (apic_enabled() && (ecx & (1 << 24))) {
+    ce_mode = CLOCKEVENT_TSC_DEADLINE;
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | TIMER_VECTOR);
+  } else if (apic_enabled() && (lapic_timer_khz = lapic_timer_calibrate())) {
+    ce_mode = CLOCKEVENT_LAPIC_ONESHOT;
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+  } else {
+    ce_mode = CLOCKEVENT_PIT;
+    irq_unmask(0);
+  }
+
+  kprintf("[INFO] timer_init: using %s\n", clockevent_name());
+  return true;
+}
+
+/**
+ * Whether timer interrupts are available. Without them ktimer_t never fires.
+ */
+bool timer_enabled() { return ce_mode != CLOCKEVENT_NONE; }
+
+/**
+ * Name of the clock event device in use.
+ */
+const char* clockevent_name() { return clockevent_names[ce_mode]; }
+
+/**
+ * Expire the due timers and program the next interrupt. Called by the timer
+ * interrupt handler.
+ */
+void timer_interrupt() {
+  spin_lock(&wheel_lock);
+  ktimer_t* expired = wheel_advance(ktime_ns());
+  clockevent_program(wheel_next_expiry());
+  spin_unlock(&wheel_lock);
+
+  // Acknowledge before running the callbacks, which may arm the next timer
+  if (ce_mode == CLOCKEVENT_PIT) {
+    irq_eoi(0);
+  } else {
+    lapic_eoi();
+  }
+
+  while (expired != NULL) {
+    ktimer_t* timer = expired;
+    expired = timer->next;
+    timer->next = NULL;
+    timer->fn(timer, timer->arg);
+  }
+}
+
+/******************************************************************************/
+/**
+ * Prepare a timer. It is not pending until armed.
+ * \param timer The timer.
+ * \param fn Function called when the timer expires.
+ * \param arg Argument passed to fn.
+ */
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* arg) {
+  timer->expires = 0;
+  timer->fn = fn;
+  timer->arg = arg;
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->slot = NULL;
+}
+
+/**
+ * Arm a timer, or move it if it is already pending. fn may re-arm its own
+ * timer.
+ * \param timer The timer.
+ * \param expires Absolute expiry in ns since boot. A time in the past fires
+ * on the next timer interrupt, which is raised right away.
+ */
+void ktimer_arm(ktimer_t* timer, uint64_t expires) {
+  uint64_t flags = irq_save();
+  spin_lock(&wheel_lock);
+  if (timer->slot != NULL) wheel_remove(timer);
+  timer->expires = expires;
+  wheel_insert(timer);
+  if (expires < ce_programmed) {
+    if (apic_enabled() && lapic_id() != boot_lapic_id) {
+      // The device interrupts the boot CPU, whose handler programs it again
+      lapic_send_ipi(boot_lapic_id, TIMER_VECTOR);
+    } else {
+      clockevent_program(expires);
+    }
+  }
+  spin_unlock(&wheel_lock);
+  irq_restore(flags);
+}
+
+/**
+ * Arm a timer relative to now.
+ * \param timer The timer.
+ * \param delay_ns Delay in ns.
+ */
+void ktimer_arm_after(ktimer_t* timer, uint64_t delay_ns) {
+  ktimer_arm(timer, ktime_ns() + delay_ns);
+}
+
+/**
+ * Disarm a timer.
+ * \param timer The timer.
+ * \returns true if the timer was pending, else returns false.
+ */
+bool ktimer_cancel(ktimer_t* timer) {
+  uint64_t flags = irq_save();
+  spin_lock(&wheel_lock);
+  bool pending = timer->slot != NULL;
+  // The device stays programmed: an early interrupt just finds nothing due
+  if (pending) wheel_remove(timer);
+  spin_unlock(&wheel_lock);
+  irq_restore(flags);
+  return pending;
+}
+
+/**
+ * Whether a timer is armed and has not fired yet.
+ * \param timer The timer.
+ */
+bool ktimer_pending(ktimer_t* timer) { return timer->slot != NULL; }
@@ -0,0 +1,83 @@
+#include "vbe.h"
+
+// Height of a page, 0 until vbe_init() succeeds
+int32_t vbe_page_h = 0;
+// The index and data ports are one register access together
+spinlock_t vbe_lock;
+
+/******************************************************************************/
+// Helper functions
+// Read a VBE register. The caller holds vbe_lock.
+uint16_t vbe_read(uint16_t index) {
+  outw(VBE_DISPI_IOPORT_INDEX, index);
+  return inw(VBE_DISPI_IOPORT_DATA);
+}
+
+// Write a VBE register. The caller holds vbe_lock.
+void vbe_write(uint16_t index, uint16_t value) {
+  outw(VBE_DISPI_IOPORT_INDEX, index);
+  outw(VBE_DISPI_IOPORT_DATA, value);
+}
+
+/******************************************************************************/
+/**
+ * Find the Bochs VBE device and make its virtual screen two pages tall, so
+ * vbe_show_page() can flip between them. The mode set by the bootloader is
+ * kept; it must be the one described by the arguments, else the screen is
+ * driven by another device.
+ * \param width,height Visible size in pixels.
+ * \param bpp Bits per pixel.
+ * \returns true if the device can flip pages, else returns false.
+ */
+bool vbe_init(int32_t width, int32_t height, int32_t bpp) {
+  spin_init(&vbe_lock);
+  uint64_t flags = irq_save();
+  spin_lock(&vbe_lock);
+
+  // Without the device the data port reads as 0xFFFF
+  bool found = false;
+  uint16_t id = vbe_read(VBE_DISPI_INDEX_ID);
+  if (id < VBE_DISPI_ID1 || id > VBE_DISPI_ID5) {
+    kprintf("[INFO] vbe_init: no Bochs VBE device\n");
+  } else if ((vbe_read(VBE_DISPI_INDEX_ENABLE) & VBE_DISPI_ENABLED) == 0 ||
+             vbe_read(VBE_DISPI_INDEX_XRES) != width ||
+             vbe_read(VBE_DISPI_INDEX_YRES) != height ||
+             vbe_read(VBE_DISPI_INDEX_BPP) != bpp) {
+    kprintf("[INFO] vbe_init: the screen is not in the Bochs VBE mode\n");
+  } else {
+    // The device clamps the virtual height to its video memory
+    vbe_write(VBE_DISPI_INDEX_VIRT_HEIGHT, 2 * height);
+    vbe_write(VBE_DISPI_INDEX_X_OFFSET, 0);
+    vbe_write(VBE_DISPI_INDEX_Y_OFFSET, 0);
+    if (vbe_read(VBE_DISPI_INDEX_VIRT_HEIGHT) < 2 * height) {
+      kprintf("[INFO] vbe_init: not enough video memory for two pages\n");
+    } else {
+      found = true;
+    }
+  }
+
+  if (found) vbe_page_h = height;
+  spin_unlock(&vbe_lock);
+  irq_restore(flags);
+  return found;
+}
+
+/**
+ * Whether vbe_init() succeeded.
+ */
+bool vbe_enabled() { return vbe_page_h != 0; }
+
+/**
+ * Scan out one of the two pages. The switch is one register write; the device
+ * shows the new page from its next frame.
+ * \param page 0 for the top page, 1 for the one below it.
+ */
+void vbe_show_page(int32_t page) {
+  if (vbe_page_h == 0) return;
+
+  uint64_t flags = irq_save();
+  spin_lock(&vbe_lock);
+  vbe_write(VBE_DISPI_INDEX_Y_OFFSET, page == 0 ? 0 : vbe_page_h);
+  spin_unlock(&vbe_lock);
+  irq_restore(flags);
+}
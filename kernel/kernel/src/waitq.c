@@ -0,0 +1,126 @@
+#include "waitq.h"
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Unlink the head of a wait queue. The caller holds the queue's lock.
+ * \param wq The wait queue.
+ * \returns the unlinked task, or NULL if the queue is empty.
+ */
+task_t* waitq_pop(waitq_t* wq) {
+  task_t* task = wq->head;
+  if (task == NULL) return NULL;
+  wq->head = task->wait_next;
+  if (wq->head == NULL) wq->tail = NULL;
+  task->wait_next = NULL;
+  task->waitq = NULL;
+  return task;
+}
+
+/**
+ * Unlink a task from the middle of a wait queue. The caller holds the queue's
+ * lock.
+ * \param wq The wait queue.
+ * \param task The task.
+ */
+void waitq_remove(waitq_t* wq, task_t* task) {
+  task_t* prev = NULL;
+  for (task_t* cur = wq->head; cur != NULL; prev = cur, cur = cur->wait_next) {
+    if (cur != task) continue;
+    if (prev == NULL) {
+      wq->head = task->wait_next;
+    } else {
+      prev->wait_next = task->wait_next;
+    }
+    if (wq->tail == task) wq->tail = prev;
+    break;
+  }
+  task->wait_next = NULL;
+  task->waitq = NULL;
+}
+
+/******************************************************************************/
+/**
+ * Init an empty wait queue.
+ * \param wq The wait queue.
+ */
+void waitq_init(waitq_t* wq) {
+  spin_init(&wq->lock);
+  wq->head = NULL;
+  wq->tail = NULL;
+}
+
+/**
+ * Block the calling task until cond(arg) holds. The condition is checked
+ * under the queue's lock, so a wakeup sent after the check is never lost.
+ * \param wq The wait queue.
+ * \param cond The condition.
+ * \param arg Argument passed to cond.
+ */
+void waitq_wait(waitq_t* wq, waitq_cond_t cond, void* arg) {
+  uint64_t flags = irq_save();
+  task_t* task = task_current();
+  while (true) {
+    spin_lock(&wq->lock);
+    if (cond(arg)) {
+      spin_unlock(&wq->lock);
+      break;
+    }
+
+    // Queue up and block. A waker that runs between the unlock and
+    // schedule() makes the task runnable again, so schedule() returns soon.
+    task->wait_next = NULL;
+    task->waitq = wq;
+    if (wq->tail == NULL) {
+      wq->head = task;
+    } else {
+      wq->tail->wait_next = task;
+    }
+    wq->tail = task;
+    task->state = TASK_BLOCKED;
+    spin_unlock(&wq->lock);
+    schedule();
+
+    // Woken up by something else (e.g. a timer): leave the queue ourselves
+    if (task->waitq != NULL) {
+      spin_lock(&wq->lock);
+      if (task->waitq == wq) waitq_remove(wq, task);
+      spin_unlock(&wq->lock);
+    }
+  }
+  irq_restore(flags);
+}
+
+/**
+ * Wake the task that has waited the longest. Safe in interrupt context.
+ * \param wq The wait queue.
+ * \returns true if a task is woken up, else returns false.
+ */
+bool waitq_wake_one(waitq_t* wq) {
+  uint64_t flags = irq_save();
+  spin_lock(&wq->lock);
+  task_t* task = waitq_pop(wq);
+  if (task != NULL) sched_wakeup(task);
+  spin_unlock(&wq->lock);
+  irq_restore(flags);
+  return task != NULL;
+}
+
+/**
+ * Wake every task in the queue. Safe in interrupt context.
+ * \param wq The wait queue.
+ * \returns the number of tasks woken up.
+ */
+size_t waitq_wake_all(waitq_t* wq) {
+  uint64_t flags = irq_save();
+  spin_lock(&wq->lock);
+  size_t nb_woken = 0;
+  task_t* task;
+  while ((task = waitq_pop(wq)) != NULL) {
+    sched_wakeup(task);
+    nb_woken++;
+  }
+  spin_unlock(&wq->lock);
+  irq_restore(flags);
+  return nb_woken;
+}
@@ -1,3 +1,4 @@
+#include <latency.h>
 #include <mem.h>
 #include <process.h>
 #include <stdbool.h>
@@ -5,6 +6,54 @@
 #include <stdint.h>
 #include <stdio.h>
 
+// Histograms read by the "lat" command
+#define MAX_NB_LAT_STAT 128
+lat_stat_t lat_stats[MAX_NB_LAT_STAT];
+
+/**
+ * Print the latency of every interrupt vector and system call that ran, per
+ * CPU: number of runs, then min, p50, p99 and max in ns.
+ */
+void print_latency() {
+  int64_t nb_stat = latstat(lat_stats, MAX_NB_LAT_STAT);
+  if (nb_stat < 0) {
+    perror("[ERROR] Unable to read latency histograms.\n");
+    return;
+  }
+
+  printf("cpu kind number: count min p50 p99 max (ns)\n");
+  for (int64_t i = 0; i < nb_stat; i++) {
+    lat_stat_t* stat = &lat_stats[i];
+    printf("%d %s %d: %d %d %d %d %d\n", (int64_t)stat->cpu,
+           stat->kind == LAT_KIND_IRQ ? "irq" : "syscall", stat->id,
+           stat->count, stat->min_ns, lat_percentile(stat, 50),
+           lat_percentile(stat, 99), stat->max_ns);
+  }
+}
+
+// Counters read by the "syscalls" command
+syscall_stat_t syscall_stats[NB_SYSCALL];
+
+/**
+ * Print how many times each system call ran and the average number of TSC
+ * ticks it took.
+ */
+void print_syscalls() {
+  int64_t nb_stat = syscallstat(syscall_stats, NB_SYSCALL);
+  if (nb_stat < 0) {
+    perror("[ERROR] Unable to read system call counters.\n");
+    return;
+  }
+
+  printf("number name: count avg_cycles\n");
+  for (int64_t i = 0; i < nb_stat; i++) {
+    syscall_stat_t* stat = &syscall_stats[i];
+    if (stat->count == 0) continue;
+    printf("%d %s: %d %d\n", stat->nr, stat->name, stat->count,
+           stat->cycles / stat->count);
+  }
+}
+
 void _start() {
   char* line = NULL;
   size_t line_size = 0;
@@ -26,6 +75,10 @@ void _start() {
       // If type "quit", the shell program exits, else we launch the executable.
       if (strcmp(tok, "clear") == 0) {
         exec("shell");
+      } else if (strcmp(tok, "lat") == 0) {
+        print_latency();
+      } else if (strcmp(tok, "syscalls") == 0) {
+        print_syscalls();
       } else {
         exec(tok);
       }
@@ -1,17 +1,19 @@
 #include <graphic.h>
+#include <input.h>
 #include <mem.h>
 #include <process.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <system.h>
-#include <time.h>
 
-#define DRAW_TIME 1000000
-#define INPUT_TIME 100000
-// The speed at which the player is moving
-#define MOVE_SPEED 10
+// One frame per period at 60 Hz, with up to 10 ms of CPU time per frame
+#define FRAME_PERIOD_NS 16666667
+#define FRAME_BUDGET_NS 10000000
+// The speed at which the player is moving, per frame while the key is held
+#define MOVE_SPEED 5
 #define WINDOW_WIDTH 960
 #define WINDOW_HEIGHT 720
 #define NUM_OF_ENEMIES 10
@@ -92,6 +94,7 @@ void move_player(char c) {
 
       tri2d_t(&player, ARGB32_GREEN, true, &window);
       graphic_draw(&window, true);
+      graphic_present();
       break;
     case 'd':
       player.p0.x += MOVE_SPEED;
@@ -100,6 +103,7 @@ void move_player(char c) {
 
       tri2d_t(&player, ARGB32_GREEN, true, &window);
       graphic_draw(&window, true);
+      graphic_present();
       break;
     default:
       break;
@@ -202,51 +206,45 @@ void initialize_game() {
 
   // Draw the enemies and the player into the window
   graphic_draw(&window, false);
+  graphic_present();
 }
 
 void _start() {
   initialize_game();
 
-  uint64_t prev_draw_time = 0;
-  uint64_t prev_input_time = 0;
+  // Draw one frame per period. The scheduler wakes us at the start of each
+  // period, so we do not spin between frames.
+  sched_setdeadline(0, FRAME_PERIOD_NS, FRAME_BUDGET_NS);
+  // Ignore the keys typed in the shell
+  input_flush();
 
  // Run this loop and for each frame, 
  // 1. Draw all the objects (enemies, player, and bullets)
  // 2. Get keyboard input and either call shoot, move_player, quit or do nothing based on the input
- // 3. Get the time elapsed between one frame to the next
+ // 3. Sleep until the next frame
   while (true) {
-    if (get_time() - prev_draw_time > DRAW_TIME) {
-      draw_enemy();
-      draw_player();
-      update_bullet();
-      draw_bullet();
-      hit_enemy();
-
-      graphic_draw(&window, true);
-      prev_draw_time = get_time();
+    draw_enemy();
+    draw_player();
+    update_bullet();
+    draw_bullet();
+    hit_enemy();
+
+    graphic_draw(&window, true);
+
+    graphic_flip();
+
+    // Use the keyboard input to control the player. Keys are read from the
+    // shared event ring, so moving and shooting work at the same time.
+    if (key_down(KEY_A)) move_player('a');
+    if (key_down(KEY_D)) move_player('d');
+    key_event_t event;
+    while (input_poll(&event)) {
+      if (!event.pressed) continue;
+      if (event.key == KEY_SPACE) shoot();
+      if (event.key == KEY_Q) exit();
     }
 
-    // Use the keyboard input to control the cube location on xy-plane
-    if (get_time() - prev_input_time > INPUT_TIME) {
-      char c = peekc();
-      switch (c) {
-        case 'a':
-          move_player('a');
-          break;
-        case 'd':
-          move_player('d');
-          break;
-        case ' ':
-          shoot();
-          break;
-        case 'q':
-          exit();
-          break;
-        default:
-          break;
-      }
-      prev_input_time = get_time();
-    }
+    sched_wait_period();
   }
 
   exit();
@@ -9,6 +9,18 @@
 #include "time.h"
 // Color is defined in system.h
 
+// Number of damage rectangles a window keeps. Past that, a new rectangle is
+// merged into the one it grows least.
+#define WINDOW_MAX_DAMAGE 8
+
+// Pixels [x0, x1) x [y0, y1) of a window buffer
+typedef struct {
+  int32_t x0;
+  int32_t y0;
+  int32_t x1;
+  int32_t y1;
+} damage_rect_t;
+
 typedef struct {
   pixel_t* addr;
   int32_t* z_buffer;
@@ -18,6 +30,21 @@ typedef struct {
   int32_t screen_x;
   int32_t screen_y;
   bool flip;
+  // Set by graphic_draw(): whether the window is on screen, where, and which
+  // graphic_clear_screen() it was drawn after. Any change means a full copy.
+  bool shown;
+  bool shown_flip;
+  int32_t shown_x;
+  int32_t shown_y;
+  uint64_t shown_clear;
+  // Regions changed since the last graphic_draw(), copied by the next one
+  int32_t nb_damage;
+  damage_rect_t damage[WINDOW_MAX_DAMAGE];
+  // Regions drawn since the last window_clear(), the only ones it resets
+  int32_t nb_content;
+  damage_rect_t content[WINDOW_MAX_DAMAGE];
+  // Compositor surface id, or -1 while the window is not attached
+  int32_t surface;
 } window_t;
 
 typedef struct {
@@ -78,7 +105,10 @@ typedef struct {
 bool graphic_get_framebuffer_info(framebuffer_info_t* fb_info);
 
 /**
- * Copy the current window's frame buffer to the kernel's framebuffer.
+ * Copy the current window's frame buffer to the kernel's framebuffer. Only the
+ * damaged regions are copied, unless the window moved, flipped or the screen
+ * was cleared since the last draw. An attached window is composed instead, so
+ * the windows above it stay on top and a move leaves no trail.
  * \param window Pointer to the window struct.
  * \param clear Clear window buffer after draw.
  * \return true if draw successfully.
@@ -90,6 +120,42 @@ void graphic_draw(window_t* window_t, bool clear);
  */ 
 void graphic_clear_screen();
 
+/**
+ * Show what was drawn since the last present. Clears and draws go to a back
+ * buffer in the kernel; this copies the parts that changed to the screen in
+ * one pass, so a frame never shows half drawn.
+ * \returns the number of bytes written to the screen, or -1 if another
+ * program owns the screen.
+ */
+int64_t graphic_present();
+
+/**
+ * Show what was drawn since the last frame by page flipping: the kernel draws
+ * the changes to the hidden half of the framebuffer and swaps it with the one
+ * on screen, so the frame appears at once without tearing. Where the display
+ * cannot flip pages, this is graphic_present().
+ * \returns the number of bytes written to the screen, or -1 if another
+ * program owns the screen.
+ */
+int64_t graphic_flip();
+
+/**
+ * Map the screen into the program, to draw on it without copying a window.
+ * Rows are framebuffer_pitch bytes apart. The program owns the screen until
+ * it calls graphic_unmap_framebuffer(), exits or execs; meanwhile the draw
+ * calls of other programs fail.
+ * \param fb_info Filled with the framebuffer information (may be NULL).
+ * \returns the address of the top-left pixel, or NULL if another program owns
+ * the screen.
+ */
+pixel_t* graphic_map_framebuffer(framebuffer_info_t* fb_info);
+
+/**
+ * Give the screen back after graphic_map_framebuffer(). The mapping goes away.
+ * \returns true if the program owned the screen, else returns false.
+ */
+bool graphic_unmap_framebuffer();
+
 /******************************************************************************/
 // Window functions
 /**
@@ -113,6 +179,40 @@ bool window_init(window_t* window, int width, int height, int screen_x,
  */
 void window_clear(window_t* window);
 
+/**
+ * Hand the window to the kernel's compositor, on top of the other windows.
+ * From then on graphic_draw() composes it with the windows it overlaps and
+ * the screen needs no clear between frames.
+ * \param window Pointer to the window struct.
+ * \return true if the window is attached.
+ */
+bool window_attach(window_t* window);
+
+/**
+ * Take the window out of the compositor. What it covered is drawn again.
+ * \param window Pointer to the window struct.
+ * \return true if the window was attached.
+ */
+bool window_detach(window_t* window);
+
+/**
+ * Put an attached window on top of the others.
+ * \param window Pointer to the window struct.
+ * \return true if the window is raised.
+ */
+bool window_raise(window_t* window);
+
+/**
+ * Record that a region of the window buffer changed. The drawing functions
+ * call it; a program writing to window->addr itself must too.
+ * \param window Pointer to the window struct.
+ * \param x Left column of the region.
+ * \param y Bottom row of the region (row index in the buffer).
+ * \param width Width of the region (in pixel).
+ * \param height Height of the region (in pixel).
+ */
+void window_damage(window_t* window, int x, int y, int width, int height);
+
 /******************************************************************************/
 // Draw primitive to user's framebuffer in 2D
 /**
@@ -0,0 +1,74 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "system.h"
+
+// Key codes of the events and of key_down(): set 1 scancodes without the
+// release bit. Keys sent with the 0xE0 prefix (arrows, right Ctrl/Alt, ...)
+// get bit 7 set, so every key fits in 0-255.
+#define KEY_ESC 0x01
+#define KEY_TAB 0x0F
+#define KEY_Q 0x10
+#define KEY_W 0x11
+#define KEY_ENTER 0x1C
+#define KEY_A 0x1E
+#define KEY_S 0x1F
+#define KEY_D 0x20
+#define KEY_F 0x21
+#define KEY_SPACE 0x39
+#define KEY_EXTENDED 0x80
+#define KEY_UP (KEY_EXTENDED | 0x48)
+#define KEY_LEFT (KEY_EXTENDED | 0x4B)
+#define KEY_RIGHT (KEY_EXTENDED | 0x4D)
+#define KEY_DOWN (KEY_EXTENDED | 0x50)
+
+// Modifiers held when an event was recorded
+#define KEY_MOD_SHIFT 0x1
+#define KEY_MOD_CTRL 0x2
+#define KEY_MOD_ALT 0x4
+#define KEY_MOD_CAPSLOCK 0x8
+
+// Number of events kept in the ring. Must be a power of two.
+#define KEY_RING_SIZE 128
+#define KEY_RING_MASK (KEY_RING_SIZE - 1)
+
+// One press or release, recorded by the keyboard interrupt handler
+typedef struct {
+  uint64_t tsc;        // TSC when the interrupt arrived (see get_time())
+  uint8_t key;         // KEY_* code
+  uint8_t pressed;     // 1 for a press (or auto-repeat), 0 for a release
+  uint16_t modifiers;  // KEY_MOD_* held at the time
+  uint32_t reserved;
+} key_event_t;
+
+// Page shared read-only with every process at USER_KEYBOARD. The kernel is
+// the only writer: it fills events[head & KEY_RING_MASK], then bumps head.
+// Readers keep their own tail; once head - tail reaches KEY_RING_SIZE, the
+// oldest event is being overwritten.
+typedef struct {
+  volatile uint64_t head;             // Number of events written so far
+  volatile uint64_t key_down[4];      // Bit k is set while key k is held
+  uint64_t reserved[3];
+  volatile key_event_t events[KEY_RING_SIZE];
+} key_ring_t;
+
+/**
+ * Drop the events recorded so far. Call once before polling so keys typed
+ * before the program started are not replayed.
+ */
+void input_flush();
+
+/**
+ * Read the next keyboard event without a system call.
+ * \param event Output event.
+ * \returns true if an event is read, or false if there is no new event.
+ */
+bool input_poll(key_event_t* event);
+
+/**
+ * Whether a key is held down right now, without a system call.
+ * \param key KEY_* code.
+ */
+bool key_down(uint8_t key);
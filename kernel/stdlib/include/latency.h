@@ -0,0 +1,47 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "system.h"
+
+// Number of log2 buckets in a latency histogram. Bucket b counts latencies in
+// [2^b, 2^(b+1)) ns; bucket 0 also counts 0 ns and the last bucket everything
+// above.
+#define LAT_NB_BUCKET 32
+
+// What a histogram measures
+#define LAT_KIND_IRQ 0      // An interrupt handler; id is the vector
+#define LAT_KIND_SYSCALL 1  // A system call; id is its number
+
+// Histogram of one interrupt vector or system call on one CPU, filled by
+// SYSCALL_LATSTAT. Times are measured with the TSC and reported in ns, from
+// entry to exit of the handler.
+typedef struct {
+  int32_t cpu;   // CPU the handler ran on
+  int32_t kind;  // One of LAT_KIND_*
+  int64_t id;    // Interrupt vector or system call number
+  uint64_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t sum_ns;
+  uint64_t buckets[LAT_NB_BUCKET];
+} lat_stat_t;
+
+/**
+ * Copy every non-empty latency histogram.
+ * \param stats Array to be filled.
+ * \param max_stat Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t latstat(lat_stat_t* stats, size_t max_stat);
+
+/**
+ * Estimate a percentile of a histogram. The result is the upper bound of the
+ * bucket holding it, clamped to the range seen, so it is within a factor of
+ * two of the exact value.
+ * \param stat The histogram.
+ * \param percent Percentile, from 0 to 100.
+ * \returns the latency in ns, or 0 if the histogram is empty.
+ */
+uint64_t lat_percentile(const lat_stat_t* stat, uint32_t percent);
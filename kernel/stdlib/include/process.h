@@ -5,6 +5,40 @@
 
 #include "system.h"
 
+#define PROC_NAME_LEN 32
+
+// State of a process reported by procstat()
+#define PROC_STATE_UNUSED 0
+#define PROC_STATE_RUNNABLE 1
+#define PROC_STATE_RUNNING 2
+#define PROC_STATE_BLOCKED 3
+#define PROC_STATE_EXITED 4
+
+// Snapshot of one process, filled by SYSCALL_PROCSTAT. Times are measured with
+// the TSC and reported in nanoseconds.
+typedef struct {
+  int64_t pid;
+  char name[PROC_NAME_LEN];
+  int32_t state;           // One of PROC_STATE_*
+  int32_t cpu;             // CPU the process last ran on
+  int32_t sched_class;     // SCHED_NORMAL or SCHED_DEADLINE (see sched.h)
+  int32_t user;            // 1 for a user program, 0 for a kernel thread
+  uint64_t utime_ns;       // Time spent in user mode
+  uint64_t stime_ns;       // Time spent in the kernel on behalf of the process
+  uint64_t nr_switch;      // Number of times the process was switched out
+  uint64_t nr_page_fault;  // Number of page faults
+  uint64_t dl_nr_missed;   // Missed deadlines (deadline class only)
+} proc_stat_t;
+
+// Counters of one system call since boot, filled by SYSCALL_SYSCALLSTAT
+typedef struct {
+  int64_t nr;                   // System call number
+  char name[SYSCALL_NAME_LEN];  // Name in SYSCALL_LIST
+  int32_t nb_args;              // Number of arguments
+  uint64_t count;               // Number of calls, from every process
+  uint64_t cycles;              // TSC ticks spent in the handler
+} syscall_stat_t;
+
 /**
  * Handler to invoke the execution of program with name exec_name.
  * \param exe_name Name of the executable to be exec.
@@ -16,4 +50,26 @@ bool exec(const char* exe_name);
  * Hanlder to exit the current process and invoke shell exec.
  * \returns true if the function is executed successfully, else return falses.
  */
-bool exit();
\ No newline at end of file
+bool exit();
+
+/**
+ * Get the pid of the calling process.
+ * \returns the pid of the calling process.
+ */
+int64_t getpid();
+
+/**
+ * Take a snapshot of every process, including the ones that exited recently.
+ * \param stats Array to be filled.
+ * \param max_proc Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t procstat(proc_stat_t* stats, size_t max_proc);
+
+/**
+ * Read the call counters of every system call.
+ * \param stats Array to be filled, one entry per system call.
+ * \param max_stat Number of entries in stats (NB_SYSCALL is enough).
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t syscallstat(syscall_stat_t* stats, size_t max_stat);
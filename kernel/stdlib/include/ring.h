@@ -0,0 +1,155 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "graphic.h"
+#include "system.h"
+
+// Number of entries in each queue of a ring. Must be a power of two.
+#define RING_SIZE 64
+#define RING_MASK (RING_SIZE - 1)
+
+// One queued system call: the number and arguments syscall() would take
+typedef struct {
+  uint64_t nr;
+  uint64_t args[6];
+  uint64_t user_data;  // Copied to the completion, not read by the kernel
+} ring_sqe_t;
+
+// Result of one queued system call
+typedef struct {
+  uint64_t user_data;
+  int64_t res;  // Return value of the system call
+} ring_cqe_t;
+
+// Submission and completion queues, allocated by the program. The program
+// fills sqes[sq_tail & RING_MASK] and bumps sq_tail; ring_enter() runs the
+// entries in order, advancing sq_head and writing cqes[cq_tail & RING_MASK].
+// The program reads completions up to cq_tail and bumps cq_head. The kernel
+// only looks at the ring during ring_enter(), on the caller's behalf.
+typedef struct {
+  volatile uint32_t sq_head;  // Next entry the kernel runs
+  volatile uint32_t sq_tail;  // Next free entry
+  volatile uint32_t cq_head;  // Next completion the program reads
+  volatile uint32_t cq_tail;  // Next completion the kernel writes
+  ring_sqe_t sqes[RING_SIZE];
+  ring_cqe_t cqes[RING_SIZE];
+} syscall_ring_t;
+
+/**
+ * Empty both queues of a ring.
+ * \param ring The ring.
+ */
+void ring_init(syscall_ring_t* ring);
+
+/**
+ * Queue a system call. Nothing runs until ring_enter().
+ * \param ring The ring.
+ * \param nr System call number (SYSCALL_*). exec, exit and ring_enter itself
+ * are refused and complete with -1.
+ * \param user_data Value copied to the completion.
+ * \param arg0,arg1,arg2,arg3,arg4,arg5 Arguments of the system call.
+ * \returns true if the entry is queued, false if the submission queue is full.
+ */
+bool ring_prep(syscall_ring_t* ring, uint64_t nr, uint64_t user_data,
+               uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+               uint64_t arg4, uint64_t arg5);
+
+/**
+ * Queue a write (see printf()).
+ * \param ring The ring.
+ * \param f_descriptor STD_OUT or STD_ERR.
+ * \param str Characters to be written. Must stay valid until ring_enter().
+ * \param size Number of characters.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_write(syscall_ring_t* ring, uint64_t f_descriptor,
+                     const char* str, size_t size, uint64_t user_data);
+
+/**
+ * Queue the mapping of one page (see mmap()).
+ * \param ring The ring.
+ * \param address Virtual address of the page.
+ * \param read,write,exec Protection of the page.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_mmap(syscall_ring_t* ring, void* address, bool read, bool write,
+                    bool exec, uint64_t user_data);
+
+/**
+ * Queue a sleep of CLOCK_MONOTONIC (see clock_nanosleep()).
+ * \param ring The ring.
+ * \param flags 0, or TIMER_ABSTIME if ns is a deadline.
+ * \param ns Duration, or deadline in ns since boot.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_sleep(syscall_ring_t* ring, int flags, uint64_t ns,
+                     uint64_t user_data);
+
+/**
+ * Queue a copy of a window to the screen (see graphic_draw()). Its position
+ * is taken now, its pixels when the entry runs.
+ * \param ring The ring.
+ * \param window The window.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_framebuffer_cpy(syscall_ring_t* ring, window_t* window,
+                               uint64_t user_data);
+
+/**
+ * Queue a clear of the screen (see graphic_clear_screen()).
+ * \param ring The ring.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_framebuffer_clear(syscall_ring_t* ring, uint64_t user_data);
+
+/**
+ * Queue a present of the screen (see graphic_present()).
+ * \param ring The ring.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_present(syscall_ring_t* ring, uint64_t user_data);
+
+/**
+ * Queue a flip of the screen (see graphic_flip()).
+ * \param ring The ring.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_flip(syscall_ring_t* ring, uint64_t user_data);
+
+/**
+ * Queue a draw of a window (see graphic_draw()). An attached window is
+ * composed from its damage; the window must not be drawn to until the ring is
+ * entered. Any other window is copied whole.
+ * \param ring The ring.
+ * \param window The window.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_draw(syscall_ring_t* ring, window_t* window,
+                    uint64_t user_data);
+
+/**
+ * Run every queued entry with a single system call. Entries run in order and
+ * each one writes a completion. The kernel stops early if the completion
+ * queue is full; the rest stays queued for the next call.
+ * \param ring The ring.
+ * \returns the number of entries run, or -1 on error.
+ */
+int64_t ring_enter(syscall_ring_t* ring);
+
+/**
+ * Take the oldest completion.
+ * \param ring The ring.
+ * \param cqe Filled with the completion.
+ * \returns true if there was one, else returns false.
+ */
+bool ring_get_cqe(syscall_ring_t* ring, ring_cqe_t* cqe);
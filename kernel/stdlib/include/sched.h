@@ -0,0 +1,72 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "system.h"
+
+// Bit mask of the CPUs a task may run on. Bit i stands for CPU i.
+typedef uint64_t cpu_mask_t;
+
+#define CPU_MASK_ALL (~(cpu_mask_t)0)
+#define CPU_MASK(cpu) ((cpu_mask_t)1 << (cpu))
+
+// Snapshot of one CPU's run queue, filled by SYSCALL_SCHED_STAT
+typedef struct {
+  int32_t cpu;             // Index of the CPU
+  int32_t online;          // Whether the CPU is running the scheduler
+  int64_t length;          // Number of tasks waiting in the run queue
+  uint64_t nr_push;        // Tasks pushed by the owner
+  uint64_t nr_pop;         // Tasks popped by the owner
+  uint64_t nr_steal;       // Tasks this CPU stole from other CPUs
+  uint64_t nr_steal_fail;  // Steal attempts that came back empty
+  uint64_t nr_stolen;      // Tasks other CPUs stole from this queue
+  uint64_t nr_switch;      // Context switches on this CPU
+} runqueue_stat_t;
+
+/**
+ * Restrict the task with the given pid to the CPUs in mask.
+ * \param pid Pid of the task. 0 means the calling process.
+ * \param mask Set of allowed CPUs.
+ * \returns true if the affinity is changed, else returns false.
+ */
+bool sched_setaffinity(int64_t pid, cpu_mask_t mask);
+
+/**
+ * Read the CPU affinity of the task with the given pid.
+ * \param pid Pid of the task. 0 means the calling process.
+ * \returns the set of allowed CPUs, or 0 if the task does not exist.
+ */
+cpu_mask_t sched_getaffinity(int64_t pid);
+
+/**
+ * Read the run queue counters of every CPU.
+ * \param stats Array to be filled, one entry per CPU.
+ * \param max_cpu Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t sched_get_stat(runqueue_stat_t* stats, size_t max_cpu);
+
+/******************************************************************************/
+// Scheduling classes
+#define SCHED_NORMAL 0
+#define SCHED_DEADLINE 1
+
+/**
+ * Ask for periodic scheduling: the caller is woken at the start of every
+ * period and runs ahead of best-effort work. Typical use is one period per
+ * frame, e.g. 16666667 ns with a budget of 10000000 ns.
+ * \param pid Pid of the task. Only 0 (the calling process) is supported.
+ * \param period_ns Length of a period in nanoseconds. 0 goes back to the normal
+ * class.
+ * \param budget_ns Run time needed per period in nanoseconds.
+ * \returns true if the request is admitted, else returns false.
+ */
+bool sched_setdeadline(int64_t pid, uint64_t period_ns, uint64_t budget_ns);
+
+/**
+ * Finish the work of the current period and sleep until the next one.
+ * \returns the number of deadlines missed so far, or -1 if the caller did not
+ * call sched_setdeadline().
+ */
+int64_t sched_wait_period();
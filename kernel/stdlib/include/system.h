@@ -2,17 +2,53 @@
 
 /******************************************************************************/
 // Syscall number
-#define SYSCALL_READ 0
-#define SYSCALL_WRITE 1
-#define SYSCALL_MMAP 9
-#define SYSCALL_MPROTECT 10
-#define SYSCALL_MUNMAP 11
-#define SYSCALL_EXEC 59
-#define SYSCALL_EXIT 60
-#define SYSCALL_GET_FRAMEBUFFER_INFO 1000
-#define SYSCALL_FRAMEBUFFER_CPY 1001
-#define SYSCALL_FRAMEBUFFER_CLEAR 1002
-#define SYSCALL_PEEK_CHAR 2000
+// Every system call as X(NAME, name, number, nb_args), sorted by number.
+// SYSCALL_<NAME> is the number passed to syscall(). The kernel builds its
+// dispatch table from this list, with ksys_<name>() as the handler.
+#define SYSCALL_LIST(X)                                    \
+  X(READ, read, 0, 6)                                      \
+  X(WRITE, write, 1, 3)                                    \
+  X(MMAP, mmap, 9, 4)                                      \
+  X(MPROTECT, mprotect, 10, 4)                             \
+  X(MUNMAP, munmap, 11, 1)                                 \
+  X(NANOSLEEP, nanosleep, 35, 1)                           \
+  X(GETPID, getpid, 39, 0)                                 \
+  X(EXEC, exec, 59, 1)                                     \
+  X(EXIT, exit, 60, 0)                                     \
+  X(CLOCK_NANOSLEEP, clock_nanosleep, 230, 3)              \
+  X(GET_FRAMEBUFFER_INFO, get_framebuffer_info, 1000, 1)   \
+  X(FRAMEBUFFER_CPY, framebuffer_cpy, 1001, 6)             \
+  X(FRAMEBUFFER_CLEAR, framebuffer_clear, 1002, 0)         \
+  X(MAP_FRAMEBUFFER, map_framebuffer, 1003, 0)             \
+  X(UNMAP_FRAMEBUFFER, unmap_framebuffer, 1004, 0)         \
+  X(PRESENT, present, 1005, 0)                             \
+  X(FRAMEBUFFER_DAMAGE, framebuffer_damage, 1006, 3)       \
+  X(SURFACE_ATTACH, surface_attach, 1007, 1)               \
+  X(SURFACE_DETACH, surface_detach, 1008, 1)               \
+  X(SURFACE_RAISE, surface_raise, 1009, 1)                 \
+  X(SURFACE_COMMIT, surface_commit, 1010, 3)               \
+  X(FLIP, flip, 1011, 0)                                   \
+  X(PEEK_CHAR, peek_char, 2000, 0)                         \
+  X(SCHED_SETAFFINITY, sched_setaffinity, 3000, 2)         \
+  X(SCHED_GETAFFINITY, sched_getaffinity, 3001, 1)         \
+  X(SCHED_STAT, sched_stat, 3002, 2)                       \
+  X(SCHED_SETDEADLINE, sched_setdeadline, 3003, 3)         \
+  X(SCHED_WAIT_PERIOD, sched_wait_period, 3004, 0)         \
+  X(PROCSTAT, procstat, 3005, 2)                           \
+  X(LATSTAT, latstat, 3006, 2)                             \
+  X(SYSCALLSTAT, syscallstat, 3007, 2)                     \
+  X(RING_ENTER, ring_enter, 3008, 2)
+
+#define SYSCALL_NUMBER_ENUM(NAME, name, num, argc) SYSCALL_##NAME = num,
+enum { SYSCALL_LIST(SYSCALL_NUMBER_ENUM) };
+
+// Dense index of each system call, from 0 to NB_SYSCALL - 1
+#define SYSCALL_INDEX_ENUM(NAME, name, num, argc) SYSCALL_INDEX_##NAME,
+enum { SYSCALL_LIST(SYSCALL_INDEX_ENUM) NB_SYSCALL };
+
+// System call numbers are below this bound
+#define SYSCALL_NR_LIMIT 4096
+#define SYSCALL_NAME_LEN 24
 
 /******************************************************************************/
 // Page related 
@@ -25,11 +61,18 @@
 
 /******************************************************************************/
 // Mem location for stack and heap
+#define USER_VDSO 0x60000000000
+// Keyboard event ring (see input.h), the page after the time page
+#define USER_KEYBOARD (USER_VDSO + PAGE_SIZE)
 #define USER_STACK 0x70000000000
 #define USER_HEAP  0x90000000000
 #define USER_FRAMEBUFFER 0x100000000000
+// The screen itself, while a program owns it (see graphic_map_framebuffer())
+#define USER_SCANOUT 0x200000000000
+#define USER_SCANOUT_END (USER_SCANOUT + 0x100000000)
 
 #define KERNEL_HEAP 0xffff900000000000
+#define KERNEL_MMIO 0xffffa00000000000
 /******************************************************************************/
 // I/O related
 #define STD_IN 0
@@ -38,6 +81,7 @@
 
 /******************************************************************************/
 #define MAX_NB_PROCESS 256
+#define MAX_NB_CPU 16
 
 /******************************************************************************/
 #define FLT_MAX 3.40282e+38
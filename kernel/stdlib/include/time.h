@@ -1,4 +1,64 @@
 #pragma once 
 #include <stdint.h>
 
-uint64_t get_time();
\ No newline at end of file
+// Clocks accepted by clock_gettime() and clock_nanosleep()
+#define CLOCK_MONOTONIC 1
+
+// clock_nanosleep() flag: the time is a deadline rather than a duration
+#define TIMER_ABSTIME 1
+
+#define NS_PER_SEC 1000000000ULL
+
+typedef struct timespec {
+  int64_t tv_sec;
+  int64_t tv_nsec;
+} timespec_t;
+
+// Layout of the read-only time page the kernel maps at USER_VDSO. The scale
+// factor is 32.32 fixed point: ns = ((tsc - tsc_boot) * tsc_to_ns_mult) >> 32.
+typedef struct vdso_time {
+  volatile uint32_t seq;  // Odd while the kernel updates the page
+  uint32_t reserved;
+  uint64_t tsc_boot;
+  uint64_t tsc_to_ns_mult;
+  uint64_t tsc_khz;
+} vdso_time_t;
+
+/**
+ * Read the 64-bit time stamp counter.
+ * \returns the number of TSC cycles since reset.
+ */
+uint64_t get_time();
+
+/**
+ * Nanoseconds elapsed since boot, computed from the time page without entering
+ * the kernel.
+ * \returns the monotonic time in nanoseconds.
+ */
+uint64_t clock_ns();
+
+/**
+ * Read a clock. Only CLOCK_MONOTONIC (time since boot) is supported.
+ * \param clock_id The clock to read.
+ * \param ts Filled with the current time.
+ * \returns 0 on success, or -1 if the clock is unknown or ts is NULL.
+ */
+int clock_gettime(int clock_id, timespec_t* ts);
+
+/**
+ * Block the calling process for at least a given duration. The CPU halts or
+ * runs other programs in the meantime.
+ * \param req Duration to sleep.
+ * \returns 0 on success, or -1 if req is invalid.
+ */
+int nanosleep(const timespec_t* req);
+
+/**
+ * Block the calling process on a clock. With TIMER_ABSTIME, req is the time to
+ * wake up at, so a periodic loop does not drift.
+ * \param clock_id The clock, only CLOCK_MONOTONIC is supported.
+ * \param flags 0 or TIMER_ABSTIME.
+ * \param req Duration, or deadline with TIMER_ABSTIME.
+ * \returns 0 on success, or -1 on error.
+ */
+int clock_nanosleep(int clock_id, int flags, const timespec_t* req);
@@ -4,6 +4,54 @@
 // defined in asm/syscall.s
 extern int64_t syscall(uint64_t nr, ...);
 
+// Number of graphic_clear_screen() calls, so windows know when to copy again
+uint64_t screen_clear_count = 0;
+
+// Where the buffers of the next window_init() go, so a program can have
+// several windows
+uintptr_t window_next = USER_FRAMEBUFFER;
+
+/******************************************************************************/
+// Helper functions
+/**
+ * Add [x0, x1) x [y0, y1) to a list of rectangles. Nothing is added if a
+ * rectangle already covers it; once the list is full, it is merged into the
+ * rectangle whose area grows least.
+ */
+void rect_list_add(damage_rect_t *rects, int32_t *nb_rect, int32_t x0,
+                   int32_t y0, int32_t x1, int32_t y1) {
+  for (int32_t i = 0; i < *nb_rect; i++) {
+    if (rects[i].x0 <= x0 && rects[i].y0 <= y0 && rects[i].x1 >= x1 &&
+        rects[i].y1 >= y1) {
+      return;
+    }
+  }
+
+  if (*nb_rect < WINDOW_MAX_DAMAGE) {
+    rects[*nb_rect] = (damage_rect_t){x0, y0, x1, y1};
+    (*nb_rect)++;
+    return;
+  }
+
+  int32_t best = 0;
+  int64_t best_growth = INT64_MAX;
+  for (int32_t i = 0; i < *nb_rect; i++) {
+    damage_rect_t *r = &rects[i];
+    int64_t area = (int64_t)(r->x1 - r->x0) * (r->y1 - r->y0);
+    int64_t merged = (int64_t)(max(r->x1, x1) - min(r->x0, x0)) *
+                     (max(r->y1, y1) - min(r->y0, y0));
+    if (merged - area < best_growth) {
+      best = i;
+      best_growth = merged - area;
+    }
+  }
+  damage_rect_t *r = &rects[best];
+  r->x0 = min(r->x0, x0);
+  r->y0 = min(r->y0, y0);
+  r->x1 = max(r->x1, x1);
+  r->y1 = max(r->y1, y1);
+}
+
 /******************************************************************************/
 // Graphical functions
 /**
@@ -23,10 +71,34 @@ bool graphic_get_framebuffer_info(framebuffer_info_t *fb_info) {
 void graphic_draw(window_t *window, bool clear) {
   if (window == NULL) return;
 
-  // Make draw call
-  syscall(SYSCALL_FRAMEBUFFER_CPY, window->addr, (int64_t)window->screen_x,
-          (int64_t)window->screen_y, (int64_t)window->width,
-          (int64_t)window->height, (int64_t)window->flip);
+  // The compositor finds out about moves on its own
+  if (window->surface >= 0) {
+    syscall(SYSCALL_SURFACE_COMMIT, (int64_t)window->surface, window->damage,
+            (int64_t)window->nb_damage);
+    window->nb_damage = 0;
+    if (clear) window_clear(window);
+    return;
+  }
+
+  // Make draw call. A window that moved or whose screen area was cleared is
+  // copied whole, else only its damage.
+  if (!window->shown || window->shown_x != window->screen_x ||
+      window->shown_y != window->screen_y ||
+      window->shown_flip != window->flip ||
+      window->shown_clear != screen_clear_count) {
+    syscall(SYSCALL_FRAMEBUFFER_CPY, window->addr, (int64_t)window->screen_x,
+            (int64_t)window->screen_y, (int64_t)window->width,
+            (int64_t)window->height, (int64_t)window->flip);
+    window->shown = true;
+    window->shown_x = window->screen_x;
+    window->shown_y = window->screen_y;
+    window->shown_flip = window->flip;
+    window->shown_clear = screen_clear_count;
+  } else if (window->nb_damage > 0) {
+    syscall(SYSCALL_FRAMEBUFFER_DAMAGE, window, window->damage,
+            (int64_t)window->nb_damage);
+  }
+  window->nb_damage = 0;
 
   // Clear the window buffer if needed
   if (clear) window_clear(window);
@@ -35,7 +107,51 @@ void graphic_draw(window_t *window, bool clear) {
 /**
  * Clear the kernel's buffer
  */
-void graphic_clear_screen() { syscall(SYSCALL_FRAMEBUFFER_CLEAR); }
+void graphic_clear_screen() {
+  syscall(SYSCALL_FRAMEBUFFER_CLEAR);
+  screen_clear_count++;
+}
+
+/**
+ * Show what was drawn since the last present. Clears and draws go to a back
+ * buffer in the kernel; this copies the parts that changed to the screen in
+ * one pass, so a frame never shows half drawn.
+ * \returns the number of bytes written to the screen, or -1 if another
+ * program owns the screen.
+ */
+int64_t graphic_present() { return syscall(SYSCALL_PRESENT); }
+
+/**
+ * Show what was drawn since the last frame by page flipping: the kernel draws
+ * the changes to the hidden half of the framebuffer and swaps it with the one
+ * on screen, so the frame appears at once without tearing. Where the display
+ * cannot flip pages, this is graphic_present().
+ * \returns the number of bytes written to the screen, or -1 if another
+ * program owns the screen.
+ */
+int64_t graphic_flip() { return syscall(SYSCALL_FLIP); }
+
+/**
+ * Map the screen into the program, to draw on it without copying a window.
+ * Rows are framebuffer_pitch bytes apart. The program owns the screen until
+ * it calls graphic_unmap_framebuffer(), exits or execs; meanwhile the draw
+ * calls of other programs fail.
+ * \param fb_info Filled with the framebuffer information (may be NULL).
+ * \returns the address of the top-left pixel, or NULL if another program owns
+ * the screen.
+ */
+pixel_t* graphic_map_framebuffer(framebuffer_info_t* fb_info) {
+  if (fb_info != NULL && !graphic_get_framebuffer_info(fb_info)) return NULL;
+  return (pixel_t *)syscall(SYSCALL_MAP_FRAMEBUFFER);
+}
+
+/**
+ * Give the screen back after graphic_map_framebuffer(). The mapping goes away.
+ * \returns true if the program owned the screen, else returns false.
+ */
+bool graphic_unmap_framebuffer() {
+  return (bool)syscall(SYSCALL_UNMAP_FRAMEBUFFER);
+}
 
 /******************************************************************************/
 // Window functions
@@ -55,14 +171,16 @@ bool window_init(window_t *window, int width, int height, int screen_x,
                  int screen_y, color_t bg) {
   if (window == NULL) return false;
 
-  // Memmap address for the window's framebuffer. This would start at
-  // USER_FRAMEBUFFER defined in system.h.
-  if (mmap((void *)USER_FRAMEBUFFER, 2 * width * height * sizeof(pixel_t),
-           (PROT_READ | PROT_WRITE), 0, 0, 0) == NULL) {
+  // Memmap address for the window's framebuffer. The first one starts at
+  // USER_FRAMEBUFFER defined in system.h, the next ones follow.
+  size_t size = 2 * width * height * sizeof(pixel_t);
+  if (mmap((void *)window_next, size, (PROT_READ | PROT_WRITE), 0, 0, 0) ==
+      NULL) {
     return false;
   }
 
-  window->addr = (pixel_t *)USER_FRAMEBUFFER;
+  window->addr = (pixel_t *)window_next;
+  window_next += (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
   window->z_buffer = (int32_t *)(window->addr + width * height);
   window->width = width;
   window->height = height;
@@ -70,8 +188,13 @@ bool window_init(window_t *window, int width, int height, int screen_x,
   window->screen_y = screen_y;
   window->bg = bg;
   window->flip = true;  // default for bottom-left origin.
-  // Set buffer to the default background color. This would also set dirty_buff
-  // to false
+  window->shown = false;
+  window->surface = -1;
+  window->nb_damage = 0;
+  // Set buffer to the default background color: the whole buffer counts as
+  // drawn, so window_clear() resets all of it
+  window->nb_content = 1;
+  window->content[0] = (damage_rect_t){0, 0, width, height};
   window_clear(window);
   return true;
 }
@@ -83,14 +206,84 @@ bool window_init(window_t *window, int width, int height, int screen_x,
 void window_clear(window_t *window) {
   if (window == NULL) return;
 
+  // Only the regions drawn since the last clear differ from the background
   color_t *src = (color_t *)window->addr;
   int32_t *z_buff = window->z_buffer;
-  for (int r = 0; r < window->height; r++) {
-    for (int c = 0; c < window->width; c++) {
-      src[r * window->width + c] = window->bg;
-      z_buff[r * window->width + c] = INT32_MIN;
+  for (int32_t i = 0; i < window->nb_content; i++) {
+    damage_rect_t *rect = &window->content[i];
+    for (int r = rect->y0; r < rect->y1; r++) {
+      for (int c = rect->x0; c < rect->x1; c++) {
+        src[r * window->width + c] = window->bg;
+        z_buff[r * window->width + c] = INT32_MIN;
+      }
     }
+    rect_list_add(window->damage, &window->nb_damage, rect->x0, rect->y0,
+                  rect->x1, rect->y1);
   }
+  window->nb_content = 0;
+}
+
+/**
+ * Hand the window to the kernel's compositor, on top of the other windows.
+ * From then on graphic_draw() composes it with the windows it overlaps and
+ * the screen needs no clear between frames.
+ * \param window Pointer to the window struct.
+ * \return true if the window is attached.
+ */
+bool window_attach(window_t *window) {
+  if (window == NULL || window->surface >= 0) return false;
+  int64_t id = syscall(SYSCALL_SURFACE_ATTACH, window);
+  if (id < 0) return false;
+  window->surface = (int32_t)id;
+  // Attaching composed the whole window
+  window->nb_damage = 0;
+  return true;
+}
+
+/**
+ * Take the window out of the compositor. What it covered is drawn again.
+ * \param window Pointer to the window struct.
+ * \return true if the window was attached.
+ */
+bool window_detach(window_t *window) {
+  if (window == NULL || window->surface < 0) return false;
+  bool detached = (bool)syscall(SYSCALL_SURFACE_DETACH,
+                                (int64_t)window->surface);
+  window->surface = -1;
+  window->shown = false;
+  return detached;
+}
+
+/**
+ * Put an attached window on top of the others.
+ * \param window Pointer to the window struct.
+ * \return true if the window is raised.
+ */
+bool window_raise(window_t *window) {
+  if (window == NULL || window->surface < 0) return false;
+  return (bool)syscall(SYSCALL_SURFACE_RAISE, (int64_t)window->surface);
+}
+
+/**
+ * Record that a region of the window buffer changed. The drawing functions
+ * call it; a program writing to window->addr itself must too.
+ * \param window Pointer to the window struct.
+ * \param x Left column of the region.
+ * \param y Bottom row of the region (row index in the buffer).
+ * \param width Width of the region (in pixel).
+ * \param height Height of the region (in pixel).
+ */
+void window_damage(window_t *window, int x, int y, int width, int height) {
+  if (window == NULL) return;
+
+  int32_t x0 = max(x, 0);
+  int32_t y0 = max(y, 0);
+  int32_t x1 = min(x + width, window->width);
+  int32_t y1 = min(y + height, window->height);
+  if (x0 >= x1 || y0 >= y1) return;
+
+  rect_list_add(window->damage, &window->nb_damage, x0, y0, x1, y1);
+  rect_list_add(window->content, &window->nb_content, x0, y0, x1, y1);
 }
 
 /******************************************************************************/
@@ -111,6 +304,7 @@ bool pixel2d(int x, int y, color_t color, window_t *window) {
     if (x < window->width && x >= 0 && y < window->height && y >= 0) {
       // Draw the pixel to the window
       (window->addr)[x + y * window->width] = color;
+      window_damage(window, x, y, 1, 1);
     }
     return true;
   }
@@ -176,6 +370,10 @@ bool line2d(int x0, int y0, int x1, int y1, color_t color, window_t *window) {
   int step_dec_neg = 2 * dy;
   int step_dec_non_neg = step_dec_neg - 2 * dx;
 
+  // Mark the bounding box once so each pixel finds it covered
+  window_damage(window, min(x0, x1), min(y0, y1), abs(x1 - x0) + 1,
+                abs(y1 - y0) + 1);
+
   // Draw pixel in the line
   pixel2d(x, y, color, window);
   if (steep) {
@@ -244,6 +442,7 @@ bool tri2d(int x0, int y0, int x1, int y1, int x2, int y2, color_t color,
   int x_max = min(max(x0, max(x1, x2)), window->width - 1);
   int y_min = max(min(y0, min(y1, y2)), 0);
   int y_max = min(max(y0, max(y1, y2)), window->height - 1);
+  window_damage(window, x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
 
   if (fill) {
     for (int y = y_min; y <= y_max; y++) {
@@ -306,6 +505,7 @@ bool rec2d(int x0, int y0, int x1, int y1, int x2, int y2, int x3, int y3,
   int x_max = min(max(x0, max(x1, max(x2, x3))), window->width - 1);
   int y_min = max(min(y0, min(y1, min(y2, y3))), 0);
   int y_max = min(max(y0, max(y1, max(y2, y3))), window->height - 1);
+  window_damage(window, x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
 
   if (fill) {
     for (int y = y_min; y <= y_max; y++) {
@@ -366,6 +566,7 @@ bool rec2d_wh(int x, int y, int width, int height, color_t color, bool fill,
   if (x >= window->width || x_end <= 0 || y_end >= window->height || y <= 0) {
     return true;
   }
+  window_damage(window, x, y_end, x_end - x + 1, y - y_end + 1);
 
   if (fill) {
     for (int c = y_end; c <= y; c++) {
@@ -401,6 +602,7 @@ bool pixel3d(int x, int y, int z, color_t color, window_t *window) {
       y < window->height && y >= 0) {
     window->addr[idx] = color;
     window->z_buffer[idx] = z;
+    window_damage(window, x, y, 1, 1);
   }
   return true;
 }
@@ -471,6 +673,10 @@ bool line3d(int x0, int y0, int z0, int x1, int y1, int z1, color_t color,
   int step_dec_neg = 2 * dy;
   int step_dec_non_neg = step_dec_neg - 2 * dx;
 
+  // Mark the bounding box once so each pixel finds it covered
+  window_damage(window, min(x0, x1), min(y0, y1), abs(x1 - x0) + 1,
+                abs(y1 - y0) + 1);
+
   // Draw pixel in the line
   pixel3d(x, y, z, color, window);
   if (steep) {
@@ -543,6 +749,7 @@ bool tri3d(int x0, int y0, int z0, int x1, int y1, int z1, int x2, int y2,
   int x_max = min(max(x0, max(x1, x2)), window->width - 1);
   int y_min = max(min(y0, min(y1, y2)), 0);
   int y_max = min(max(y0, max(y1, y2)), window->height - 1);
+  window_damage(window, x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
   float dx10 = (float)(x1 - x0);
   float dy10 = (float)(y1 - y0);
   float dx02 = (float)(x0 - x2);
@@ -0,0 +1,56 @@
+#include "input.h"
+
+// Ring shared by the kernel at USER_KEYBOARD
+#define KEY_RING ((const key_ring_t*)USER_KEYBOARD)
+
+// Number of events this process has consumed
+uint64_t input_tail = 0;
+
+/**
+ * Drop the events recorded so far. Call once before polling so keys typed
+ * before the program started are not replayed.
+ */
+void input_flush() {
+  input_tail = __atomic_load_n(&KEY_RING->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Read the next keyboard event without a system call.
+ * \param event Output event.
+ * \returns true if an event is read, or false if there is no new event.
+ */
+bool input_poll(key_event_t* event) {
+  while (true) {
+    uint64_t head = __atomic_load_n(&KEY_RING->head, __ATOMIC_ACQUIRE);
+    if (input_tail == head) return false;
+    // Skip the events that were overwritten. The slot at head - KEY_RING_SIZE
+    // is the one the kernel writes next, so it is dropped too.
+    if (head - input_tail >= KEY_RING_SIZE) {
+      input_tail = head - KEY_RING_SIZE + 1;
+    }
+
+    const volatile key_event_t* slot =
+        &KEY_RING->events[input_tail & KEY_RING_MASK];
+    event->tsc = slot->tsc;
+    event->key = slot->key;
+    event->pressed = slot->pressed;
+    event->modifiers = slot->modifiers;
+    event->reserved = 0;
+
+    // The kernel may have reused the slot while we copied it
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&KEY_RING->head, __ATOMIC_RELAXED);
+    if (head - input_tail < KEY_RING_SIZE) {
+      input_tail++;
+      return true;
+    }
+  }
+}
+
+/**
+ * Whether a key is held down right now, without a system call.
+ * \param key KEY_* code.
+ */
+bool key_down(uint8_t key) {
+  return (KEY_RING->key_down[key >> 6] >> (key & 63)) & 1;
+}
@@ -0,0 +1,44 @@
+#include "latency.h"
+
+// External functions for system call handler. syscall(uint64_t nr, ...) is
+// defined in asm/syscall.s
+extern int64_t syscall(uint64_t nr, ...);
+
+/**
+ * Copy every non-empty latency histogram.
+ * \param stats Array to be filled.
+ * \param max_stat Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t latstat(lat_stat_t* stats, size_t max_stat) {
+  if (stats == NULL) return -1;
+  return syscall(SYSCALL_LATSTAT, stats, max_stat);
+}
+
+/**
+ * Estimate a percentile of a histogram. The result is the upper bound of the
+ * bucket holding it, clamped to the range seen, so it is within a factor of
+ * two of the exact value.
+ * \param stat The histogram.
+ * \param percent Percentile, from 0 to 100.
+ * \returns the latency in ns, or 0 if the histogram is empty.
+ */
+uint64_t lat_percentile(const lat_stat_t* stat, uint32_t percent) {
+  if (stat == NULL || stat->count == 0) return 0;
+  if (percent > 100) percent = 100;
+
+  // Rank of the sample we are looking for, rounded up
+  uint64_t rank = (stat->count * percent + 99) / 100;
+  if (rank == 0) rank = 1;
+
+  uint64_t seen = 0;
+  for (int b = 0; b < LAT_NB_BUCKET; b++) {
+    seen += stat->buckets[b];
+    if (seen < rank) continue;
+    uint64_t bound = (2ULL << b) - 1;
+    if (bound > stat->max_ns) bound = stat->max_ns;
+    if (bound < stat->min_ns) bound = stat->min_ns;
+    return bound;
+  }
+  return stat->max_ns;
+}
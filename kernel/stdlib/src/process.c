@@ -15,4 +15,32 @@ bool exec(const char* exe_name) { return syscall(SYSCALL_EXEC, exe_name); }
  * Hanlder to exit the current process and invoke shell exec.
  * \returns true if the function is executed successfully, else return falses.
  */
-bool exit() { return syscall(SYSCALL_EXIT); }
\ No newline at end of file
+bool exit() { return syscall(SYSCALL_EXIT); }
+
+/**
+ * Get the pid of the calling process.
+ * \returns the pid of the calling process.
+ */
+int64_t getpid() { return syscall(SYSCALL_GETPID); }
+
+/**
+ * Take a snapshot of every process, including the ones that exited recently.
+ * \param stats Array to be filled.
+ * \param max_proc Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t procstat(proc_stat_t* stats, size_t max_proc) {
+  if (stats == NULL) return -1;
+  return syscall(SYSCALL_PROCSTAT, stats, max_proc);
+}
+
+/**
+ * Read the call counters of every system call.
+ * \param stats Array to be filled, one entry per system call.
+ * \param max_stat Number of entries in stats (NB_SYSCALL is enough).
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t syscallstat(syscall_stat_t* stats, size_t max_stat) {
+  if (stats == NULL) return -1;
+  return syscall(SYSCALL_SYSCALLSTAT, stats, max_stat);
+}
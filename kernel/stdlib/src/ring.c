@@ -0,0 +1,188 @@
+#include "ring.h"
+
+// External functions for system call handler. syscall(uint64_t nr, ...) is
+// defined in asm/syscall.s
+extern int64_t syscall(uint64_t nr, ...);
+
+/******************************************************************************/
+/**
+ * Empty both queues of a ring.
+ * \param ring The ring.
+ */
+void ring_init(syscall_ring_t* ring) {
+  ring->sq_head = 0;
+  ring->sq_tail = 0;
+  ring->cq_head = 0;
+  ring->cq_tail = 0;
+}
+
+/**
+ * Queue a system call. Nothing runs until ring_enter().
+ * \param ring The ring.
+ * \param nr System call number (SYSCALL_*). exec, exit and ring_enter itself
+ * are refused and complete with -1.
+ * \param user_data Value copied to the completion.
+ * \param arg0,arg1,arg2,arg3,arg4,arg5 Arguments of the system call.
+ * \returns true if the entry is queued, false if the submission queue is full.
+ */
+bool ring_prep(syscall_ring_t* ring, uint64_t nr, uint64_t user_data,
+               uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+               uint64_t arg4, uint64_t arg5) {
+  uint32_t tail = ring->sq_tail;
+  if (tail - ring->sq_head >= RING_SIZE) return false;
+
+  ring_sqe_t* sqe = &ring->sqes[tail & RING_MASK];
+  sqe->nr = nr;
+  sqe->args[0] = arg0;
+  sqe->args[1] = arg1;
+  sqe->args[2] = arg2;
+  sqe->args[3] = arg3;
+  sqe->args[4] = arg4;
+  sqe->args[5] = arg5;
+  sqe->user_data = user_data;
+  ring->sq_tail = tail + 1;
+  return true;
+}
+
+/**
+ * Queue a write (see printf()).
+ * \param ring The ring.
+ * \param f_descriptor STD_OUT or STD_ERR.
+ * \param str Characters to be written. Must stay valid until ring_enter().
+ * \param size Number of characters.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_write(syscall_ring_t* ring, uint64_t f_descriptor,
+                     const char* str, size_t size, uint64_t user_data) {
+  return ring_prep(ring, SYSCALL_WRITE, user_data, f_descriptor,
+                   (uint64_t)str, size, 0, 0, 0);
+}
+
+/**
+ * Queue the mapping of one page (see mmap()).
+ * \param ring The ring.
+ * \param address Virtual address of the page.
+ * \param read,write,exec Protection of the page.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_mmap(syscall_ring_t* ring, void* address, bool read, bool write,
+                    bool exec, uint64_t user_data) {
+  return ring_prep(ring, SYSCALL_MMAP, user_data, (uint64_t)address, read,
+                   write, exec, 0, 0);
+}
+
+/**
+ * Queue a sleep of CLOCK_MONOTONIC (see clock_nanosleep()).
+ * \param ring The ring.
+ * \param flags 0, or TIMER_ABSTIME if ns is a deadline.
+ * \param ns Duration, or deadline in ns since boot.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_sleep(syscall_ring_t* ring, int flags, uint64_t ns,
+                     uint64_t user_data) {
+  return ring_prep(ring, SYSCALL_CLOCK_NANOSLEEP, user_data, CLOCK_MONOTONIC,
+                   (uint64_t)flags, ns, 0, 0, 0);
+}
+
+/**
+ * Queue a copy of a window to the screen (see graphic_draw()). Its position
+ * is taken now, its pixels when the entry runs.
+ * \param ring The ring.
+ * \param window The window.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_framebuffer_cpy(syscall_ring_t* ring, window_t* window,
+                               uint64_t user_data) {
+  if (window == NULL) return false;
+  return ring_prep(ring, SYSCALL_FRAMEBUFFER_CPY, user_data,
+                   (uint64_t)window->addr, (int64_t)window->screen_x,
+                   (int64_t)window->screen_y, (int64_t)window->width,
+                   (int64_t)window->height, (int64_t)window->flip);
+}
+
+/**
+ * Queue a clear of the screen (see graphic_clear_screen()).
+ * \param ring The ring.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_framebuffer_clear(syscall_ring_t* ring, uint64_t user_data) {
+  return ring_prep(ring, SYSCALL_FRAMEBUFFER_CLEAR, user_data, 0, 0, 0, 0, 0,
+                   0);
+}
+
+/**
+ * Queue a present of the screen (see graphic_present()).
+ * \param ring The ring.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_present(syscall_ring_t* ring, uint64_t user_data) {
+  return ring_prep(ring, SYSCALL_PRESENT, user_data, 0, 0, 0, 0, 0, 0);
+}
+
+/**
+ * Queue a flip of the screen (see graphic_flip()).
+ * \param ring The ring.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_flip(syscall_ring_t* ring, uint64_t user_data) {
+  return ring_prep(ring, SYSCALL_FLIP, user_data, 0, 0, 0, 0, 0, 0);
+}
+
+/**
+ * Queue a draw of a window (see graphic_draw()). An attached window is
+ * composed from its damage; the window must not be drawn to until the ring is
+ * entered. Any other window is copied whole.
+ * \param ring The ring.
+ * \param window The window.
+ * \param user_data Value copied to the completion.
+ * \returns true if the entry is queued, else returns false.
+ */
+bool ring_prep_draw(syscall_ring_t* ring, window_t* window,
+                    uint64_t user_data) {
+  if (window == NULL) return false;
+  if (window->surface < 0) {
+    return ring_prep_framebuffer_cpy(ring, window, user_data);
+  }
+  if (!ring_prep(ring, SYSCALL_SURFACE_COMMIT, user_data,
+                 (int64_t)window->surface, (uint64_t)window->damage,
+                 (int64_t)window->nb_damage, 0, 0, 0)) {
+    return false;
+  }
+  window->nb_damage = 0;
+  return true;
+}
+
+/******************************************************************************/
+/**
+ * Run every queued entry with a single system call. Entries run in order and
+ * each one writes a completion. The kernel stops early if the completion
+ * queue is full; the rest stays queued for the next call.
+ * \param ring The ring.
+ * \returns the number of entries run, or -1 on error.
+ */
+int64_t ring_enter(syscall_ring_t* ring) {
+  if (ring == NULL) return -1;
+  return syscall(SYSCALL_RING_ENTER, ring, ring->sq_tail - ring->sq_head);
+}
+
+/**
+ * Take the oldest completion.
+ * \param ring The ring.
+ * \param cqe Filled with the completion.
+ * \returns true if there was one, else returns false.
+ */
+bool ring_get_cqe(syscall_ring_t* ring, ring_cqe_t* cqe) {
+  uint32_t head = ring->cq_head;
+  if (head == ring->cq_tail) return false;
+
+  *cqe = ring->cqes[head & RING_MASK];
+  ring->cq_head = head + 1;
+  return true;
+}
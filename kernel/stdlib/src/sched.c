@@ -0,0 +1,56 @@
+#include "sched.h"
+
+// External functions for system call handler. syscall(uint64_t nr, ...) is
+// defined in asm/syscall.s
+extern int64_t syscall(uint64_t nr, ...);
+
+/**
+ * Restrict the task with the given pid to the CPUs in mask.
+ * \param pid Pid of the task. 0 means the calling process.
+ * \param mask Set of allowed CPUs.
+ * \returns true if the affinity is changed, else returns false.
+ */
+bool sched_setaffinity(int64_t pid, cpu_mask_t mask) {
+  return (bool)syscall(SYSCALL_SCHED_SETAFFINITY, pid, mask);
+}
+
+/**
+ * Read the CPU affinity of the task with the given pid.
+ * \param pid Pid of the task. 0 means the calling process.
+ * \returns the set of allowed CPUs, or 0 if the task does not exist.
+ */
+cpu_mask_t sched_getaffinity(int64_t pid) {
+  return (cpu_mask_t)syscall(SYSCALL_SCHED_GETAFFINITY, pid);
+}
+
+/**
+ * Read the run queue counters of every CPU.
+ * \param stats Array to be filled, one entry per CPU.
+ * \param max_cpu Number of entries in stats.
+ * \returns the number of entries written, or -1 on error.
+ */
+int64_t sched_get_stat(runqueue_stat_t* stats, size_t max_cpu) {
+  if (stats == NULL) return -1;
+  return syscall(SYSCALL_SCHED_STAT, stats, max_cpu);
+}
+
+/**
+ * Ask for periodic scheduling: the caller is woken at the start of every
+ * period and runs ahead of best-effort work. Typical use is one period per
+ * frame, e.g. 16666667 ns with a budget of 10000000 ns.
+ * \param pid Pid of the task. Only 0 (the calling process) is supported.
+ * \param period_ns Length of a period in nanoseconds. 0 goes back to the normal
+ * class.
+ * \param budget_ns Run time needed per period in nanoseconds.
+ * \returns true if the request is admitted, else returns false.
+ */
+bool sched_setdeadline(int64_t pid, uint64_t period_ns, uint64_t budget_ns) {
+  return (bool)syscall(SYSCALL_SCHED_SETDEADLINE, pid, period_ns, budget_ns);
+}
+
+/**
+ * Finish the work of the current period and sleep until the next one.
+ * \returns the number of deadlines missed so far, or -1 if the caller did not
+ * call sched_setdeadline().
+ */
+int64_t sched_wait_period() { return syscall(SYSCALL_SCHED_WAIT_PERIOD); }
@@ -1,7 +1,96 @@
 #include "time.h"
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <system.h>
+
+// External functions for system call handler. syscall(uint64_t nr, ...) is
+// defined in asm/syscall.s
+extern int64_t syscall(uint64_t nr, ...);
+
+// Convert a timespec to ns. Returns false if it is not a valid time.
+bool timespec_to_ns(const timespec_t* ts, uint64_t* ns) {
+  if (ts == NULL || ts->tv_sec < 0 || ts->tv_nsec < 0 ||
+      ts->tv_nsec >= (int64_t)NS_PER_SEC) {
+    return false;
+  }
+  // Clamp before multiplying so a far-off tv_sec sleeps "forever" rather than
+  // wrapping around to a short sleep.
+  if (ts->tv_sec >= INT64_MAX / (int64_t)NS_PER_SEC) {
+    *ns = INT64_MAX;
+    return true;
+  }
+  *ns = ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+  return true;
+}
+
+/**
+ * Read the 64-bit time stamp counter.
+ * \returns the number of TSC cycles since reset.
+ */
 uint64_t get_time() {
-  uint64_t msr;
-  __asm__("rdtsc\n" : "=a"(msr));
-  return msr;
-}
\ No newline at end of file
+  uint32_t low, high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Nanoseconds elapsed since boot, computed from the time page without entering
+ * the kernel.
+ * \returns the monotonic time in nanoseconds.
+ */
+uint64_t clock_ns() {
+  const vdso_time_t* page = (const vdso_time_t*)USER_VDSO;
+  uint32_t seq;
+  uint64_t tsc_boot, mult, tsc;
+  // Retry if the kernel updated the page while we were reading it
+  do {
+    seq = page->seq;
+    __asm__ volatile("" ::: "memory");
+    tsc_boot = page->tsc_boot;
+    mult = page->tsc_to_ns_mult;
+    tsc = get_time();
+    __asm__ volatile("" ::: "memory");
+  } while ((seq & 1) || seq != page->seq);
+  return (uint64_t)(((unsigned __int128)(tsc - tsc_boot) * mult) >> 32);
+}
+
+/**
+ * Read a clock. Only CLOCK_MONOTONIC (time since boot) is supported.
+ * \param clock_id The clock to read.
+ * \param ts Filled with the current time.
+ * \returns 0 on success, or -1 if the clock is unknown or ts is NULL.
+ */
+int clock_gettime(int clock_id, timespec_t* ts) {
+  if (clock_id != CLOCK_MONOTONIC || ts == NULL) return -1;
+  uint64_t ns = clock_ns();
+  ts->tv_sec = ns / NS_PER_SEC;
+  ts->tv_nsec = ns % NS_PER_SEC;
+  return 0;
+}
+
+/**
+ * Block the calling process for at least a given duration. The CPU halts or
+ * runs other programs in the meantime.
+ * \param req Duration to sleep.
+ * \returns 0 on success, or -1 if req is invalid.
+ */
+int nanosleep(const timespec_t* req) {
+  uint64_t ns;
+  if (!timespec_to_ns(req, &ns)) return -1;
+  return syscall(SYSCALL_NANOSLEEP, ns);
+}
+
+/**
+ * Block the calling process on a clock. With TIMER_ABSTIME, req is the time to
+ * wake up at, so a periodic loop does not drift.
+ * \param clock_id The clock, only CLOCK_MONOTONIC is supported.
+ * \param flags 0 or TIMER_ABSTIME.
+ * \param req Duration, or deadline with TIMER_ABSTIME.
+ * \returns 0 on success, or -1 on error.
+ */
+int clock_nanosleep(int clock_id, int flags, const timespec_t* req) {
+  uint64_t ns;
+  if (!timespec_to_ns(req, &ns)) return -1;
+  return syscall(SYSCALL_CLOCK_NANOSLEEP, clock_id, flags, ns);
+}
@@ -0,0 +1,36 @@
+.global syscall
+.global syscall_int80
+
+# This function is called to issue a system call with the SYSCALL instruction
+# Arguments are:
+#  syscall number (in %rdi)
+#  syscall arg0 (in %rsi)
+#  syscall arg1 (in %rdx)
+#  syscall arg2 (in %rcx)
+#  syscall arg3 (in %r8)
+#  syscall arg4 (in %r9)
+#  syscall arg5 (at 0x8(%rsp))
+syscall:
+  # SYSCALL overwrites %rcx with the return address, so pass arg2 in %r10
+  mov %rcx, %r10
+
+  # Pull argument 5 up into %rax
+  mov 0x8(%rsp), %rax
+
+  # Enter the kernel through the fast path
+  syscall
+
+  # Return from the function
+  retq
+
+# Same as syscall, but through the interrupt 0x80 gate. Kept for compatibility
+# and to compare both paths.
+syscall_int80:
+  # Pull argument 5 up into %rax
+  mov 0x8(%rsp), %rax
+
+  # Trigger the system call interrupt
+  int $0x80
+
+  # Return from the function
+  retq
@@ -0,0 +1,130 @@
+#include <mem.h>
+#include <process.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <system.h>
+
+// Refresh the table once per second
+#define REFRESH_PERIOD_NS 1000000000
+#define REFRESH_BUDGET_NS 20000000
+#define NS_PER_MS 1000000
+
+// Two snapshots: CPU usage is the difference between them
+proc_stat_t stats[MAX_NB_PROCESS];
+proc_stat_t prev_stats[MAX_NB_PROCESS];
+int64_t nb_stats = 0;
+int64_t nb_prev_stats = 0;
+
+const char* state_names[] = {"unused", "ready", "run", "sleep", "exited"};
+
+// Print n spaces
+void pad(int n) {
+  for (; n > 0; n--) printf(" ");
+}
+
+// Print a string left-aligned in a column of the given width
+void print_col_s(const char* str, int width) { pad(width - printf("%s", str)); }
+
+// Print a number right-aligned in a column of the given width
+void print_col_d(uint64_t value, int width) {
+  int digits = 1;
+  for (uint64_t v = value; v >= 10; v /= 10) digits++;
+  pad(width - digits);
+  printf("%d", value);
+}
+
+/**
+ * Find the previous snapshot of a process.
+ * \param pid Pid of the process.
+ * \returns pointer to the previous snapshot, or NULL if the process is new.
+ */
+proc_stat_t* find_prev(int64_t pid) {
+  for (int64_t i = 0; i < nb_prev_stats; i++) {
+    if (prev_stats[i].pid == pid) return &prev_stats[i];
+  }
+  return NULL;
+}
+
+// CPU time consumed by a process since the previous snapshot
+uint64_t cpu_delta(proc_stat_t* stat) {
+  uint64_t total = stat->utime_ns + stat->stime_ns;
+  proc_stat_t* prev = find_prev(stat->pid);
+  if (prev != NULL) total -= prev->utime_ns + prev->stime_ns;
+  return total;
+}
+
+void draw_table() {
+  // The idle tasks are included, so the sum of every delta is the wall time
+  // multiplied by the number of online CPUs
+  uint64_t total = 0;
+  for (int64_t i = 0; i < nb_stats; i++) total += cpu_delta(&stats[i]);
+  if (total == 0) total = 1;
+
+  printf("\f");
+  printf("top - %d processes (press q to quit)\n\n", nb_stats);
+  print_col_s("PID", 6);
+  print_col_s("NAME", 16);
+  print_col_s("STATE", 8);
+  print_col_s("CPU", 5);
+  print_col_s("  %CPU", 7);
+  print_col_s("   USER(ms)", 12);
+  print_col_s("    SYS(ms)", 12);
+  print_col_s("    CSW", 8);
+  print_col_s("   PF", 6);
+  printf("   MISS\n");
+
+  for (int64_t i = 0; i < nb_stats; i++) {
+    proc_stat_t* stat = &stats[i];
+    print_col_d(stat->pid, 4);
+    pad(2);
+    print_col_s(stat->name, 16);
+    print_col_s(stat->state <= PROC_STATE_EXITED ? state_names[stat->state]
+                                                 : "?",
+                8);
+    print_col_d(stat->cpu < 0 ? 0 : stat->cpu, 3);
+    pad(2);
+    print_col_d(cpu_delta(stat) * 100 / total, 6);
+    pad(1);
+    print_col_d(stat->utime_ns / NS_PER_MS, 12);
+    print_col_d(stat->stime_ns / NS_PER_MS, 12);
+    print_col_d(stat->nr_switch, 8);
+    print_col_d(stat->nr_page_fault, 6);
+    if (stat->sched_class == SCHED_DEADLINE) {
+      print_col_d(stat->dl_nr_missed, 7);
+    } else {
+      printf("      -");
+    }
+    printf("\n");
+  }
+}
+
+void _start() {
+  // Wake up once per refresh period instead of polling the clock
+  sched_setdeadline(0, REFRESH_PERIOD_NS, REFRESH_BUDGET_NS);
+
+  while (true) {
+    nb_stats = procstat(stats, MAX_NB_PROCESS);
+    if (nb_stats < 0) {
+      perror("[ERROR] top: Unable to read process statistics.\n");
+      exit();
+    }
+    draw_table();
+
+    // Keep this snapshot to compute the next CPU usage
+    memcpy(prev_stats, stats, nb_stats * sizeof(proc_stat_t));
+    nb_prev_stats = nb_stats;
+
+    char c;
+    while ((c = peekc()) != '\0') {
+      if (c == 'q') exit();
+    }
+    sched_wait_period();
+  }
+
+  // Loop forever
+  for (;;) {
+  }
+}